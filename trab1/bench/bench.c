@@ -0,0 +1,680 @@
+/**
+ * Microbenchmarks for the frame codec primitives of linklayer.c
+ *
+ * linklayer.c is included directly so its static functions (stuff(),
+ * generateBcc(), buildIFrame(), readCMD(), ...) can be measured without
+ * changing their linkage. Every malloc() done by the link layer goes through
+ * benchMalloc() so allocations per frame can be reported, and every read()
+ * of the serial port goes through benchRead() so the loopback benchmark can
+ * report read() calls per frame for each VMIN/VTIME setting.
+ */
+
+#define _XOPEN_SOURCE 600 // posix_openpt
+#define _DEFAULT_SOURCE
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <signal.h>
+#include <string.h>
+#include <strings.h>
+#include <stdio.h>
+#include <termios.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/time.h>
+#include <time.h>
+
+static size_t benchAllocations = 0;
+
+static void * benchMalloc(size_t size) {
+    ++benchAllocations;
+    return malloc(size);
+}
+
+static size_t benchReads = 0;
+
+static ssize_t benchRead(int fd, void * buffer, size_t size) {
+    ++benchReads;
+    return read(fd, buffer, size);
+}
+
+#undef _XOPEN_SOURCE // Redefinidos pelo linklayer.c
+#undef _DEFAULT_SOURCE
+#define malloc(size) benchMalloc(size)
+#define read(fd, buffer, size) benchRead(fd, buffer, size)
+#include "../src/linklayer.c"
+#undef malloc
+#undef read
+
+#define BENCH_PACKET_SIZE 1024
+#define BENCH_MIN_ITERATIONS 16
+#define BENCH_MIN_NANOSECONDS 200000000L // 0.2s por caso
+#define LOOPBACK_MIN_FRAMES 4
+#define FUZZ_STREAMS 2000
+#define FUZZ_STREAM_SIZE 8192
+#define FUZZ_PAYLOAD_SIZE 64
+#define FEC_FUZZ_BLOCKS 500 // Por número de raízes
+#define FEC_FUZZ_PAYLOAD_SIZE 1024
+
+typedef struct {
+    State state;
+    bool stuffing;
+    uint8_t C;
+    uint8_t BCC1;
+    uint8_t BCC2;
+    uint8_t frame[FUZZ_PAYLOAD_SIZE + 6];
+    size_t frameLength;
+} ReferenceParser;
+
+typedef struct {
+    size_t end;
+    uint8_t C;
+    size_t frameLength;
+    uint8_t frame[FUZZ_PAYLOAD_SIZE + 6];
+} FrameEvent;
+
+typedef struct {
+    char const * name;
+    unsigned int percent; // Percentagem de bytes F/ESC no payload
+} Density;
+
+typedef struct {
+    char const * name;
+    unsigned char vmin;
+    unsigned char vtime;
+} ReadMode;
+
+static const Density densities[] = {
+    { "0%", 0 }, { "1%", 1 }, { "50%", 50 }, { "100%", 100 }
+};
+
+static const ReadMode readModes[] = {
+    { "VMIN=0 VTIME=1", 0, 1 }, { "VMIN=1 VTIME=0", 1, 0 }, { "VMIN=255 VTIME=1", 255, 1 }
+};
+
+static uint32_t rngState = 0x2545F491;
+
+static uint32_t nextRandom(void) {
+    rngState ^= rngState << 13;
+    rngState ^= rngState >> 17;
+    rngState ^= rngState << 5;
+    return rngState;
+}
+
+static long nanoseconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+/**
+ * @desc Gera um payload em que percent% dos bytes são F ou ESC (alternados)
+ */
+static void fillPayload(uint8_t * payload, size_t size, unsigned int percent) {
+    size_t i;
+    uint8_t ch;
+
+    for (i = 0; i < size; ++i) {
+        do {
+            ch = (uint8_t) nextRandom();
+        } while (ch == F || ch == ESC);
+        payload[i] = ch;
+    }
+
+    size_t special = size * percent / 100;
+    for (i = 0; i < special; ++i) {
+        size_t pos = (percent == 100) ? i : nextRandom() % size;
+        payload[pos] = (i & 1) ? ESC : F;
+    }
+}
+
+/**
+ * @desc readCMD() original (switch por byte), usado como referência no teste de
+ * equivalência do parseFrame(). Única diferença: o overflow da trama I também
+ * limpa o stuffing pendente, que antes transitava para a trama seguinte.
+ * @return true nos mesmos bytes em que o readCMD original retornava true
+ */
+static bool referenceParseByte(ReferenceParser * p, uint8_t ch) {
+    uint8_t temp;
+
+    switch (p->state) {
+    case START:
+        if (ch == F)
+            p->state = F_RCV;
+        break;
+    case F_RCV:
+        if (ch == A_CSENDER_RRECEIVER) {
+            p->state = A_RCV;
+            p->BCC1 = ch;
+        } else if (ch != F)
+            p->state = START;
+        break;
+    case A_RCV:
+        if (ch == F)
+            p->state = F_RCV;
+        else {
+            if (isCMD(ch) || isCMDI(ch)) {
+                p->BCC1 ^= ch;
+                p->C = ch;
+                p->state = C_RCV;
+            } else
+                p->state = START;
+        }
+        break;
+    case C_RCV:
+        if (p->stuffing) {
+            p->stuffing = false;
+            if ((ch ^ STUFFING_XOR_BYTE) == p->BCC1)
+                p->state = BCC_OK;
+            else
+                p->state = START;
+        } else if (ch == ESC) {
+            p->stuffing = true;
+        } else if (ch == p->BCC1) {
+            p->state = BCC_OK;
+        } else if (ch == F)
+            p->state = F_RCV;
+        else
+            p->state = START;
+        break;
+    case BCC_OK:
+        if (ch == F && isCMD(p->C)) {
+            return true;
+        } else if (isCMDI(p->C) && (ch != F) && linkLayer.is_receiver) {
+            p->frame[p->frameLength++] = F;
+            p->frame[p->frameLength++] = A_CSENDER_RRECEIVER;
+            p->frame[p->frameLength++] = p->C;
+            p->frame[p->frameLength++] = p->BCC1;
+            if ( ch == ESC ) {
+                p->stuffing = true;
+                p->BCC2 = 0x00;
+            } else {
+                p->frame[p->frameLength++] = ch;
+                p->BCC2 = ch;
+            }
+            p->state = RCV_I;
+        } else
+            p->state = START;
+        break;
+    case RCV_I:
+        if (p->frameLength >= (linkLayer.settings->payloadSize + 6)) {
+            p->frameLength = 0;
+            p->stuffing = false;
+            if (ch == F)
+                p->state = F_RCV;
+            else
+                p->state = START;
+        } else if ( (ch == F) && p->stuffing ) {
+            p->state = F_RCV;
+            p->frameLength = 0;
+            p->stuffing = false;
+        } else if (ch == F) {
+            p->BCC2 ^= p->frame[p->frameLength - 1];
+            if (p->BCC2 == p->frame[p->frameLength - 1])
+                p->frame[p->frameLength++] = ch;
+            return true;
+        } else if (p->stuffing) {
+            p->stuffing = false;
+            temp = ch ^ STUFFING_XOR_BYTE;
+            p->frame[p->frameLength++] = temp;
+            p->BCC2 ^= temp;
+        } else if (ch == ESC) {
+            p->stuffing = true;
+        } else {
+            p->BCC2 ^= ch;
+            p->frame[p->frameLength++] = ch;
+        }
+        break;
+    default:
+        break;
+    }
+    return false;
+}
+
+/**
+ * @desc Gera uma sequência de tramas I e de supervisão válidas, truncadas,
+ * demasiado grandes e ruído, com bits trocados aleatoriamente
+ */
+static size_t buildFuzzStream(uint8_t * stream, size_t capacity) {
+    static const uint8_t commands[] = {
+        C_SET, C_UA, C_DISC, C_RR_RAW, C_RR_RAW | 0x80, C_REJ_RAW, C_REJ_RAW | 0x80
+    };
+    uint8_t payload[FUZZ_PAYLOAD_SIZE + 8];
+    size_t size = 0, pieceSize, i;
+    uint8_t * piece;
+
+    while (size < capacity - 2 * sizeof(payload) - 16) {
+        switch (nextRandom() % 4) {
+        case 0:
+        case 1:
+            pieceSize = 1 + nextRandom() % sizeof(payload);
+            fillPayload(payload, pieceSize, nextRandom() % 101);
+            linkLayer.sequenceNumber = (int) (nextRandom() & 1);
+            piece = buildIFrame(payload, pieceSize, &pieceSize);
+            break;
+        case 2:
+            piece = buildFrameHeader(A_CSENDER_RRECEIVER,
+                    commands[nextRandom() % sizeof(commands)], &pieceSize, false);
+            break;
+        default:
+            piece = NULL;
+            pieceSize = nextRandom() % 8;
+            for (i = 0; i < pieceSize; ++i)
+                stream[size + i] = (uint8_t) nextRandom();
+            break;
+        }
+        if (piece != NULL) {
+            if (nextRandom() % 8 == 0) // Trama truncada
+                pieceSize = nextRandom() % pieceSize;
+            memcpy(stream + size, piece, pieceSize);
+            free(piece);
+        }
+        size += pieceSize;
+    }
+
+    for (i = nextRandom() % 4; i > 0; --i)
+        stream[nextRandom() % size] ^= (uint8_t) (1 << (nextRandom() % 8));
+
+    return size;
+}
+
+/**
+ * @desc Compara o parseFrame() com o readCMD() original sobre sequências
+ * aleatórias, entregues ao parseFrame() em blocos de tamanho aleatório
+ * @return 0 se os dois parsers produzirem exatamente as mesmas tramas
+ */
+static int fuzzParser(void) {
+    static uint8_t stream[FUZZ_STREAM_SIZE];
+    static FrameEvent events[FUZZ_STREAM_SIZE];
+    static ReferenceParser reference;
+    unsigned int payloadSize = linkLayer.settings->payloadSize;
+    size_t maxFrameLength = linkLayer.maxFrameLength;
+    size_t numEvents, event, size, i, chunk, consumed, frames = 0;
+    unsigned int n;
+    FrameParser parser;
+    uint8_t C;
+
+    linkLayer.settings->payloadSize = FUZZ_PAYLOAD_SIZE;
+    linkLayer.maxFrameLength = FUZZ_PAYLOAD_SIZE + 6; // O parseFrame usa este, calculado no llinitialize
+
+    for (n = 0; n < FUZZ_STREAMS; ++n) {
+        size = buildFuzzStream(stream, sizeof(stream));
+        linkLayer.is_receiver = (n % 4 != 0);
+
+        numEvents = 0;
+        reference.state = START;
+        reference.stuffing = false;
+        reference.frameLength = 0;
+        for (i = 0; i < size; ++i) {
+            if (referenceParseByte(&reference, stream[i])) {
+                events[numEvents].end = i + 1;
+                events[numEvents].C = reference.C;
+                events[numEvents].frameLength = reference.frameLength;
+                memcpy(events[numEvents].frame, reference.frame, reference.frameLength);
+                ++numEvents;
+                reference.state = START;
+                reference.stuffing = false;
+                reference.frameLength = 0;
+            }
+        }
+
+        event = 0;
+        parser.state = START;
+        parser.C = &C;
+        linkLayer.frameLength = 0;
+        for (i = 0; i < size; i += consumed) {
+            chunk = 1 + nextRandom() % 300;
+            if (chunk > size - i)
+                chunk = size - i;
+            if (!parseFrame(&parser, stream + i, chunk, &consumed))
+                continue;
+            if (event == numEvents || events[event].end != i + consumed
+                    || events[event].C != C
+                    || events[event].frameLength != linkLayer.frameLength
+                    || memcmp(events[event].frame, linkLayer.frame, linkLayer.frameLength) != 0) {
+                printf("fuzz: stream %u diverges from the reference parser at byte %lu\n",
+                        n, i + consumed);
+                return -1;
+            }
+            ++event;
+            parser.state = START;
+            linkLayer.frameLength = 0;
+        }
+        if (event != numEvents) {
+            printf("fuzz: stream %u missed %lu frames\n", n, numEvents - event);
+            return -1;
+        }
+        frames += numEvents;
+    }
+
+    printf("fuzz: %d streams, %lu frames, parseFrame matches the reference parser\n",
+            FUZZ_STREAMS, frames);
+    linkLayer.settings->payloadSize = payloadSize;
+    linkLayer.maxFrameLength = maxFrameLength;
+    linkLayer.is_receiver = true;
+    return 0;
+}
+
+/**
+ * @desc Estraga bytes do bloco, nunca deixando um igual
+ */
+static void corrupt(uint8_t * block, size_t position) {
+    block[position] ^= (uint8_t) (1 + nextRandom() % 255);
+}
+
+/**
+ * @desc Passa blocos aleatórios pelo fecEncode() e pelo repairFrame(), com erros
+ * até ao limite de cada palavra de código (espalhados ou num burst que atravessa
+ * o entrelaçamento) e, a partir de 16 raízes, com um erro a mais em todas as palavras
+ * @return 0 se os blocos dentro do limite voltarem intactos e os outros forem recusados
+ */
+static int fuzzFec(void) {
+    static const unsigned int rootsList[] = {2, 8, 16, 32};
+    static uint8_t payload[FEC_FUZZ_PAYLOAD_SIZE];
+    static uint8_t frame[4 + 2 * (FEC_FUZZ_PAYLOAD_SIZE + 1) + FEC_MAX_ROOTS];
+    unsigned int fecRoots = linkLayer.settings->fecRoots;
+    uint8_t * savedFrame = linkLayer.frame;
+    unsigned long int repaired = 0, refused = 0;
+    size_t size, encodedSize, depth, position, burst, inCodeword, c, i;
+    unsigned int r, roots, t, n, errors;
+    bool tooMany, ok;
+    int result = 0;
+
+    linkLayer.frame = frame;
+    for (r = 0; r < sizeof(rootsList) / sizeof(rootsList[0]) && result == 0; ++r) {
+        roots = rootsList[r];
+        t = roots / 2;
+        linkLayer.settings->fecRoots = roots;
+
+        for (n = 0; n < FEC_FUZZ_BLOCKS && result == 0; ++n) {
+            size = 1 + nextRandom() % FEC_FUZZ_PAYLOAD_SIZE;
+            for (i = 0; i < size; ++i)
+                payload[i] = (uint8_t) nextRandom();
+
+            // Corpo da trama como o buildIFrame() o faz: payload, BCC2 e paridade
+            memcpy(frame + 4, payload, size);
+            frame[4 + size] = generateBcc(payload, size);
+            encodedSize = fecEncodedSize(size + 1, roots);
+            fecEncode(frame + 4, size + 1, roots, frame + 4 + size + 1);
+            depth = (encodedSize - (size + 1)) / roots;
+
+            // O byte p do bloco é da palavra p % depth, incluindo a paridade.
+            // Com poucas raízes uma palavra a mais pode ser mal corrigida, só se testa a recusa a partir de 16
+            tooMany = (roots >= 16 && n % 4 == 3);
+            if (tooMany) {
+                burst = depth * (t + 1); // t + 1 erros em todas as palavras
+                position = nextRandom() % (encodedSize - burst + 1);
+                for (i = 0; i < burst; ++i)
+                    corrupt(frame + 4, position + i);
+            } else if (n % 2 == 0) {
+                burst = 1 + nextRandom() % (depth * t); // Nunca mais de t numa palavra
+                position = nextRandom() % (encodedSize - burst + 1);
+                for (i = 0; i < burst; ++i)
+                    corrupt(frame + 4, position + i);
+            } else {
+                for (c = 0; c < depth; ++c) {
+                    inCodeword = (encodedSize - c + depth - 1) / depth;
+                    errors = nextRandom() % (t + 1); // Repetidos só estragam menos
+                    for (i = 0; i < errors; ++i)
+                        corrupt(frame + 4, c + depth * (nextRandom() % inCodeword));
+                }
+            }
+
+            linkLayer.frameLength = 4 + encodedSize;
+            ok = repairFrame();
+            if (tooMany) {
+                if (ok) {
+                    printf("fec: %u roots, block %u with %u errors per codeword was %s\n", roots, n, t + 1,
+                            memcmp(frame + 4, payload, size) != 0 ? "mis-corrected" : "accepted");
+                    result = -1;
+                } else
+                    ++refused;
+            } else {
+                if (!ok || linkLayer.frameLength != 4 + size + 1 || memcmp(frame + 4, payload, size) != 0) {
+                    printf("fec: %u roots, block %u (%lu bytes, depth %lu) was not restored\n", roots, n, size, depth);
+                    result = -1;
+                } else
+                    ++repaired;
+            }
+        }
+    }
+
+    if (result == 0)
+        printf("fec: %lu blocks restored, %lu over the limit refused\n", repaired, refused);
+    linkLayer.frame = savedFrame;
+    linkLayer.settings->fecRoots = fecRoots;
+    linkLayer.frameLength = 0;
+    return result;
+}
+
+static void report(char const * primitive, char const * density,
+        long elapsed, size_t bytes, size_t allocations, size_t frames) {
+    printf("%-12s %6s %12.3f %14.2f\n", primitive, density,
+            (double) elapsed / (double) bytes,
+            (double) allocations / (double) frames);
+}
+
+static void benchStuff(uint8_t * payload, size_t size, char const * density) {
+    size_t frames = 0, bytes = 0, stuffedSize;
+    size_t allocations = benchAllocations;
+    long start = nanoseconds(), elapsed;
+
+    do {
+        uint8_t * stuffed = stuff(payload, size, &stuffedSize);
+        free(stuffed);
+        bytes += size;
+        ++frames;
+    } while ((elapsed = nanoseconds() - start) < BENCH_MIN_NANOSECONDS
+            || frames < BENCH_MIN_ITERATIONS);
+
+    report("stuff", density, elapsed, bytes, benchAllocations - allocations, frames);
+}
+
+static void benchBcc(uint8_t * payload, size_t size, char const * density) {
+    size_t frames = 0, bytes = 0;
+    size_t allocations = benchAllocations;
+    volatile uint8_t sink = 0;
+    long start = nanoseconds(), elapsed;
+
+    do {
+        sink ^= generateBcc(payload, size);
+        bytes += size;
+        ++frames;
+    } while ((elapsed = nanoseconds() - start) < BENCH_MIN_NANOSECONDS
+            || frames < BENCH_MIN_ITERATIONS);
+
+    report("generateBcc", density, elapsed, bytes, benchAllocations - allocations, frames);
+}
+
+static void benchBuildIFrame(uint8_t * payload, size_t size, char const * density) {
+    size_t frames = 0, bytes = 0, frameSize;
+    size_t allocations = benchAllocations;
+    long start = nanoseconds(), elapsed;
+
+    do {
+        uint8_t * frame = buildIFrame(payload, size, &frameSize);
+        free(frame);
+        bytes += size;
+        ++frames;
+    } while ((elapsed = nanoseconds() - start) < BENCH_MIN_NANOSECONDS
+            || frames < BENCH_MIN_ITERATIONS);
+
+    report("buildIFrame", density, elapsed, bytes, benchAllocations - allocations, frames);
+}
+
+/**
+ * @desc Mede o readCMD() sobre tramas escritas num pipe; o descritor de leitura
+ * do pipe faz as vezes da porta série
+ */
+static void benchReadCMD(char const * primitive, uint8_t * frame, size_t frameSize,
+        size_t payloadSize, char const * density) {
+    int fds[2];
+    size_t frames = 0, bytes = 0;
+    size_t allocations;
+    long elapsed = 0, start;
+    uint8_t C;
+
+    if (pipe(fds) != 0) {
+        perror("pipe");
+        return;
+    }
+    linkLayer.serialFileDescriptor = fds[0];
+
+    allocations = benchAllocations;
+    do {
+        if (write(fds[1], frame, frameSize) != (ssize_t) frameSize) {
+            perror("write");
+            break;
+        }
+        alarmed = false;
+        start = nanoseconds();
+        if (!readCMD(&C)) {
+            fprintf(stdout, "%s: readCMD failed to decode the frame\n", primitive);
+            break;
+        }
+        elapsed += nanoseconds() - start;
+        bytes += payloadSize;
+        ++frames;
+    } while (elapsed < BENCH_MIN_NANOSECONDS || frames < BENCH_MIN_ITERATIONS);
+
+    close(fds[0]);
+    close(fds[1]);
+
+    if (frames != 0)
+        report(primitive, density, elapsed, bytes, benchAllocations - allocations, frames);
+}
+
+/**
+ * @desc Mede o readCMD() numa porta configurada pelo configurePort() (slave de
+ * um pseudo-terminal) com o VMIN/VTIME de mode; as tramas são escritas no master
+ */
+static void benchLoopback(const ReadMode * mode, char const * frameName,
+        uint8_t * frame, size_t frameSize) {
+    size_t frames = 0, reads;
+    long elapsed = 0, start;
+    int master, slave;
+    uint8_t C;
+
+    master = posix_openpt(O_RDWR | O_NOCTTY);
+    if (master < 0 || grantpt(master) != 0 || unlockpt(master) != 0) {
+        perror("posix_openpt");
+        return;
+    }
+    slave = open(ptsname(master), O_RDWR | O_NOCTTY);
+    if (slave < 0) {
+        perror("open pty slave");
+        close(master);
+        return;
+    }
+
+    linkLayer.serialFileDescriptor = slave;
+    linkLayer.settings->vmin = mode->vmin;
+    linkLayer.settings->vtime = mode->vtime;
+    if (configurePort() != 0)
+        goto cleanUp;
+
+    reads = benchReads;
+    do {
+        if (write(master, frame, frameSize) != (ssize_t) frameSize) {
+            perror("write");
+            break;
+        }
+        alarmed = false;
+        start = nanoseconds();
+        if (!readCMD(&C)) {
+            fprintf(stdout, "loopback: readCMD failed to decode the frame\n");
+            break;
+        }
+        elapsed += nanoseconds() - start;
+        ++frames;
+    } while (elapsed < BENCH_MIN_NANOSECONDS || frames < LOOPBACK_MIN_FRAMES);
+
+    if (frames != 0)
+        printf("%-18s %-8s %12.1f %12.2f\n", mode->name, frameName,
+                (double) elapsed / 1000.0 / (double) frames,
+                (double) (benchReads - reads) / (double) frames);
+
+cleanUp:
+    close(slave);
+    close(master);
+}
+
+int main(void) {
+    LinkLayerSettings settings;
+    uint8_t payload[BENCH_PACKET_SIZE];
+    size_t i, frameSize, cmdSize;
+    uint8_t * frame;
+    uint8_t * cmd;
+
+    settings.port = "bench";
+    settings.timeout = 1;
+    settings.numAttempts = 1;
+    settings.payloadSize = BENCH_PACKET_SIZE;
+    settings.baudRate = 38400;
+    settings.maxBaudRate = 0;
+    settings.vmin = 0;
+    settings.vtime = 1;
+    settings.lowLatency = false;
+    settings.hwFlowControl = false;
+    settings.fullDuplex = false;
+    settings.fecRoots = 0;
+    settings.traceFile = NULL;
+
+    // O output de debug do link layer não interessa para as medições
+    if (freopen("/dev/null", "w", stderr) == NULL)
+        return 1;
+
+    if (llinitialize(&settings, true) != 0) {
+        fprintf(stdout, "llinitialize failed\n");
+        return 1;
+    }
+
+    if (fuzzParser() != 0)
+        return 1;
+    if (fuzzFec() != 0)
+        return 1;
+
+    printf("payload: %d bytes\n", BENCH_PACKET_SIZE);
+    printf("%-12s %6s %12s %14s\n", "primitive", "F/ESC", "ns/byte", "allocs/frame");
+
+    for (i = 0; i < sizeof(densities) / sizeof(densities[0]); ++i) {
+        fillPayload(payload, sizeof(payload), densities[i].percent);
+
+        benchStuff(payload, sizeof(payload), densities[i].name);
+        benchBcc(payload, sizeof(payload), densities[i].name);
+        benchBuildIFrame(payload, sizeof(payload), densities[i].name);
+
+        frame = buildIFrame(payload, sizeof(payload), &frameSize);
+        if (frame == NULL)
+            return 1;
+        benchReadCMD("destuff", frame, frameSize, sizeof(payload), densities[i].name);
+        free(frame);
+    }
+
+    // Fase de cabeçalho isolada: sequência de tramas de supervisão
+    cmd = buildFrameHeader(A_CSENDER_RRECEIVER, C_RR_RAW | 0x80, &cmdSize, false);
+    if (cmd == NULL)
+        return 1;
+    benchReadCMD("readCMD", cmd, cmdSize, cmdSize, "-");
+
+    fillPayload(payload, sizeof(payload), 0);
+    frame = buildIFrame(payload, sizeof(payload), &frameSize);
+    if (frame == NULL)
+        return 1;
+
+    printf("\nloopback (pty)\n");
+    printf("%-18s %-8s %12s %12s\n", "read mode", "frame", "us/frame", "reads/frame");
+    for (i = 0; i < sizeof(readModes) / sizeof(readModes[0]); ++i) {
+        benchLoopback(&readModes[i], "I", frame, frameSize);
+        benchLoopback(&readModes[i], "RR", cmd, cmdSize);
+    }
+
+    free(frame);
+    free(cmd);
+
+    return 0;
+}
@@ -0,0 +1,245 @@
+/**
+ * Offline replay of a frame trace (serius -X file, or serius.trace after a
+ * failed connection)
+ *
+ * First the frame events are summed up: how many of each frame went each way,
+ * timeouts, the time between an I frame and the answer to it and the longest
+ * silence on the link. Then the received bytes in the trace are fed back
+ * through parseFrame() with the decoder settings of the run that wrote it, once
+ * to count the frames and again in a loop to measure the decoder alone.
+ *
+ * linklayer.c is included directly, like in bench.c, so parseFrame() can be
+ * called without a serial port.
+ */
+
+#define _XOPEN_SOURCE 600
+#define _DEFAULT_SOURCE
+
+#include <sys/types.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <time.h>
+
+#undef _XOPEN_SOURCE // Redefinidos pelo linklayer.c
+#undef _DEFAULT_SOURCE
+#include "../src/linklayer.c"
+
+#define REPLAY_MIN_NANOSECONDS 200000000L // 0.2s de descodificação
+#define REPLAY_MIN_ITERATIONS 4
+
+typedef struct {
+    unsigned long int commands;
+    unsigned long int framesOk;
+    unsigned long int framesBad;
+    unsigned long int payloadBytes;
+} DecodeCount;
+
+static long nanoseconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+/**
+ * @desc Nome do campo C, com o N(R)/N(S) que leva
+ */
+static void controlName(uint8_t C, char * name, size_t size) {
+    switch (C & 0x7F) {
+    case C_SET: snprintf(name, size, "SET"); return;
+    case C_UA: snprintf(name, size, "UA"); return;
+    case C_DISC: snprintf(name, size, "DISC"); return;
+    case C_BAUD: snprintf(name, size, "BAUD"); return;
+    case C_BAUD_END: snprintf(name, size, "BAUD_END"); return;
+    case C_RR_RAW: snprintf(name, size, "RR_%d", C >> 7); return;
+    case C_REJ_RAW: snprintf(name, size, "REJ_%d", C >> 7); return;
+    case C_RNR_RAW: snprintf(name, size, "RNR_%d", C >> 7); return;
+    default:
+        break;
+    }
+    if ((C & 0x3F) == C_I_RAW)
+        snprintf(name, size, "I_%d", (C >> 6) & 1);
+    else
+        snprintf(name, size, "0x%02X", C);
+}
+
+static char const * outcomeName(uint8_t outcome) {
+    switch (outcome) {
+    case TRACE_OK: return "ok";
+    case TRACE_BAD: return "bad BCC2";
+    case TRACE_REPAIRED: return "repaired";
+    case TRACE_TIMEOUT: return "timeout";
+    case TRACE_FAILED: return "write failed";
+    default: return "?";
+    }
+}
+
+static void summarizeEvents(TraceEvent const * events, uint32_t numEvents) {
+    static unsigned long int counts[2][256][TRACE_FAILED + 1];
+    unsigned long int answers = 0;
+    uint64_t gap, longestGap = 0, answerTime = 0, longestAnswer = 0;
+    uint32_t i, j, longestAt = 0;
+    unsigned int direction, C, outcome;
+    char name[16];
+
+    if (numEvents == 0) {
+        printf("no frame events\n");
+        return;
+    }
+
+    for (i = 0; i < numEvents; ++i) {
+        if (events[i].outcome <= TRACE_FAILED)
+            ++counts[events[i].direction & 1][events[i].control][events[i].outcome];
+        if (i > 0) {
+            gap = events[i].timestamp - events[i - 1].timestamp;
+            if (gap > longestGap) {
+                longestGap = gap;
+                longestAt = i;
+            }
+        }
+        // Tempo até à resposta a uma trama I enviada: próximo evento recebido que não seja timeout
+        if (events[i].direction != TRACE_TX || (events[i].control & 0x3F) != C_I_RAW)
+            continue;
+        for (j = i + 1; j < numEvents && events[j].direction == TRACE_TX; ++j)
+            ;
+        if (j < numEvents && events[j].outcome != TRACE_TIMEOUT) {
+            gap = events[j].timestamp - events[i].timestamp;
+            answerTime += gap;
+            if (gap > longestAnswer)
+                longestAnswer = gap;
+            ++answers;
+        }
+    }
+
+    printf("%u frame events over %.3f s\n\n", numEvents,
+            (double) (events[numEvents - 1].timestamp - events[0].timestamp) / 1e9);
+    printf("%-4s %-10s %-13s %10s\n", "dir", "control", "outcome", "count");
+    for (direction = 0; direction < 2; ++direction)
+        for (C = 0; C < 256; ++C)
+            for (outcome = 0; outcome <= TRACE_FAILED; ++outcome) {
+                if (counts[direction][C][outcome] == 0)
+                    continue;
+                if (outcome == TRACE_TIMEOUT)
+                    snprintf(name, sizeof(name), "-");
+                else
+                    controlName((uint8_t) C, name, sizeof(name));
+                printf("%-4s %-10s %-13s %10lu\n", direction == TRACE_TX ? "tx" : "rx", name,
+                        outcomeName((uint8_t) outcome), counts[direction][C][outcome]);
+            }
+
+    if (answers != 0)
+        printf("\nI frame to answer: %lu, average %.3f ms, longest %.3f ms\n", answers,
+                (double) answerTime / (double) answers / 1e6, (double) longestAnswer / 1e6);
+    if (events[longestAt].outcome == TRACE_TIMEOUT)
+        snprintf(name, sizeof(name), "timeout");
+    else
+        controlName(events[longestAt].control, name, sizeof(name));
+    printf("longest silence: %.3f ms, before event %u (%s %s)\n", (double) longestGap / 1e6,
+            longestAt, events[longestAt].direction == TRACE_TX ? "tx" : "rx", name);
+}
+
+/**
+ * @desc Passa os bytes todos pelo parseFrame(), como o readCMD() faz com os read()
+ */
+static void decode(uint8_t const * raw, size_t size, DecodeCount * count) {
+    FrameParser parser;
+    size_t offset = 0, consumed;
+    uint8_t C;
+
+    memset(count, 0, sizeof(*count));
+    parser.state = START;
+    parser.C = &C;
+    parser.BCC1 = 0x00;
+    parser.BCC2 = 0x00;
+    linkLayer.frameLength = 0;
+
+    while (offset < size) {
+        if (!parseFrame(&parser, raw + offset, size - offset, &consumed)) {
+            offset += consumed;
+            continue;
+        }
+        offset += consumed;
+        if (isCMD(C))
+            ++count->commands;
+        else if (linkLayer.frame[linkLayer.frameLength - 1] != F)
+            ++count->framesBad;
+        else {
+            ++count->framesOk;
+            count->payloadBytes += linkLayer.frameLength - 6;
+        }
+        // O readCMD() começa cada trama com o parser limpo
+        parser.state = START;
+        parser.BCC1 = 0x00;
+        parser.BCC2 = 0x00;
+        linkLayer.frameLength = 0;
+    }
+}
+
+int main(int argc, char ** argv) {
+    LinkLayerSettings settings;
+    TraceHeader header;
+    TraceEvent * events;
+    DecodeCount count;
+    uint8_t * raw;
+    unsigned long int rxEvents = 0;
+    long elapsed, start;
+    size_t iterations = 0;
+    uint32_t i;
+
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s TraceFile\n", argv[0]);
+        return 1;
+    }
+    if (traceload(argv[1], &header, &events, &raw) != 0) {
+        fprintf(stderr, "%s: not a trace file\n", argv[1]);
+        return 1;
+    }
+
+    printf("trace: %s, %s, payload %u, FEC %u, %s\n", argv[1], header.receiver ? "receiver" : "sender",
+            header.payloadSize, header.fecRoots, header.fullDuplex ? "full-duplex" : "half-duplex");
+    if (header.droppedEvents != 0 || header.rawStart != 0)
+        printf("ring wrapped: %lu older events and %lu older received bytes are gone\n",
+                (unsigned long int) header.droppedEvents, (unsigned long int) header.rawStart);
+    summarizeEvents(events, header.numEvents);
+
+    memset(&settings, 0, sizeof(settings));
+    settings.port = "replay";
+    settings.timeout = 1;
+    settings.numAttempts = 1;
+    settings.payloadSize = header.payloadSize;
+    settings.fullDuplex = header.fullDuplex;
+    settings.fecRoots = header.fecRoots;
+
+    // O output de debug do parser não interessa aqui
+    if (freopen("/dev/null", "w", stderr) == NULL)
+        return 1;
+    if (llinitialize(&settings, header.receiver) != 0) {
+        printf("llinitialize failed\n");
+        return 1;
+    }
+
+    decode(raw, header.rawSize, &count);
+    for (i = 0; i < header.numEvents; ++i)
+        if (events[i].direction == TRACE_RX && events[i].outcome != TRACE_TIMEOUT)
+            ++rxEvents;
+    printf("\n%u received bytes decode to %lu commands, %lu good I frames (%lu payload bytes), %lu bad I frames\n",
+            header.rawSize, count.commands, count.framesOk, count.payloadBytes, count.framesBad);
+    printf("the trace recorded %lu received frames\n", rxEvents);
+
+    if (header.rawSize != 0) {
+        start = nanoseconds();
+        do {
+            decode(raw, header.rawSize, &count);
+            ++iterations;
+            elapsed = nanoseconds() - start;
+        } while (elapsed < REPLAY_MIN_NANOSECONDS || iterations < REPLAY_MIN_ITERATIONS);
+        printf("decoder: %.2f ns/byte, %.1f MB/s\n", (double) elapsed / (double) (iterations * header.rawSize),
+                (double) (iterations * header.rawSize) * 1e3 / (double) elapsed);
+    }
+
+    free(events);
+    free(raw);
+    return 0;
+}
@@ -1,29 +1,91 @@
+#define _POSIX_C_SOURCE 200809L // posix_fallocate, futimens
+
 #include "applayer.h"
 #include "linklayer.h"
+#include "llasync.h"
+#include "delta.h"
+#include "mux.h"
+#include "stream.h"
+#include "trace.h"
 
 #include <string.h>
 #include <stdlib.h>
+#include <fcntl.h>
+#include <sys/stat.h>
 
 #define IS_RECEIVER(n) (!((n)>>4))
 #define IS_TRANSMITTER(n) ((n)>>4)
+#define IS_DUPLEX(n) ((n) == STATUS_RECEIVER_DUPLEX_FILE || (n) == STATUS_TRANSMITTER_DUPLEX_FILE)
+#define IS_DELTA(n) ((n) == STATUS_RECEIVER_DELTA || (n) == STATUS_TRANSMITTER_DELTA)
+#define USES_EXCHANGE(n) (IS_DUPLEX(n) || IS_DELTA(n)) // Os dois lados enviam pacotes, llexchange em vez de llwrite/llread
+#define NAMED_BY_START(n) ((n) == STATUS_RECEIVER_FILE_RECEIVED_NAME || IS_DUPLEX(n)) // Nome vem no C_START
 
 // Control byte types
 #define C_DATA 0x01
 #define C_START 0x02
 #define C_END 0x03
+#define C_SIGNATURE 0x04 // Delta, receptor -> emissor: tamanho e número de blocos da cópia antiga
+#define C_CHECKSUMS 0x05 // Delta, receptor -> emissor: checksums dos blocos seguintes
+#define C_COPY 0x06 // Delta, emissor -> receptor: copiar blocos da cópia antiga
+
+#define CHECKSUM_ENTRY_SIZE 12 // Fraca (4 bytes) + forte (8 bytes)
 
 // Start Packet Argument Types
 #define TYPE_FILESIZE 0
 #define TYPE_FILENAME 1
+#define TYPE_MTIME 2 // Segundos desde a época, só no C_START
+
+#define START_PACKET_MAX (3 + 255 + 2 * (2 + sizeof(long int))) // Nome, tamanho e data
+
+#define WRITE_BUFFER_MIN 4096
+#define WRITE_BUFFER_MAX (1 << 20)
 
 typedef struct {
     int sequenceNumber;
     long int fileSize;
+    FILE * fptr;
+    char * fileName;
+    bool done; // Recepção: já chegou o C_END
+    unsigned int files; // Ficheiros completos (C_END enviado ou recebido)
+    long int expectedSize; // Recepção: tamanho anunciado no C_START, -1 se não veio
+    long int mtime; // Recepção: data de modificação anunciada no C_START, 0 se não veio
+    bool buffered; // Recepção: já tem o buffer de escrita (setvbuf só antes da primeira escrita)
+    size_t bufferSize;
+    size_t pending; // Bytes no buffer de escrita ainda por despejar
+} Transfer;
+
+typedef struct {
+    Signature sig; // Blocos da cópia antiga (o receptor só usa o tamanho e o número)
+    bool ready; // Emissor: já chegaram as checksums todas
+    FILE * basis; // Receptor: cópia antiga, NULL se não existir
+    char * tempName; // Receptor: ficheiro novo, renomeado no fim
+    long int literal; // Bytes enviados tal e qual
+    long int copied; // Bytes copiados da cópia antiga
+} Delta;
+
+typedef enum {
+    SOURCE_START, SOURCE_DATA, SOURCE_END, SOURCE_DONE
+} SourceStage;
+
+typedef struct {
+    Transfer transfer;
+    SourceStage stage;
+} MuxSource; // Ficheiro enviado num canal do multiplexer
+
+typedef struct {
+    Transfer tx; // O que este lado envia
+    Transfer rx; // O que este lado recebe
+    Transfer channels[MUX_MAX_CHANNELS]; // Recepção multiplexada: um ficheiro por canal
+    int channel; // Canal do pacote a ser tratado, -1 fora do multiplexer
+    Delta delta;
     AppLayerSettings * settings;
+    size_t maxPacketSize; // Maior pacote que cabe numa trama I (payloadSize do link layer)
 } AppLayer;
 
 AppLayer appLayer;
 
+static char writeBuffer[WRITE_BUFFER_MAX]; // Buffer do ficheiro recebido, só há um aberto de cada vez
+
 /**
  * @desc Faz parser do pacote recebido
  * @arg uint8_t* packet: pacote recebido
@@ -43,6 +105,25 @@ static int read(void);
  */
 static int writeStartPacket(void);
 
+/**
+ * @desc Constrói o pacote de controlo do tipo START de um ficheiro
+ * @arg uint8_t *packet: com espaço para maxSize bytes
+ * @arg size_t maxSize: maior pacote que a ligação aceita, o tamanho e a data ficam de fora se não couberem
+ * @return Retorna o tamanho do pacote, 0 se o nome do ficheiro não for válido ou não couber
+ */
+static size_t buildStartPacket(Transfer *transfer, uint8_t *packet, size_t maxSize);
+
+/**
+ * @desc Constrói o pacote de controlo do tipo END de um ficheiro
+ * @return Retorna o tamanho do pacote
+ */
+static size_t buildEndPacket(Transfer *transfer, uint8_t *packet);
+
+/**
+ * @desc Escreve os 4 bytes de cabeçalho de um pacote de dados (C, N, L2, L1)
+ */
+static void putDataHeader(Transfer *transfer, uint8_t *packet, size_t size);
+
 /**
  * @desc Envia pacote de controlo do tipo END contendo apenas o byte de controlo correspondendo a type end
  * @return Retorna um número positivo em caso de sucesso e negatio em caso de erro
@@ -62,6 +143,120 @@ static int writeDataPacket(uint8_t *data, size_t size);
  */
 static int write(void);
 
+/**
+ * @desc Envia todos os ficheiros do lote na mesma ligação, cada um com o seu C_START/C_DATA/C_END
+ * @return Retorna 0 em caso de sucesso e -1 em caso de erro
+ */
+static int writeBatch(void);
+
+/**
+ * @desc Envia os ficheiros ao mesmo tempo, cada um no seu canal do multiplexer
+ * @return Retorna 0 em caso de sucesso e -1 em caso de erro
+ */
+static int writeMux(void);
+
+/**
+ * @desc MuxProducer dos ficheiros: START, os DATA e o END de um MuxSource
+ */
+static int produceMuxPacket(void *context, uint8_t *packet, size_t *size);
+
+/**
+ * @desc Trata um pacote multiplexado com o estado (Transfer) do seu canal
+ * @return Retorna 0 em caso de sucesso e -1 em caso de erro
+ */
+static int parserChannelPacket(uint8_t *packet, size_t size);
+
+/**
+ * @desc Fecha os ficheiros dos canais recebidos
+ */
+static void closeChannels(void);
+
+/**
+ * @desc Cria as pastas de um nome recebido no C_START (lote enviado com -W)
+ * @arg char *fileName: nome recebido, relativo à pasta actual
+ * @return Retorna 0 em caso de sucesso e -1 se o nome sair da pasta actual ou não der para criar as pastas
+ */
+static int makeParents(char *fileName);
+
+/**
+ * @desc Envia um pacote; em full-duplex trata os pacotes que chegarem enquanto
+ * espera pela confirmação
+ * @return Retorna 0 em caso de sucesso e -1 em caso de erro
+ */
+static int sendPacket(uint8_t *packet, size_t size);
+
+/**
+ * @desc Full-duplex: envia o ficheiro enquanto recebe o do outro lado
+ */
+static int exchange(void);
+
+/**
+ * @desc Trata os pacotes que chegarem até flag ficar a true
+ * @arg bool const *flag: posto a true pelo parserPacket
+ * @return Retorna 0 em caso de sucesso e -1 se a ligação cair antes
+ */
+static int receiveUntil(bool const *flag);
+
+/**
+ * @desc Quem respondeu ao SET espera pelo DISC, como no llread
+ * @return Retorna 0 em caso de sucesso e -1 em caso de erro
+ */
+static int waitDisconnect(void);
+
+/**
+ * @desc Delta, receptor: envia as checksums dos blocos da cópia antiga e reconstrói o
+ * ficheiro a partir dos C_COPY e C_DATA do emissor
+ * @return Retorna 0 em caso de sucesso e -1 em caso de erro
+ */
+static int readDelta(void);
+
+/**
+ * @desc Delta, emissor: espera pelas checksums e envia só o que não está na cópia do receptor
+ * @return Retorna 0 em caso de sucesso e -1 em caso de erro
+ */
+static int writeDelta(void);
+
+/**
+ * @desc Envia em pacotes C_DATA bytes que não estão na cópia antiga
+ * @return Retorna 0 em caso de sucesso e -1 em caso de erro
+ */
+static int writeLiteral(uint8_t *data, size_t size);
+
+/**
+ * @desc Envia pacote de controlo do tipo COPY, numBlocks blocos seguidos a partir de firstBlock
+ * @return Retorna 0 em caso de sucesso e -1 em caso de erro
+ */
+static int writeCopyPacket(uint32_t firstBlock, uint32_t numBlocks);
+
+/**
+ * @desc Copia blocos da cópia antiga para o ficheiro novo (C_COPY recebido)
+ * @return Retorna 0 em caso de sucesso e -1 em caso de erro
+ */
+static int copyBlocks(uint32_t firstBlock, uint32_t numBlocks);
+
+/**
+ * @desc Fecha os ficheiros e liberta a memória do modo delta
+ * @arg bool keep: o ficheiro novo está completo, substitui a cópia antiga; se não, é apagado
+ * @return Retorna 0 em caso de sucesso e -1 se não der para substituir a cópia antiga
+ */
+static int closeDelta(bool keep);
+
+/**
+ * @desc Prepara o ficheiro recebido com o tamanho anunciado no C_START: reserva o espaço
+ * todo de uma vez (menos fragmentação) e ajusta o buffer de escrita ao tamanho
+ */
+static void prepareOutput(void);
+
+/**
+ * @desc Junta um argumento (TLV) numérico de 8 bytes ao pacote
+ * @return Retorna o número de bytes escritos
+ */
+static size_t putTlvNumber(uint8_t *packet, uint8_t type, long int value);
+
+static void putUint32(uint8_t *buffer, uint32_t value);
+
+static uint32_t getUint32(uint8_t const *buffer);
+
 
 int initAppLayer(Bundle *bundle) {
 
@@ -80,25 +275,77 @@ int initAppLayer(Bundle *bundle) {
     }
 
     appLayer.settings = &bundle->alSettings;
-    appLayer.fileSize = 0;
+    appLayer.maxPacketSize = bundle->llSettings.payloadSize;
+    memset(&appLayer.tx, 0, sizeof(appLayer.tx));
+    memset(&appLayer.rx, 0, sizeof(appLayer.rx));
+    memset(&appLayer.delta, 0, sizeof(appLayer.delta));
+    memset(appLayer.channels, 0, sizeof(appLayer.channels));
+    appLayer.channel = -1;
 
-    if ( appLayer.settings->status == STATUS_TRANSMITTER_FILE ) {
-        if ( fseek(appLayer.settings->io.fptr, 0, SEEK_END) ){
-            if ( appLayer.settings->fileName != NULL ) {
-                fprintf(stderr, "Error: Cant's find file '%s' size", appLayer.settings->fileName);
+    if ( appLayer.settings->status == STATUS_TRANSMITTER_FILE || appLayer.settings->status == STATUS_TRANSMITTER_DELTA
+            || IS_DUPLEX(appLayer.settings->status) ) {
+        appLayer.tx.fptr = appLayer.settings->io.fptr;
+        appLayer.tx.fileName = appLayer.settings->fileName;
+        if ( fseek(appLayer.tx.fptr, 0, SEEK_END) ){
+            if ( appLayer.tx.fileName != NULL ) {
+                fprintf(stderr, "Error: Cant's find file '%s' size", appLayer.tx.fileName);
             } else fprintf(stderr, "appLayer.settings->fileName is set to Null in TRANSMITTER_FILE mode");
             return -1;
         }
-        appLayer.fileSize = ftell(appLayer.settings->io.fptr);
+        appLayer.tx.fileSize = ftell(appLayer.tx.fptr);
+        // O C_START tem de caber numa trama, senão o receptor descarta-o e as tentativas esgotam-se
+        if ( appLayer.tx.fileName != NULL && 3 + strlen(appLayer.tx.fileName) + 1 > appLayer.maxPacketSize ) {
+            fprintf(stderr, "Error: fileName '%s' doesn't fit in the link payload (-f %lu)\n",
+                    appLayer.tx.fileName, appLayer.maxPacketSize);
+            return -1;
+        }
+        if ( IS_DUPLEX(appLayer.settings->status) )
+            fprintf(stderr, "Full-duplex: gonna create the received fileName when control packet start arrives\n");
     } else if (appLayer.settings->status == STATUS_RECEIVER_FILE ) {
         if ( appLayer.settings->fileName == NULL ) {
             fprintf(stderr, "appLayer.settings->fileName is set to Null in RECEIVER_FILE mode");
             return -1;
         }
+        appLayer.rx.fptr = appLayer.settings->io.fptr;
+        appLayer.rx.fileName = appLayer.settings->fileName;
+    } else if (appLayer.settings->status == STATUS_RECEIVER_DELTA ) {
+        if ( appLayer.settings->fileName == NULL ) {
+            fprintf(stderr, "appLayer.settings->fileName is set to Null in RECEIVER_DELTA mode");
+            return -1;
+        }
+        fprintf(stderr, "Delta: gonna update '%s' with what changed on the other side\n", appLayer.settings->fileName);
     } else if (appLayer.settings->status == STATUS_RECEIVER_FILE_RECEIVED_NAME ) {
         fprintf(stderr, "Gonna create fileName when control packet start arrives\n");
     } else if (appLayer.settings->status == STATUS_TRANSMITTER_STRING) {
-        appLayer.fileSize = (long int) strlen(appLayer.settings->io.chptr) + 1;
+        appLayer.tx.fileSize = (long int) strlen(appLayer.settings->io.chptr) + 1;
+    } else if (appLayer.settings->status == STATUS_TRANSMITTER_BATCH) {
+        if ( appLayer.settings->numFiles == 0 ) {
+            fprintf(stderr, "appLayer.settings->files is empty in TRANSMITTER_BATCH mode");
+            return -1;
+        }
+        fprintf(stderr, "Batch: sending %lu files over one connection\n", appLayer.settings->numFiles);
+    } else if (appLayer.settings->status == STATUS_TRANSMITTER_MUX) {
+        if ( appLayer.settings->numFiles == 0 || appLayer.settings->numFiles > MUX_MAX_CHANNELS ) {
+            fprintf(stderr, "appLayer.settings->files must have 1 to %d files in TRANSMITTER_MUX mode", MUX_MAX_CHANNELS);
+            return -1;
+        }
+        if ( appLayer.settings->packetBodySize <= MUX_HEADER_SIZE ) {
+            fprintf(stderr, "appLayer.settings->packetBodySize must be bigger than %d in TRANSMITTER_MUX mode", MUX_HEADER_SIZE);
+            return -1;
+        }
+        // Os pacotes de dados levam packetBodySize - MUX_HEADER_SIZE bytes, com os cabeçalhos dão packetBodySize + 4
+        if ( appLayer.settings->packetBodySize + 4 > appLayer.maxPacketSize ) {
+            fprintf(stderr, "appLayer.settings->packetBodySize (-s %lu) plus the headers doesn't fit in the link payload (-f %lu)\n",
+                    appLayer.settings->packetBodySize, appLayer.maxPacketSize);
+            return -1;
+        }
+        fprintf(stderr, "Mux: sending %lu files at once over one connection\n", appLayer.settings->numFiles);
+    } else if (appLayer.settings->status == STATUS_TRANSMITTER_STREAM) {
+        if ( streaminitialize(fileno(stdin), appLayer.settings->packetBodySize, appLayer.settings->flushDelay) != 0 ) {
+            fprintf(stderr, "Error: streaminitialize()\n");
+            return -1;
+        }
+        fprintf(stderr, "Stream: sending stdin, small writes wait up to %u ms\n", appLayer.settings->flushDelay);
     } else {
         fprintf(stderr, "Redirections and pipes are not implemented yet\n");
         return -1;
@@ -118,20 +365,66 @@ int initAppLayer(Bundle *bundle) {
         }
         else fprintf(stderr, "llopen() was successful\n\n");
 
-        appLayer.sequenceNumber = 0;
+        appLayer.tx.sequenceNumber = 0;
+        appLayer.rx.sequenceNumber = 0;
+        appLayer.tx.files = 0;
+        appLayer.rx.files = 0;
+        if ( IS_DUPLEX(appLayer.settings->status) ) { // Recomeça a receção do zero
+            if ( appLayer.rx.fptr != NULL )
+                fclose(appLayer.rx.fptr);
+            appLayer.rx.fptr = NULL;
+            appLayer.rx.fileSize = 0;
+            appLayer.rx.done = false;
+        }
 
-        if ( IS_RECEIVER(appLayer.settings->status) ) {
+        if ( IS_DELTA(appLayer.settings->status) ) {
+            res = IS_RECEIVER(appLayer.settings->status) ? readDelta() : writeDelta();
+            if ( res != 0 ) {
+                fprintf(stderr, "There was an error in applayer delta function\n");
+                llclose();
+                continue;
+            }
+        } else if ( IS_DUPLEX(appLayer.settings->status) ) {
+            res = exchange();
+            if ( res != 0 ) {
+                fprintf(stderr, "There was an error in applayer exchange function\n");
+                llclose();
+                continue;
+            }
+        } else if ( IS_RECEIVER(appLayer.settings->status) ) {
+            // A thread vai lendo as tramas seguintes enquanto estas vão para o disco
+            if ( llasyncstart(true) != 0 )
+                fprintf(stderr, "llasyncstart failed, reading synchronously\n");
             res = read();
+            if ( llasyncactive() && llasyncstop() != 0 )
+                res = -1;
+            closeChannels();
             if ( res != 0 ) {
                 fprintf(stderr, "There was an error in applayer read function\n");
                 llclose();
                 continue;
             }
         } else {
-            res = write();
+            if ( appLayer.settings->status == STATUS_TRANSMITTER_MUX )
+                res = writeMux();
+            else {
+                // Os pacotes vão para a fila da thread e o próximo pedaço lê-se enquanto o anterior está na linha
+                if ( llasyncstart(false) != 0 )
+                    fprintf(stderr, "llasyncstart failed, writing synchronously\n");
+                res = (appLayer.settings->status == STATUS_TRANSMITTER_BATCH) ? writeBatch() : write();
+                // Só aqui se sabe se os últimos pacotes foram confirmados
+                if ( llasyncactive() && llasyncstop() != 0 )
+                    res = -1;
+            }
             if ( res != 0 ) {
                 fprintf(stderr, "There was an error in applayer write function\n");
                 llclose();
+                // O que já saiu do stdin perdeu-se, recomeçar dava ao receptor um ficheiro truncado
+                if ( appLayer.settings->status == STATUS_TRANSMITTER_STREAM && streamconsumed() ) {
+                    fprintf(stderr, "Error: stdin was already read and can't be sent again, giving up\n");
+                    tries = bundle->llSettings.numAttempts;
+                    break;
+                }
                 continue;
             }
         }
@@ -145,11 +438,26 @@ int initAppLayer(Bundle *bundle) {
         break;
     }
     
-    if ( appLayer.settings->status == STATUS_TRANSMITTER_FILE || appLayer.settings->status == STATUS_RECEIVER_FILE ) 
+    if ( appLayer.settings->status == STATUS_TRANSMITTER_FILE || appLayer.settings->status == STATUS_RECEIVER_FILE
+            || appLayer.settings->status == STATUS_TRANSMITTER_DELTA || IS_DUPLEX(appLayer.settings->status) )
         fclose(appLayer.settings->io.fptr);
 
+    if ( IS_DUPLEX(appLayer.settings->status) && appLayer.rx.fptr != NULL )
+        fclose(appLayer.rx.fptr);
+
+    if ( appLayer.settings->status == STATUS_TRANSMITTER_STREAM )
+        streamclose();
+
+    // Com -X o trace vai sempre para o ficheiro, sem -X só quando não houve maneira de transferir
+    if ( bundle->llSettings.traceFile != NULL )
+        tracedump(bundle->llSettings.traceFile);
+    else if ( tries == bundle->llSettings.numAttempts )
+        tracedump(TRACE_DEFAULT_FILE);
+
     if (tries < bundle->llSettings.numAttempts) {
          fprintf(stderr, "\n\nO ficheiro foi transferido com sucesso!\nNúmero de tentativas: %d\n", tries);
+         if ( appLayer.tx.files > 1 || appLayer.rx.files > 1 )
+             fprintf(stderr, "Ficheiros transferidos: %u\n", IS_RECEIVER(appLayer.settings->status) ? appLayer.rx.files : appLayer.tx.files);
     }
     else {
          fprintf(stderr, "\n\nO ficheiro não conseguiu transferido!\n");
@@ -162,68 +470,133 @@ static int parserPacket(uint8_t* packet, size_t size) {
     uint8_t C = packet[0];
     int res;
 
+    if ( C == C_MUX )
+        return parserChannelPacket(packet, size);
+
     if(C == C_DATA) {
         uint8_t sequence = packet[1];
         uint8_t L2 = packet[2];
         uint8_t L1 = packet[3];
         uint32_t dataSize = 256 * L2 + L1;
         
-        if ( sequence != appLayer.sequenceNumber ) {
+        if ( sequence != appLayer.rx.sequenceNumber ) {
             fprintf(stderr, "parserPacket: numero de sequência inválido\n");
             errno = ECONNABORTED;
             return -1;
         }
 
-        if ( (appLayer.settings->status == STATUS_RECEIVER_FILE_RECEIVED_NAME) && appLayer.settings->io.fptr == NULL ) {
+        if ( NAMED_BY_START(appLayer.settings->status) && appLayer.rx.fptr == NULL ) {
             fprintf(stderr, "parserPacket: esperava um C_START antes do C_DATA\n");
             return -1;
         }
 
-        if( appLayer.settings->status == STATUS_RECEIVER_FILE || appLayer.settings->status == STATUS_RECEIVER_FILE_RECEIVED_NAME) {
-            res = fwrite(packet+4, 1, dataSize, appLayer.settings->io.fptr);
-            if ( ferror(appLayer.settings->io.fptr) ) {
+        if( appLayer.rx.fptr != NULL ) {
+            // O buffer vai encher: despeja-o já, com o emissor parado por um RNR em vez de
+            // ficar a dar timeouts e a reenviar se o disco demorar
+            // Com a linklayer assíncrona é a thread que envia o RNR quando o anel enche
+            if ( appLayer.rx.buffered && !USES_EXCHANGE(appLayer.settings->status) && !llasyncactive()
+                    && appLayer.rx.pending + dataSize > appLayer.rx.bufferSize ) {
+                llsetreceiverbusy(true);
+                res = fflush(appLayer.rx.fptr);
+                llsetreceiverbusy(false);
+                appLayer.rx.pending = 0;
+                if ( res != 0 ) {
+                    fprintf(stderr, "parserPacket: erro ao escrever para o ficheiro\n");
+                    return -1;
+                }
+            }
+            appLayer.rx.pending += dataSize;
+            res = fwrite(packet+4, 1, dataSize, appLayer.rx.fptr);
+            if ( ferror(appLayer.rx.fptr) ) {
                 fprintf(stderr, "parserPacket: erro ao escrever para o ficheiro\n");
                 return -1;
             }
             fprintf(stderr, "parserPacket: number of bytes written to file %d\n", res);
-            appLayer.fileSize += res;
+            appLayer.rx.fileSize += res;
             
-            ++appLayer.sequenceNumber;
-            if ( appLayer.sequenceNumber > 255 ) 
-                appLayer.sequenceNumber = 0;
+            ++appLayer.rx.sequenceNumber;
+            if ( appLayer.rx.sequenceNumber > 255 ) 
+                appLayer.rx.sequenceNumber = 0;
         } else {
             // Pipes e redireccões não foram implementadas
         }
     } else if ( C == C_START ) {
+        char *fileNameReceived = NULL;
+        size_t offset = 1, i;
+        uint8_t type, length;
 
-        uint8_t type = packet[1];
-        uint8_t length = packet[2];
-        char *fileNameReceived;
-
-        fileNameReceived = (char *) malloc( sizeof(char) * length );
-        memcpy(fileNameReceived,packet+3,length);
+        // Num lote cada ficheiro tem o seu START, a contagem recomeça
+        appLayer.rx.fileSize = 0;
+        appLayer.rx.done = false;
+        appLayer.rx.expectedSize = -1;
+        appLayer.rx.mtime = 0;
 
-        switch(type) {
-            case TYPE_FILESIZE:
-                // No nosso caso só recebe no fim
-                fprintf(stderr, "parserPacket: Not expected fileSize type\n");
-                /*appLayer.fileSize = (int) value; // fileSize is in AppLayer*/
-                break;
-            case TYPE_FILENAME:
-                if ( appLayer.settings->status == STATUS_RECEIVER_FILE_RECEIVED_NAME ) {
-                    appLayer.settings->fileName = fileNameReceived;
-                    appLayer.settings->io.fptr = fopen(fileNameReceived, "w+b"); //Creates a file, if exists erases the content first
-                    if (appLayer.settings->io.fptr == NULL) {
-                        fprintf(stderr, "parserPacket: Error opening file '%s'\n", fileNameReceived);
+        while ( offset + 2 <= size ) {
+            type = packet[offset];
+            length = packet[offset+1];
+            offset += 2;
+            if ( offset + length > size ) {
+                fprintf(stderr, "parserPacket: Start Packet argument too long\n");
+                free(fileNameReceived);
+                return -1;
+            }
+            switch(type) {
+                case TYPE_FILESIZE:
+                case TYPE_MTIME:
+                    if ( length > sizeof(long int) ) {
+                        fprintf(stderr, "parserPacket: Start Packet number too long\n");
+                        free(fileNameReceived);
                         return -1;
                     }
-                }
-                break;
-            default:
-                fprintf(stderr, "parserPacket: Start Packet type not correct\n");
-                return -1;
-                break;
+                    if ( type == TYPE_FILESIZE )
+                        for (i = 0, appLayer.rx.expectedSize = 0; i < length; ++i)
+                            appLayer.rx.expectedSize |= (long int) packet[offset+i] << i*8;
+                    else
+                        for (i = 0; i < length; ++i)
+                            appLayer.rx.mtime |= (long int) packet[offset+i] << i*8;
+                    break;
+                case TYPE_FILENAME:
+                    free(fileNameReceived);
+                    fileNameReceived = (char *) malloc( sizeof(char) * length + 1 );
+                    memcpy(fileNameReceived,packet+offset,length);
+                    fileNameReceived[length] = 0;
+                    break;
+                default:
+                    fprintf(stderr, "parserPacket: Start Packet type not correct\n");
+                    free(fileNameReceived);
+                    return -1;
+                    break;
+            }
+            offset += length;
         }
+
+        if ( fileNameReceived != NULL && NAMED_BY_START(appLayer.settings->status) ) {
+            if ( appLayer.rx.fptr != NULL ) { // Lote: o ficheiro anterior já acabou
+                fclose(appLayer.rx.fptr);
+                free(appLayer.rx.fileName);
+                appLayer.rx.fptr = NULL;
+                if ( !IS_DUPLEX(appLayer.settings->status) && appLayer.channel < 0 )
+                    appLayer.settings->io.fptr = NULL;
+            }
+            if ( makeParents(fileNameReceived) != 0 ) {
+                fprintf(stderr, "parserPacket: Refusing file name '%s'\n", fileNameReceived);
+                free(fileNameReceived);
+                return -1;
+            }
+            appLayer.rx.fileName = fileNameReceived;
+            appLayer.rx.fptr = fopen(fileNameReceived, "w+b"); //Creates a file, if exists erases the content first
+            if (appLayer.rx.fptr == NULL) {
+                fprintf(stderr, "parserPacket: Error opening file '%s'\n", fileNameReceived);
+                return -1;
+            }
+            appLayer.rx.buffered = false;
+            if ( !IS_DUPLEX(appLayer.settings->status) && appLayer.channel < 0 ) { // Fechado pelo main
+                appLayer.settings->fileName = appLayer.rx.fileName;
+                appLayer.settings->io.fptr = appLayer.rx.fptr;
+            }
+        } else free(fileNameReceived);
+
+        prepareOutput();
     } else if( C == C_END ) {
         uint8_t type = packet[1];
         uint8_t length = packet[2];
@@ -242,11 +615,21 @@ static int parserPacket(uint8_t* packet, size_t size) {
 
                 /*fprintf(stderr, "parserPacket: fileSizeReceivedAsString %.*s\n", length, fileSizeReceivedAsString);*/
                 /*fileSizeReceived = atol(fileSizeReceivedAsString);*/
-                fprintf(stderr, "parserPacket: fileSizeReceived %li vs fileSize %li\n", fileSizeReceived, appLayer.fileSize);
-                if ( fileSizeReceived != appLayer.fileSize ) {
+                fprintf(stderr, "parserPacket: fileSizeReceived %li vs fileSize %li\n", fileSizeReceived, appLayer.rx.fileSize);
+                if ( fileSizeReceived != appLayer.rx.fileSize ) {
                     fprintf(stderr, "parserPacket: fileSizeReceived != fileSize\n");
                     return -1;
                 }
+                appLayer.rx.done = true;
+                ++appLayer.rx.files;
+                if ( appLayer.rx.mtime != 0 && appLayer.rx.fptr != NULL ) {
+                    struct timespec times[2] = { { 0, UTIME_OMIT }, { appLayer.rx.mtime, 0 } };
+                    // Sem nada no buffer, o fclose já não mexe na data
+                    if ( fflush(appLayer.rx.fptr) != 0 || futimens(fileno(appLayer.rx.fptr), times) != 0 )
+                        fprintf(stderr, "parserPacket: Couldn't set the modification time\n");
+                }
+                if ( appLayer.rx.fileName != NULL )
+                    fprintf(stderr, "parserPacket: received '%s' (%li bytes)\n", appLayer.rx.fileName, appLayer.rx.fileSize);
                 break;
             default:
                 fprintf(stderr, "parserPacket: End Packet type not correct\n");
@@ -254,6 +637,47 @@ static int parserPacket(uint8_t* packet, size_t size) {
                 break;
         }
 
+    } else if ( C == C_SIGNATURE ) {
+        if ( appLayer.settings->status != STATUS_TRANSMITTER_DELTA || size < 9 ) {
+            fprintf(stderr, "parserPacket: Unexpected signature packet\n");
+            return -1;
+        }
+        if ( getUint32(packet+1) < DELTA_MIN_BLOCK || getUint32(packet+1) > DELTA_MAX_BLOCK ) {
+            fprintf(stderr, "parserPacket: Invalid block size %u\n", getUint32(packet+1));
+            return -1;
+        }
+        deltaFree(&appLayer.delta.sig);
+        if ( deltaAlloc(&appLayer.delta.sig, getUint32(packet+1), getUint32(packet+5)) != 0 ) {
+            fprintf(stderr, "parserPacket: No memory for %u checksums\n", getUint32(packet+5));
+            return -1;
+        }
+        appLayer.delta.ready = (appLayer.delta.sig.blockCount == 0);
+        fprintf(stderr, "parserPacket: receiver has %u blocks of %u bytes\n", appLayer.delta.sig.blockCount,
+                appLayer.delta.sig.blockSize);
+    } else if ( C == C_CHECKSUMS ) {
+        Signature *sig = &appLayer.delta.sig;
+        uint32_t count = 256 * (uint32_t) packet[1] + packet[2];
+        uint8_t *entry = packet + 3;
+        uint32_t i;
+
+        if ( appLayer.settings->status != STATUS_TRANSMITTER_DELTA || size != 3 + count * CHECKSUM_ENTRY_SIZE
+                || count > sig->blockCount - sig->received ) {
+            fprintf(stderr, "parserPacket: Checksums packet not correct\n");
+            return -1;
+        }
+        for (i = 0; i < count; ++i, entry += CHECKSUM_ENTRY_SIZE) {
+            sig->blocks[sig->received].weak = getUint32(entry);
+            sig->blocks[sig->received].strong = (uint64_t) getUint32(entry+4) | (uint64_t) getUint32(entry+8) << 32;
+            ++sig->received;
+        }
+        appLayer.delta.ready = (sig->received == sig->blockCount);
+    } else if ( C == C_COPY ) {
+        if ( appLayer.settings->status != STATUS_RECEIVER_DELTA || size < 9 ) {
+            fprintf(stderr, "parserPacket: Unexpected copy packet\n");
+            return -1;
+        }
+        if ( copyBlocks(getUint32(packet+1), getUint32(packet+5)) != 0 )
+            return -1;
     }
     return 0;
 }
@@ -262,9 +686,10 @@ static int read(void) {
     uint8_t *packet;
     size_t packetSize;
     size_t i;
+    int res;
 
     while (1) {
-        packet = llread(&packetSize);
+        packet = llasyncactive() ? llreceive(&packetSize) : llread(&packetSize);
         if ( errno != 0 ) {
             fprintf(stderr, "AppRead received llread with error\n");
             return -1;
@@ -278,7 +703,9 @@ static int read(void) {
                     fprintf(stderr, "%X", packet[i]);
                 }
                 fprintf(stderr, "\n");
-                if ( parserPacket(packet, packetSize) != 0 ) {
+                res = parserPacket(packet, packetSize);
+                free(packet);
+                if ( res != 0 ) {
                     fprintf(stderr, "AppRead parserPacket failed\n");
                     return -1;
                 }
@@ -294,24 +721,27 @@ static int write(void) {
     uint8_t data[appLayer.settings->packetBodySize];
     size_t stringSize, lidos = 0;
     size_t databytesWritten = 0;
+    int streamRes;
 
-    if ( appLayer.settings->status == STATUS_TRANSMITTER_STRING )
+    if ( appLayer.settings->status == STATUS_TRANSMITTER_STREAM )
+        appLayer.tx.fileSize = 0; // Só se sabe no fim
+    else if ( appLayer.settings->status == STATUS_TRANSMITTER_STRING )
         stringSize = strlen(appLayer.settings->io.chptr) + 1;
-    else if ( appLayer.settings->status == STATUS_TRANSMITTER_FILE ) {
+    else if ( appLayer.tx.fptr != NULL ) {
         if ( writeStartPacket() != 0 ) {
             fprintf(stderr, "writeStartPacket Failed\n");
             return -1;
         }
-        rewind(appLayer.settings->io.fptr);
+        rewind(appLayer.tx.fptr);
     }
 
     while ( !end ) {
-        if ( appLayer.settings->status == STATUS_TRANSMITTER_FILE ) {
-            res = fread(data, 1, appLayer.settings->packetBodySize, appLayer.settings->io.fptr);
-            if ( feof(appLayer.settings->io.fptr) ) {
+        if ( appLayer.tx.fptr != NULL ) {
+            res = fread(data, 1, appLayer.settings->packetBodySize, appLayer.tx.fptr);
+            if ( feof(appLayer.tx.fptr) ) {
                 fprintf(stderr, "AppWrite Reached end of file\n");
                 end = true;
-            } else if ( ferror(appLayer.settings->io.fptr) ) {
+            } else if ( ferror(appLayer.tx.fptr) ) {
                 fprintf(stderr, "AppWrite error occurred in fread\n");
                 return -1;
             } else {
@@ -331,9 +761,17 @@ static int write(void) {
             }
             fprintf(stderr, "AppWrite packet: %s\n", data);
         } else {
-            // Por fazer, ler stream
-            // Não vai chegar aqui porque retorna -1 no llinitialize
-            // Fiz dessa maneira pq talvez não vai dar tempo para implementar
+            // Stream: as escritas pequenas do produtor vão juntas no mesmo pacote
+            if ( (streamRes = streamnext(data, &res)) < 0 ) {
+                fprintf(stderr, "AppWrite error occurred reading the stream\n");
+                return -1;
+            }
+            if ( streamRes == 0 ) {
+                fprintf(stderr, "AppWrite Reached end of stream\n");
+                res = 0;
+                end = true;
+            }
+            appLayer.tx.fileSize += (long int) res;
         }
         if ( res != 0 ) {
             if ( writeDataPacket(data, res) == -1 ) {
@@ -352,20 +790,212 @@ static int write(void) {
     }
 
     fprintf(stderr, "\n\nAppWrite Number of bytes Written: %lu\n\n", databytesWritten);
+    ++appLayer.tx.files;
+    return 0;
+}
+
+static int writeBatch(void) {
+    BatchFile *file;
+    size_t i;
+    int res;
+
+    for (i = 0; i < appLayer.settings->numFiles; ++i) {
+        file = &appLayer.settings->files[i];
+        if ( (appLayer.tx.fptr = fopen(file->path, "rb")) == NULL ) {
+            fprintf(stderr, "AppWriteBatch: Error opening '%s'\n", file->path);
+            return -1;
+        }
+        appLayer.tx.fileName = file->name;
+        if ( fseek(appLayer.tx.fptr, 0, SEEK_END) ) {
+            fprintf(stderr, "AppWriteBatch: Cant's find file '%s' size\n", file->path);
+            fclose(appLayer.tx.fptr);
+            appLayer.tx.fptr = NULL;
+            return -1;
+        }
+        appLayer.tx.fileSize = ftell(appLayer.tx.fptr);
+
+        fprintf(stderr, "AppWriteBatch: file %lu of %lu, '%s' (%li bytes)\n", i + 1, appLayer.settings->numFiles,
+                file->name, appLayer.tx.fileSize);
+        res = write();
+        fclose(appLayer.tx.fptr);
+        appLayer.tx.fptr = NULL;
+        if ( res != 0 )
+            return -1;
+    }
+    return 0;
+}
+
+static int writeMux(void) {
+    size_t maxPacketSize = appLayer.maxPacketSize - MUX_HEADER_SIZE; // O cabeçalho do multiplexer vai na mesma trama
+    MuxSource *sources;
+    BatchFile *file;
+    size_t i;
+    int res = 0;
+
+    sources = (MuxSource *) calloc(appLayer.settings->numFiles, sizeof(MuxSource));
+    if ( sources == NULL || muxinitialize(maxPacketSize) != 0 ) {
+        free(sources);
+        return -1;
+    }
+
+    for (i = 0; i < appLayer.settings->numFiles && res == 0; ++i) {
+        file = &appLayer.settings->files[i];
+        if ( (sources[i].transfer.fptr = fopen(file->path, "rb")) == NULL ) {
+            fprintf(stderr, "AppWriteMux: Error opening '%s'\n", file->path);
+            res = -1;
+            break;
+        }
+        sources[i].transfer.fileName = file->name;
+        if ( fseek(sources[i].transfer.fptr, 0, SEEK_END) != 0 ) {
+            fprintf(stderr, "AppWriteMux: Cant's find file '%s' size\n", file->path);
+            res = -1;
+            break;
+        }
+        sources[i].transfer.fileSize = ftell(sources[i].transfer.fptr);
+        rewind(sources[i].transfer.fptr);
+        sources[i].stage = SOURCE_START;
+        if ( muxaddchannel(file->weight, produceMuxPacket, &sources[i]) < 0 ) {
+            res = -1;
+            break;
+        }
+        fprintf(stderr, "AppWriteMux: channel %lu, '%s' (%li bytes), weight %u\n", i, file->name,
+                sources[i].transfer.fileSize, file->weight);
+    }
+
+    if ( res == 0 )
+        res = muxrun();
+
+    for (i = 0; i < appLayer.settings->numFiles; ++i) {
+        if ( sources[i].transfer.fptr != NULL )
+            fclose(sources[i].transfer.fptr);
+        appLayer.tx.files += sources[i].transfer.files;
+    }
+    free(sources);
+    muxclose();
+    return res;
+}
+
+static int produceMuxPacket(void *context, uint8_t *packet, size_t *size) {
+    MuxSource *source = (MuxSource *) context;
+    Transfer *transfer = &source->transfer;
+    size_t res;
+
+    if ( source->stage == SOURCE_START ) {
+        if ( (*size = buildStartPacket(transfer, packet, appLayer.maxPacketSize - MUX_HEADER_SIZE)) == 0 ) {
+            fprintf(stderr, "produceMuxPacket invalid fileName\n");
+            return -1;
+        }
+        source->stage = SOURCE_DATA;
+        return 1;
+    }
+    if ( source->stage == SOURCE_DATA ) {
+        // O cabeçalho do multiplexer conta para o tamanho máximo da trama
+        res = fread(packet+4, 1, appLayer.settings->packetBodySize - MUX_HEADER_SIZE, transfer->fptr);
+        if ( ferror(transfer->fptr) ) {
+            fprintf(stderr, "produceMuxPacket error occurred in fread\n");
+            return -1;
+        }
+        if ( res != 0 ) {
+            putDataHeader(transfer, packet, res);
+            ++transfer->sequenceNumber;
+            *size = res + 4;
+            return 1;
+        }
+        source->stage = SOURCE_END;
+    }
+    if ( source->stage == SOURCE_END ) {
+        *size = buildEndPacket(transfer, packet);
+        source->stage = SOURCE_DONE;
+        ++transfer->files;
+        return 1;
+    }
+    return 0;
+}
+
+static int parserChannelPacket(uint8_t *packet, size_t size) {
+    Transfer received;
+    uint8_t channel, *inner;
+    size_t innerSize;
+    unsigned int files;
+    int res;
+
+    inner = muxunwrap(packet, size, &channel, &innerSize);
+    if ( inner == NULL || channel >= MUX_MAX_CHANNELS || inner[0] == C_MUX ) {
+        fprintf(stderr, "parserPacket: Multiplexed packet not correct\n");
+        return -1;
+    }
+    if ( !NAMED_BY_START(appLayer.settings->status) || IS_DUPLEX(appLayer.settings->status) ) {
+        fprintf(stderr, "parserPacket: Multiplexed files need -D\n");
+        return -1;
+    }
+
+    // O parserPacket trabalha sobre appLayer.rx, que passa a ser o estado do canal
+    received = appLayer.rx;
+    appLayer.rx = appLayer.channels[channel];
+    appLayer.channel = channel;
+    files = appLayer.rx.files;
+    res = parserPacket(inner, innerSize);
+    if ( appLayer.rx.files != files )
+        ++received.files;
+    appLayer.channels[channel] = appLayer.rx;
+    appLayer.rx = received;
+    appLayer.channel = -1;
+    return res;
+}
+
+static void closeChannels(void) {
+    size_t i;
+
+    for (i = 0; i < MUX_MAX_CHANNELS; ++i) {
+        if ( appLayer.channels[i].fptr != NULL )
+            fclose(appLayer.channels[i].fptr);
+        free(appLayer.channels[i].fileName);
+    }
+    memset(appLayer.channels, 0, sizeof(appLayer.channels));
+}
+
+static int makeParents(char *fileName) {
+    char *slash;
+    size_t length = strlen(fileName);
+
+    // Nada de caminhos absolutos nem de ".." que saiam da pasta actual
+    if ( fileName[0] == '/' || strcmp(fileName, "..") == 0 || strncmp(fileName, "../", 3) == 0
+            || strstr(fileName, "/../") != NULL || (length >= 3 && strcmp(fileName + length - 3, "/..") == 0) ) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    for (slash = strchr(fileName, '/'); slash != NULL; slash = strchr(slash + 1, '/')) {
+        *slash = 0;
+        if ( mkdir(fileName, 0755) != 0 && errno != EEXIST ) {
+            *slash = '/';
+            return -1;
+        }
+        *slash = '/';
+    }
+    errno = 0;
     return 0;
 }
 
 static int writeStartPacket(void) {
+    uint8_t packet[START_PACKET_MAX];
+    size_t packetSize = buildStartPacket(&appLayer.tx, packet, appLayer.maxPacketSize);
 
-    size_t filenameLength = strlen(appLayer.settings->fileName) + 1;
-    if ( filenameLength > 256 || filenameLength == 1 ) {
-        fprintf(stderr, "writeStartPacket invalid fileName\n");
+    if ( packetSize == 0 ) {
+        fprintf(stderr, "writeStartPacket invalid fileName or longer than the link payload (-f %lu)\n", appLayer.maxPacketSize);
         return -1;
     }
+    return sendPacket(packet, packetSize);
+}
 
-    size_t packetSize = 3 + filenameLength; //  C + T + L + Tamanho da string(V)
-    uint8_t packet[packetSize];
+static size_t buildStartPacket(Transfer *transfer, uint8_t *packet, size_t maxSize) {
+    struct stat info;
 
+    size_t filenameLength = strlen(transfer->fileName) + 1;
+    if ( filenameLength > 255 || filenameLength == 1 || 3 + filenameLength > maxSize )
+        return 0;
+
+    // C + T + L + Tamanho da string(V), seguidos do tamanho e da data (T + L + 8 bytes cada)
     packet[0] = C_START; // C
     packet[1] = TYPE_FILENAME; // T
     packet[2] = filenameLength; // V
@@ -373,30 +1003,70 @@ static int writeStartPacket(void) {
     size_t i;
 
     for (i = 0; i < filenameLength; ++i) {
-        packet[i+3] = appLayer.settings->fileName[i];
+        packet[i+3] = transfer->fileName[i];
+    }
+    i += 3;
+
+    // O nome vai primeiro, um receptor antigo só lê o primeiro argumento.
+    // O tamanho e a data são opcionais: com um nome comprido e tramas pequenas vai só o nome
+    if ( i + 2 + sizeof(long int) > maxSize ) {
+        fprintf(stderr, "buildStartPacket: no room for the size and mtime of '%s'\n", transfer->fileName);
+        return i;
+    }
+    i += putTlvNumber(packet+i, TYPE_FILESIZE, transfer->fileSize);
+    if ( i + 2 + sizeof(long int) <= maxSize && fstat(fileno(transfer->fptr), &info) == 0 )
+        i += putTlvNumber(packet+i, TYPE_MTIME, (long int) info.st_mtime);
+
+    return i;
+}
+
+static size_t putTlvNumber(uint8_t *packet, uint8_t type, long int value) {
+    size_t i;
+
+    packet[0] = type;
+    packet[1] = sizeof(value);
+    for (i = 0; i < sizeof(value); ++i)
+        packet[2+i] = (uint8_t) (value >> i*8);
+    return 2 + sizeof(value);
+}
+
+static void prepareOutput(void) {
+    size_t bufferSize;
+    int res;
+
+    if ( appLayer.rx.fptr == NULL || appLayer.rx.expectedSize <= 0 )
+        return;
+
+    if ( !appLayer.rx.buffered && appLayer.channel < 0 ) { // Os canais não partilham o buffer
+        bufferSize = ((size_t) appLayer.rx.expectedSize + WRITE_BUFFER_MIN - 1) / WRITE_BUFFER_MIN * WRITE_BUFFER_MIN;
+        if ( bufferSize > WRITE_BUFFER_MAX )
+            bufferSize = WRITE_BUFFER_MAX;
+        if ( setvbuf(appLayer.rx.fptr, writeBuffer, _IOFBF, bufferSize) == 0 ) {
+            appLayer.rx.buffered = true;
+            appLayer.rx.bufferSize = bufferSize;
+            appLayer.rx.pending = 0;
+        }
     }
 
-    return llwrite(packet, packetSize);
+    res = posix_fallocate(fileno(appLayer.rx.fptr), 0, (off_t) appLayer.rx.expectedSize);
+    if ( res != 0 )
+        fprintf(stderr, "prepareOutput: couldn't preallocate %li bytes (%s)\n", appLayer.rx.expectedSize, strerror(res));
+    else
+        fprintf(stderr, "prepareOutput: preallocated %li bytes\n", appLayer.rx.expectedSize);
 }
 
 static int writeDataPacket(uint8_t *data, size_t size) {
     uint8_t packet[size + 4];
     size_t i;
 
-    if ( data == NULL || size < 5) {
+    if ( data == NULL || size == 0 ) {
         errno = EINVAL;
         return -1;
     }
 
-    uint8_t L2 = size/256, L1 = size%256;
-
     fprintf(stderr, "Going to writeDataPacket\n");
-    fprintf(stderr, "size: %lu L2: %d L1: %d\n", size, L2, L1);
-    packet[0] = C_DATA;
-    if ( appLayer.sequenceNumber == 256 ) appLayer.sequenceNumber = 0;
-    packet[1] = appLayer.sequenceNumber;
-    packet[2] = L2;
-    packet[3] = L1;
+    putDataHeader(&appLayer.tx, packet, size);
+    fprintf(stderr, "size: %lu L2: %d L1: %d\n", size, packet[2], packet[3]);
     memcpy(packet+4, data, size);
 
     fprintf(stderr, "Full packet: ");
@@ -408,26 +1078,427 @@ static int writeDataPacket(uint8_t *data, size_t size) {
 
     //fprintf(stderr, "Size: %d %X   L2: %d %X  L1: %d %X\n", size, size/256, size%256);
     //fprintf(stderr, "DataPacket: %s\n", packet);
-    int err = llwrite(packet, size+4);
+    int err = sendPacket(packet, size+4);
     if ( err == 0 ) {
-        ++appLayer.sequenceNumber;
+        ++appLayer.tx.sequenceNumber;
         return 0;
     }
     return -1;
 }
 
+static void putDataHeader(Transfer *transfer, uint8_t *packet, size_t size) {
+    packet[0] = C_DATA;
+    if ( transfer->sequenceNumber == 256 ) transfer->sequenceNumber = 0;
+    packet[1] = (uint8_t) transfer->sequenceNumber;
+    packet[2] = (uint8_t) (size/256); // L2
+    packet[3] = (uint8_t) (size%256); // L1
+}
+
 static int writeEndPacket(void) {
+    uint8_t packet[3 + sizeof(appLayer.tx.fileSize)];
+    size_t packetSize = buildEndPacket(&appLayer.tx, packet);
 
-    size_t packetSize = 3 + sizeof(appLayer.fileSize); //  C + T + L + bytes do tipo
-    uint8_t packet[packetSize];
+    fprintf(stderr, "writeEndPacket: fileSize %li, fileSizeToSend %li\n", appLayer.tx.fileSize, (long int)packet[3]);
 
+    return sendPacket(packet, packetSize);
+}
+
+static size_t buildEndPacket(Transfer *transfer, uint8_t *packet) {
     packet[0] = C_END; // C
     packet[1] = TYPE_FILESIZE; // T
-    packet[2] = sizeof(appLayer.fileSize); // V
+    packet[2] = sizeof(transfer->fileSize); // V
+
+    memcpy(packet+3,&transfer->fileSize,sizeof(transfer->fileSize));
+    return 3 + sizeof(transfer->fileSize); //  C + T + L + bytes do tipo
+}
+
+static int sendPacket(uint8_t *packet, size_t size) {
+    uint8_t *received;
+    size_t receivedSize;
+    int res;
+
+    if ( !USES_EXCHANGE(appLayer.settings->status) )
+        return llasyncactive() ? llsubmit(packet, size, NULL, NULL) : llwrite(packet, size);
+
+    res = llexchange(packet, size, &received, &receivedSize);
+    while ( res != -1 ) {
+        if ( res & LL_RECEIVED ) {
+            res = (parserPacket(received, receivedSize) != 0) ? -1 : res;
+            free(received);
+            if ( res == -1 ) {
+                fprintf(stderr, "sendPacket: parserPacket failed\n");
+                return -1;
+            }
+        }
+        if ( res & LL_SENT )
+            return 0;
+        if ( res & LL_DISCONNECTED ) {
+            fprintf(stderr, "sendPacket: disconnected before the packet was acknowledged\n");
+            errno = ECONNABORTED;
+            return -1;
+        }
+        res = llexchange(NULL, 0, &received, &receivedSize);
+    }
+    return -1;
+}
+
+static int exchange(void) {
+    if ( write() != 0 )
+        return -1;
+
+    // O nosso ficheiro já foi todo confirmado, falta acabar de receber o do outro lado
+    if ( receiveUntil(&appLayer.rx.done) != 0 ) {
+        fprintf(stderr, "AppExchange: link failed before the C_END arrived\n");
+        return -1;
+    }
+
+    if ( IS_RECEIVER(appLayer.settings->status) && waitDisconnect() != 0 ) {
+        fprintf(stderr, "AppExchange: no disconnect from the other side\n");
+        return -1;
+    }
+
+    fprintf(stderr, "AppExchange: sent %li bytes, received %li bytes\n", appLayer.tx.fileSize, appLayer.rx.fileSize);
+    return 0;
+}
+
+static int receiveUntil(bool const *flag) {
+    uint8_t *received;
+    size_t receivedSize;
+    int res;
+
+    while ( !*flag ) {
+        res = llexchange(NULL, 0, &received, &receivedSize);
+        if ( res == -1 || (res & LL_DISCONNECTED) )
+            return -1;
+        if ( res & LL_RECEIVED ) {
+            res = parserPacket(received, receivedSize);
+            free(received);
+            if ( res != 0 ) {
+                fprintf(stderr, "receiveUntil: parserPacket failed\n");
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
 
-    memcpy(packet+3,&appLayer.fileSize,sizeof(appLayer.fileSize));
-    fprintf(stderr, "writeEndPacket: fileSize %li, fileSizeToSend %li\n", appLayer.fileSize, (long int)packet[3]);
+static int waitDisconnect(void) {
+    uint8_t *received;
+    size_t receivedSize;
+    int res;
 
-    return llwrite(packet, packetSize);
+    do {
+        res = llexchange(NULL, 0, &received, &receivedSize);
+        if ( res != -1 && (res & LL_RECEIVED) )
+            free(received);
+    } while ( res != -1 && !(res & LL_DISCONNECTED) );
+    return res == -1 ? -1 : 0;
 }
 
+static int readDelta(void) {
+    Delta *delta = &appLayer.delta;
+    size_t perPacket = (appLayer.settings->packetBodySize + 4 - 3) / CHECKSUM_ENTRY_SIZE;
+    uint8_t packet[3 + perPacket * CHECKSUM_ENTRY_SIZE];
+    uint8_t *block, *entry;
+    uint64_t strong;
+    long int basisSize = 0;
+    uint32_t i, count = 0;
+
+    if ( perPacket == 0 ) {
+        fprintf(stderr, "AppReadDelta: packetBodySize too small for the checksums\n");
+        return -1;
+    }
+    if ( perPacket > 0xffff )
+        perPacket = 0xffff;
+
+    appLayer.rx.fileSize = 0;
+    appLayer.rx.done = false;
+    delta->literal = delta->copied = 0;
+
+    // Sem cópia antiga não há blocos, o emissor manda tudo
+    delta->basis = fopen(appLayer.settings->fileName, "rb");
+    if ( delta->basis != NULL ) {
+        if ( fseek(delta->basis, 0, SEEK_END) != 0 || (basisSize = ftell(delta->basis)) < 0 ) {
+            fprintf(stderr, "AppReadDelta: Cant's find file '%s' size\n", appLayer.settings->fileName);
+            closeDelta(false);
+            return -1;
+        }
+        rewind(delta->basis);
+    }
+    delta->sig.blockSize = deltaBlockSize(basisSize);
+    delta->sig.blockCount = (uint32_t) (basisSize / delta->sig.blockSize); // Só blocos completos
+
+    delta->tempName = (char *) malloc(strlen(appLayer.settings->fileName) + sizeof(".part"));
+    if ( delta->tempName == NULL ) {
+        closeDelta(false);
+        return -1;
+    }
+    strcpy(delta->tempName, appLayer.settings->fileName);
+    strcat(delta->tempName, ".part");
+    if ( (appLayer.rx.fptr = fopen(delta->tempName, "w+b")) == NULL ) {
+        fprintf(stderr, "AppReadDelta: Error opening '%s'\n", delta->tempName);
+        closeDelta(false);
+        return -1;
+    }
+    appLayer.rx.buffered = false;
+
+    packet[0] = C_SIGNATURE;
+    putUint32(packet+1, delta->sig.blockSize);
+    putUint32(packet+5, delta->sig.blockCount);
+    if ( sendPacket(packet, 9) != 0 ) {
+        closeDelta(false);
+        return -1;
+    }
+    fprintf(stderr, "AppReadDelta: %u blocks of %u bytes in '%s'\n", delta->sig.blockCount, delta->sig.blockSize,
+            appLayer.settings->fileName);
+
+    if ( (block = (uint8_t *) malloc(delta->sig.blockSize)) == NULL ) {
+        closeDelta(false);
+        return -1;
+    }
+    entry = packet + 3;
+    for (i = 0; i < delta->sig.blockCount; ++i) {
+        if ( fread(block, 1, delta->sig.blockSize, delta->basis) != delta->sig.blockSize ) {
+            fprintf(stderr, "AppReadDelta: error reading '%s'\n", appLayer.settings->fileName);
+            free(block);
+            closeDelta(false);
+            return -1;
+        }
+        strong = deltaStrong(block, delta->sig.blockSize);
+        putUint32(entry, deltaWeak(block, delta->sig.blockSize));
+        putUint32(entry+4, (uint32_t) strong);
+        putUint32(entry+8, (uint32_t) (strong >> 32));
+        entry += CHECKSUM_ENTRY_SIZE;
+
+        if ( ++count == perPacket || i + 1 == delta->sig.blockCount ) {
+            packet[0] = C_CHECKSUMS;
+            packet[1] = (uint8_t) (count / 256);
+            packet[2] = (uint8_t) (count % 256);
+            if ( sendPacket(packet, 3 + count * CHECKSUM_ENTRY_SIZE) != 0 ) {
+                free(block);
+                closeDelta(false);
+                return -1;
+            }
+            count = 0;
+            entry = packet + 3;
+        }
+    }
+    free(block);
+
+    if ( receiveUntil(&appLayer.rx.done) != 0 ) {
+        fprintf(stderr, "AppReadDelta: link failed before the C_END arrived\n");
+        closeDelta(false);
+        return -1;
+    }
+    fprintf(stderr, "AppReadDelta: %li bytes copied from the old copy, %li bytes received\n", delta->copied,
+            appLayer.rx.fileSize - delta->copied);
+    if ( closeDelta(true) != 0 )
+        return -1;
+
+    if ( waitDisconnect() != 0 ) {
+        fprintf(stderr, "AppReadDelta: no disconnect from the other side\n");
+        return -1;
+    }
+    return 0;
+}
+
+static int writeDelta(void) {
+    Delta *delta = &appLayer.delta;
+    Signature *sig = &delta->sig;
+    size_t capacity, start = 0, literalStart = 0, end = 0;
+    uint32_t weak = 0, runFirst = 0, runCount = 0;
+    bool weakValid = false, eof = false;
+    long int found;
+    uint8_t *buffer;
+    int res = 0;
+
+    delta->ready = false;
+    delta->literal = delta->copied = 0;
+    if ( receiveUntil(&delta->ready) != 0 ) {
+        fprintf(stderr, "AppWriteDelta: link failed before the checksums arrived\n");
+        closeDelta(false);
+        return -1;
+    }
+
+    // O receptor não tem nada aproveitável, vai tudo como num -S
+    if ( sig->blockCount == 0 ) {
+        closeDelta(false);
+        return write();
+    }
+
+    capacity = 16 * (size_t) sig->blockSize + appLayer.settings->packetBodySize;
+    if ( deltaIndex(sig) != 0 || (buffer = (uint8_t *) malloc(capacity)) == NULL ) {
+        fprintf(stderr, "AppWriteDelta: No memory for the block table\n");
+        closeDelta(false);
+        return -1;
+    }
+    if ( writeStartPacket() != 0 ) {
+        fprintf(stderr, "writeStartPacket Failed\n");
+        free(buffer);
+        closeDelta(false);
+        return -1;
+    }
+    rewind(appLayer.tx.fptr);
+
+    while ( res == 0 ) {
+        // Janela incompleta: descarta o que já foi enviado e lê mais
+        if ( end - start < sig->blockSize && !eof ) {
+            memmove(buffer, buffer + literalStart, end - literalStart);
+            start -= literalStart;
+            end -= literalStart;
+            literalStart = 0;
+            end += fread(buffer + end, 1, capacity - end, appLayer.tx.fptr);
+            if ( ferror(appLayer.tx.fptr) ) {
+                fprintf(stderr, "AppWriteDelta error occurred in fread\n");
+                res = -1;
+                break;
+            }
+            eof = feof(appLayer.tx.fptr) ? true : false;
+            continue;
+        }
+        if ( end - start < sig->blockSize )
+            break;
+
+        if ( !weakValid ) {
+            weak = deltaWeak(buffer + start, sig->blockSize);
+            weakValid = true;
+        }
+        found = deltaFind(sig, weak, buffer + start);
+        if ( found >= 0 ) {
+            res = writeLiteral(buffer + literalStart, start - literalStart);
+            if ( runCount > 0 && (uint32_t) found != runFirst + runCount && res == 0 ) {
+                res = writeCopyPacket(runFirst, runCount);
+                runCount = 0;
+            }
+            if ( runCount++ == 0 )
+                runFirst = (uint32_t) found;
+            start += sig->blockSize;
+            literalStart = start;
+            weakValid = false;
+        } else {
+            if ( runCount > 0 ) { // Os C_COPY e os C_DATA têm de chegar por ordem
+                res = writeCopyPacket(runFirst, runCount);
+                runCount = 0;
+            }
+            if ( start + 1 - literalStart == appLayer.settings->packetBodySize && res == 0 ) {
+                res = writeLiteral(buffer + literalStart, start + 1 - literalStart);
+                literalStart = start + 1;
+            }
+            if ( start + sig->blockSize < end )
+                weak = deltaRoll(weak, buffer[start], buffer[start + sig->blockSize], sig->blockSize);
+            else weakValid = false;
+            ++start;
+        }
+    }
+
+    if ( res == 0 && runCount > 0 )
+        res = writeCopyPacket(runFirst, runCount);
+    if ( res == 0 )
+        res = writeLiteral(buffer + literalStart, end - literalStart);
+    free(buffer);
+    if ( res != 0 ) {
+        fprintf(stderr, "AppWriteDelta failed\n");
+        closeDelta(false);
+        return -1;
+    }
+
+    if ( writeEndPacket() != 0 ) {
+        fprintf(stderr, "writeEndPacket failed");
+        closeDelta(false);
+        return -1;
+    }
+
+    fprintf(stderr, "\n\nAppWriteDelta: %li bytes sent, %li bytes copied on the other side (file has %li bytes)\n\n",
+            delta->literal, delta->copied, appLayer.tx.fileSize);
+    ++appLayer.tx.files;
+    closeDelta(false);
+    return 0;
+}
+
+static int writeLiteral(uint8_t *data, size_t size) {
+    size_t chunk;
+
+    while ( size > 0 ) {
+        chunk = size < appLayer.settings->packetBodySize ? size : appLayer.settings->packetBodySize;
+        if ( writeDataPacket(data, chunk) != 0 )
+            return -1;
+        appLayer.delta.literal += (long int) chunk;
+        data += chunk;
+        size -= chunk;
+    }
+    return 0;
+}
+
+static int writeCopyPacket(uint32_t firstBlock, uint32_t numBlocks) {
+    uint8_t packet[9];
+
+    packet[0] = C_COPY;
+    putUint32(packet+1, firstBlock);
+    putUint32(packet+5, numBlocks);
+    appLayer.delta.copied += (long int) numBlocks * appLayer.delta.sig.blockSize;
+    return sendPacket(packet, sizeof(packet));
+}
+
+static int copyBlocks(uint32_t firstBlock, uint32_t numBlocks) {
+    Delta *delta = &appLayer.delta;
+    uint8_t data[4096];
+    long int left = (long int) numBlocks * delta->sig.blockSize;
+    size_t chunk;
+
+    if ( delta->basis == NULL || numBlocks == 0 || firstBlock >= delta->sig.blockCount
+            || numBlocks > delta->sig.blockCount - firstBlock ) {
+        fprintf(stderr, "copyBlocks: blocks %u+%u are not in the old copy\n", firstBlock, numBlocks);
+        return -1;
+    }
+    if ( fseek(delta->basis, (long int) firstBlock * delta->sig.blockSize, SEEK_SET) != 0 )
+        return -1;
+
+    while ( left > 0 ) {
+        chunk = left < (long int) sizeof(data) ? (size_t) left : sizeof(data);
+        if ( fread(data, 1, chunk, delta->basis) != chunk || fwrite(data, 1, chunk, appLayer.rx.fptr) != chunk ) {
+            fprintf(stderr, "copyBlocks: error copying from the old copy\n");
+            return -1;
+        }
+        left -= (long int) chunk;
+    }
+    appLayer.rx.fileSize += (long int) numBlocks * delta->sig.blockSize;
+    delta->copied += (long int) numBlocks * delta->sig.blockSize;
+    return 0;
+}
+
+static int closeDelta(bool keep) {
+    Delta *delta = &appLayer.delta;
+    int res = 0;
+
+    if ( delta->basis != NULL )
+        fclose(delta->basis);
+    delta->basis = NULL;
+    if ( appLayer.rx.fptr != NULL && fclose(appLayer.rx.fptr) != 0 )
+        keep = false;
+    appLayer.rx.fptr = NULL;
+
+    if ( delta->tempName != NULL ) {
+        if ( keep && rename(delta->tempName, appLayer.settings->fileName) != 0 ) {
+            fprintf(stderr, "closeDelta: Cant's replace '%s'\n", appLayer.settings->fileName);
+            keep = false;
+            res = -1;
+        }
+        if ( !keep )
+            remove(delta->tempName);
+        free(delta->tempName);
+        delta->tempName = NULL;
+    }
+    deltaFree(&delta->sig);
+    return res;
+}
+
+static void putUint32(uint8_t *buffer, uint32_t value) {
+    buffer[0] = (uint8_t) value;
+    buffer[1] = (uint8_t) (value >> 8);
+    buffer[2] = (uint8_t) (value >> 16);
+    buffer[3] = (uint8_t) (value >> 24);
+}
+
+static uint32_t getUint32(uint8_t const *buffer) {
+    return (uint32_t) buffer[0] | (uint32_t) buffer[1] << 8 | (uint32_t) buffer[2] << 16 | (uint32_t) buffer[3] << 24;
+}
@@ -6,15 +6,30 @@
 #define STATUS_RECEIVER_FILE 0x00 // -R file
 #define STATUS_RECEIVER_FILE_RECEIVED_NAME 0x02 // -D
 #define STATUS_RECEIVER_STREAM 0x01 // <, stdin
+#define STATUS_RECEIVER_DUPLEX_FILE 0x03 // -P file, full-duplex, espera pelo SET
+#define STATUS_RECEIVER_DELTA 0x04 // -K file, actualiza a cópia que já existe
 #define STATUS_TRANSMITTER_FILE 0x12 // -S file
 #define STATUS_TRANSMITTER_STRING 0x13 // -m 'foo'
 #define STATUS_TRANSMITTER_STREAM 0x14 // >
+#define STATUS_TRANSMITTER_DUPLEX_FILE 0x15 // -F file, full-duplex, envia o SET
+#define STATUS_TRANSMITTER_BATCH 0x16 // -S file -S file ... ou -W dir, vários ficheiros na mesma ligação
+#define STATUS_TRANSMITTER_DELTA 0x17 // -U file, só envia o que mudou na cópia do receptor
+#define STATUS_TRANSMITTER_MUX 0x18 // -C file[:peso] -C file[:peso] ..., vários ficheiros ao mesmo tempo, um por canal
 #define STATUS_UNSET -1
 
+typedef struct {
+    char * path; // Onde ler o ficheiro
+    char * name; // Nome enviado no C_START, aponta para dentro de path
+    unsigned int weight; // Peso do canal (STATUS_TRANSMITTER_MUX)
+} BatchFile;
+
 typedef struct {
     int status;
     size_t packetBodySize;
     char *fileName;
+    BatchFile *files; // Lote de ficheiros (STATUS_TRANSMITTER_BATCH)
+    size_t numFiles;
+    unsigned int flushDelay; // ms que um stream (-x) espera para juntar escritas pequenas num pacote
 
     union Io {
         char * chptr;
@@ -0,0 +1,110 @@
+#include "delta.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define FNV_OFFSET 0xcbf29ce484222325ULL
+#define FNV_PRIME 0x100000001b3ULL
+
+/**
+ * @desc Entrada da tabela de uma checksum fraca
+ */
+static uint32_t slot(Signature const *sig, uint32_t weak) {
+    return ((weak * 2654435761u) >> 8) & sig->tableMask;
+}
+
+uint32_t deltaBlockSize(long int fileSize) {
+    uint32_t size = DELTA_MIN_BLOCK;
+
+    // Blocos maiores para ficheiros maiores: menos checksums a enviar, mas cada diferença custa mais
+    while ( size < DELTA_MAX_BLOCK && (long int) size * size < fileSize )
+        size <<= 1;
+    return size;
+}
+
+uint32_t deltaWeak(uint8_t const *data, size_t size) {
+    uint32_t a = 0, b = 0;
+    size_t i;
+
+    for (i = 0; i < size; ++i) {
+        a += data[i];
+        b += (uint32_t) (size - i) * data[i];
+    }
+    return (a & 0xffff) | ((b & 0xffff) << 16);
+}
+
+uint32_t deltaRoll(uint32_t weak, uint8_t out, uint8_t in, size_t size) {
+    uint32_t a = weak & 0xffff, b = weak >> 16;
+
+    a = (a - out + in) & 0xffff;
+    b = (b - (uint32_t) size * out + a) & 0xffff;
+    return a | (b << 16);
+}
+
+uint64_t deltaStrong(uint8_t const *data, size_t size) {
+    uint64_t hash = FNV_OFFSET;
+    size_t i;
+
+    for (i = 0; i < size; ++i) {
+        hash ^= data[i];
+        hash *= FNV_PRIME;
+    }
+    return hash;
+}
+
+int deltaAlloc(Signature *sig, uint32_t blockSize, uint32_t blockCount) {
+    memset(sig, 0, sizeof(*sig));
+    sig->blockSize = blockSize;
+    sig->blockCount = blockCount;
+    if ( blockCount == 0 )
+        return 0;
+    sig->blocks = (BlockSum *) malloc(sizeof(BlockSum) * blockCount);
+    return sig->blocks == NULL ? -1 : 0;
+}
+
+int deltaIndex(Signature *sig) {
+    uint32_t size = 1, i, entry;
+
+    while ( size < 2 * sig->blockCount )
+        size <<= 1;
+    sig->table = (int32_t *) malloc(sizeof(int32_t) * size);
+    if ( sig->table == NULL )
+        return -1;
+    sig->tableMask = size - 1;
+    memset(sig->table, 0xff, sizeof(int32_t) * size); // Tudo a -1
+
+    // Ao contrário, para que os primeiros blocos fiquem à frente das listas
+    for (i = sig->blockCount; i-- > 0;) {
+        entry = slot(sig, sig->blocks[i].weak);
+        sig->blocks[i].next = sig->table[entry];
+        sig->table[entry] = (int32_t) i;
+    }
+    return 0;
+}
+
+long int deltaFind(Signature const *sig, uint32_t weak, uint8_t const *data) {
+    uint64_t strong = 0;
+    bool computed = false;
+    int32_t i;
+
+    if ( sig->table == NULL )
+        return -1;
+    for (i = sig->table[slot(sig, weak)]; i >= 0; i = sig->blocks[i].next) {
+        if ( sig->blocks[i].weak != weak )
+            continue;
+        if ( !computed ) {
+            strong = deltaStrong(data, sig->blockSize);
+            computed = true;
+        }
+        if ( sig->blocks[i].strong == strong )
+            return i;
+    }
+    return -1;
+}
+
+void deltaFree(Signature *sig) {
+    free(sig->blocks);
+    free(sig->table);
+    sig->blocks = NULL;
+    sig->table = NULL;
+}
@@ -0,0 +1,88 @@
+#ifndef DELTA_H
+#define DELTA_H
+
+#include "useful.h"
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define DELTA_MIN_BLOCK 512
+#define DELTA_MAX_BLOCK 65536
+
+typedef struct {
+    uint32_t weak; // Checksum rolante (estilo rsync)
+    uint64_t strong; // Hash forte, só calculado quando a fraca coincide
+    int32_t next; // Próximo bloco na mesma entrada da tabela, -1 no fim
+} BlockSum;
+
+/**
+ * Checksums dos blocos da cópia antiga do receptor
+ */
+typedef struct {
+    uint32_t blockSize;
+    uint32_t blockCount;
+    uint32_t received; // Checksums já recebidas (emissor)
+    BlockSum *blocks;
+    int32_t *table; // Primeiro bloco de cada entrada, -1 se vazia
+    uint32_t tableMask;
+} Signature;
+
+/**
+ * @desc Escolhe o tamanho dos blocos, perto da raiz quadrada do ficheiro
+ * @arg long int fileSize: tamanho da cópia antiga
+ * @return Retorna o tamanho dos blocos em bytes
+ */
+uint32_t deltaBlockSize(long int fileSize);
+
+/**
+ * @desc Calcula a checksum fraca de um bloco
+ * @arg uint8_t const *data: bloco
+ * @arg size_t size: número de bytes do bloco
+ * @return Retorna a checksum, soma simples nos 16 bits de baixo e soma pesada nos de cima
+ */
+uint32_t deltaWeak(uint8_t const *data, size_t size);
+
+/**
+ * @desc Avança a janela um byte sem voltar a ler o bloco todo
+ * @arg uint32_t weak: checksum da janela actual
+ * @arg uint8_t out: byte que sai da janela
+ * @arg uint8_t in: byte que entra na janela
+ * @arg size_t size: tamanho da janela
+ * @return Retorna a checksum da janela seguinte
+ */
+uint32_t deltaRoll(uint32_t weak, uint8_t out, uint8_t in, size_t size);
+
+/**
+ * @desc Calcula o hash forte de um bloco (FNV-1a de 64 bits)
+ * @arg uint8_t const *data: bloco
+ * @arg size_t size: número de bytes do bloco
+ * @return Retorna o hash
+ */
+uint64_t deltaStrong(uint8_t const *data, size_t size);
+
+/**
+ * @desc Reserva espaço para as checksums de blockCount blocos
+ * @return Retorna 0 em caso de sucesso e -1 em caso de erro
+ */
+int deltaAlloc(Signature *sig, uint32_t blockSize, uint32_t blockCount);
+
+/**
+ * @desc Constrói a tabela de dispersão pela checksum fraca, depois de chegarem todas as checksums
+ * @return Retorna 0 em caso de sucesso e -1 em caso de erro
+ */
+int deltaIndex(Signature *sig);
+
+/**
+ * @desc Procura um bloco da cópia antiga igual à janela
+ * @arg uint32_t weak: checksum fraca da janela
+ * @arg uint8_t const *data: janela, com sig->blockSize bytes
+ * @return Retorna o índice do bloco, -1 se não houver nenhum igual
+ */
+long int deltaFind(Signature const *sig, uint32_t weak, uint8_t const *data);
+
+/**
+ * @desc Liberta as checksums e a tabela
+ */
+void deltaFree(Signature *sig);
+
+#endif
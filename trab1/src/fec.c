@@ -0,0 +1,244 @@
+#include "fec.h"
+
+#include <string.h>
+
+#define GF_POLY 0x11D // x^8 + x^4 + x^3 + x^2 + 1
+#define CODEWORD_SIZE 255
+
+static uint8_t gfExp[2 * CODEWORD_SIZE];
+static uint8_t gfLog[256];
+static bool gfReady = false;
+
+static uint8_t generator[FEC_MAX_ROOTS + 1]; // Coeficientes de g(x), do grau 0 para cima
+static unsigned int generatorRoots = 0;
+
+static void gfInit(void);
+static uint8_t gfMul(uint8_t a, uint8_t b);
+static uint8_t gfDiv(uint8_t a, uint8_t b);
+static uint8_t gfEval(uint8_t const *poly, unsigned int degree, uint8_t x);
+static void buildGenerator(unsigned int roots);
+static size_t depthOf(size_t size, unsigned int roots);
+static size_t parityOffset(size_t size, size_t depth, size_t codeword);
+static void encodeCodeword(uint8_t const *message, size_t size, unsigned int roots, uint8_t *parity);
+static int decodeCodeword(uint8_t *codeword, size_t size, unsigned int roots);
+
+size_t fecEncodedSize(size_t size, unsigned int roots) {
+    return size + depthOf(size, roots) * roots;
+}
+
+int fecEncode(uint8_t const *data, size_t size, unsigned int roots, uint8_t *parity) {
+    uint8_t message[CODEWORD_SIZE], codewordParity[FEC_MAX_ROOTS];
+    size_t depth = depthOf(size, roots), c, i, count;
+
+    if ( data == NULL || parity == NULL || roots == 0 || roots > FEC_MAX_ROOTS ) {
+        errno = EINVAL;
+        return -1;
+    }
+    buildGenerator(roots);
+
+    for (c = 0; c < depth; ++c) {
+        for (i = c, count = 0; i < size; i += depth)
+            message[count++] = data[i];
+        encodeCodeword(message, count, roots, codewordParity);
+        for (i = 0; i < roots; ++i)
+            parity[parityOffset(size, depth, c) + i * depth] = codewordParity[i];
+    }
+    return 0;
+}
+
+int fecDecode(uint8_t *block, size_t encodedSize, unsigned int roots, size_t *size) {
+    uint8_t codeword[CODEWORD_SIZE];
+    size_t depth, dataSize = 0, c, i, count;
+    int res, corrected = 0;
+
+    if ( block == NULL || size == NULL || roots == 0 || roots > FEC_MAX_ROOTS ) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    // A profundidade não vem na trama: é a única que bate certo com o tamanho recebido
+    for (depth = 1; depth * roots < encodedSize; ++depth) {
+        dataSize = encodedSize - depth * roots;
+        if ( depthOf(dataSize, roots) == depth )
+            break;
+    }
+    if ( depth * roots >= encodedSize ) {
+        errno = EBADMSG;
+        return -1;
+    }
+    buildGenerator(roots);
+
+    for (c = 0; c < depth; ++c) {
+        for (i = c, count = 0; i < dataSize; i += depth)
+            codeword[count++] = block[i];
+        for (i = 0; i < roots; ++i)
+            codeword[count++] = block[dataSize + parityOffset(dataSize, depth, c) + i * depth];
+
+        if ( (res = decodeCodeword(codeword, count, roots)) < 0 ) {
+            errno = EBADMSG;
+            return -1;
+        }
+        if ( res == 0 )
+            continue;
+        corrected += res;
+        for (i = c, count = 0; i < dataSize; i += depth)
+            block[i] = codeword[count++];
+    }
+    *size = dataSize;
+    return corrected;
+}
+
+static void gfInit(void) {
+    unsigned int i, x = 1;
+
+    for (i = 0; i < CODEWORD_SIZE; ++i) {
+        gfExp[i] = (uint8_t) x;
+        gfExp[i + CODEWORD_SIZE] = (uint8_t) x;
+        gfLog[x] = (uint8_t) i;
+        x <<= 1;
+        if ( x & 0x100 )
+            x ^= GF_POLY;
+    }
+    gfReady = true;
+}
+
+static uint8_t gfMul(uint8_t a, uint8_t b) {
+    if ( a == 0 || b == 0 )
+        return 0;
+    return gfExp[gfLog[a] + gfLog[b]];
+}
+
+static uint8_t gfDiv(uint8_t a, uint8_t b) {
+    if ( a == 0 )
+        return 0;
+    return gfExp[gfLog[a] + CODEWORD_SIZE - gfLog[b]];
+}
+
+static uint8_t gfEval(uint8_t const *poly, unsigned int degree, uint8_t x) {
+    uint8_t y = 0;
+    unsigned int i;
+
+    for (i = degree + 1; i-- > 0;)
+        y = gfMul(y, x) ^ poly[i];
+    return y;
+}
+
+// g(x) = (x - a^0)(x - a^1)...(x - a^(roots-1))
+static void buildGenerator(unsigned int roots) {
+    unsigned int i, j;
+
+    if ( !gfReady )
+        gfInit();
+    if ( generatorRoots == roots )
+        return;
+
+    memset(generator, 0, sizeof(generator));
+    generator[0] = 1;
+    for (i = 0; i < roots; ++i) {
+        for (j = i + 1; j > 0; --j)
+            generator[j] = generator[j - 1] ^ gfMul(generator[j], gfExp[i]);
+        generator[0] = gfMul(generator[0], gfExp[i]);
+    }
+    generatorRoots = roots;
+}
+
+// Palavras precisas para que nenhuma passe dos 255 bytes
+static size_t depthOf(size_t size, unsigned int roots) {
+    size_t dataPerCodeword = CODEWORD_SIZE - roots;
+
+    if ( size == 0 )
+        return 1;
+    return (size + dataPerCodeword - 1) / dataPerCodeword;
+}
+
+// A paridade continua o entrelaçamento dos dados: o byte p do bloco é sempre da palavra p % depth
+static size_t parityOffset(size_t size, size_t depth, size_t codeword) {
+    return (codeword + depth - size % depth) % depth;
+}
+
+// Codificação sistemática, resto da divisão de message(x) * x^roots por g(x)
+static void encodeCodeword(uint8_t const *message, size_t size, unsigned int roots, uint8_t *parity) {
+    uint8_t feedback;
+    size_t i;
+    unsigned int j;
+
+    memset(parity, 0, roots);
+    for (i = 0; i < size; ++i) {
+        feedback = message[i] ^ parity[0];
+        for (j = 0; j + 1 < roots; ++j)
+            parity[j] = parity[j + 1] ^ gfMul(feedback, generator[roots - 1 - j]);
+        parity[roots - 1] = gfMul(feedback, generator[0]);
+    }
+}
+
+// Síndromes, Berlekamp-Massey, procura de Chien e Forney
+static int decodeCodeword(uint8_t *codeword, size_t size, unsigned int roots) {
+    uint8_t syndromes[FEC_MAX_ROOTS], locator[FEC_MAX_ROOTS + 1], previous[FEC_MAX_ROOTS + 1];
+    uint8_t temp[FEC_MAX_ROOTS + 1], evaluator[FEC_MAX_ROOTS], derivative;
+    uint8_t discrepancy, lastDiscrepancy = 1, x, xInverse, value;
+    unsigned int i, j, n, length = 0, shift = 1, found = 0;
+    bool errors = false;
+    size_t t, power;
+
+    for (i = 0; i < roots; ++i) {
+        syndromes[i] = 0;
+        for (t = 0; t < size; ++t)
+            syndromes[i] = gfMul(syndromes[i], gfExp[i]) ^ codeword[t];
+        if ( syndromes[i] != 0 )
+            errors = true;
+    }
+    if ( !errors )
+        return 0;
+
+    memset(locator, 0, sizeof(locator));
+    memset(previous, 0, sizeof(previous));
+    locator[0] = previous[0] = 1;
+    for (n = 0; n < roots; ++n) {
+        discrepancy = syndromes[n];
+        for (i = 1; i <= length; ++i)
+            discrepancy ^= gfMul(locator[i], syndromes[n - i]);
+        if ( discrepancy == 0 ) {
+            ++shift;
+            continue;
+        }
+        memcpy(temp, locator, sizeof(temp));
+        value = gfDiv(discrepancy, lastDiscrepancy);
+        for (i = 0; i + shift <= roots; ++i)
+            locator[i + shift] ^= gfMul(value, previous[i]);
+        if ( 2 * length <= n ) {
+            length = n + 1 - length;
+            memcpy(previous, temp, sizeof(previous));
+            lastDiscrepancy = discrepancy;
+            shift = 1;
+        } else ++shift;
+    }
+    if ( 2 * length > roots )
+        return -1;
+
+    // Omega(x) = S(x) * Lambda(x) mod x^roots
+    for (i = 0; i < roots; ++i) {
+        evaluator[i] = 0;
+        for (j = 0; j <= i && j <= length; ++j)
+            evaluator[i] ^= gfMul(locator[j], syndromes[i - j]);
+    }
+
+    for (t = 0; t < size; ++t) {
+        power = size - 1 - t;
+        x = gfExp[power];
+        xInverse = gfExp[(CODEWORD_SIZE - power) % CODEWORD_SIZE];
+        if ( gfEval(locator, length, xInverse) != 0 )
+            continue;
+
+        // Derivada formal: em GF(2^m) só ficam os termos de grau ímpar
+        derivative = 0;
+        for (i = 1; i <= length; i += 2)
+            derivative ^= gfMul(locator[i], i > 1 ? gfExp[(gfLog[xInverse] * (i - 1)) % CODEWORD_SIZE] : 1);
+        if ( derivative == 0 )
+            return -1;
+        codeword[t] ^= gfMul(x, gfDiv(gfEval(evaluator, roots - 1, xInverse), derivative));
+        ++found;
+    }
+
+    // Raízes fora da palavra (encurtada) ou a menos: demasiados erros
+    return found == length ? (int) found : -1;
+}
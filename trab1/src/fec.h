@@ -0,0 +1,47 @@
+#ifndef FEC_H
+#define FEC_H
+
+#include "useful.h"
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define FEC_MAX_ROOTS 128 // Bytes de paridade por palavra de código (corrige metade)
+
+/**
+ * Reed-Solomon sobre GF(256), palavras de código de até 255 bytes. Um bloco
+ * maior é repartido por várias palavras entrelaçadas byte a byte (o byte i vai
+ * para a palavra i % profundidade), para que um burst de erros fique espalhado
+ * por todas elas. A paridade vai no fim do bloco e continua o entrelaçamento:
+ * o byte p do bloco, dados ou paridade, é sempre da palavra p % profundidade.
+ */
+
+/**
+ * @desc Tamanho do bloco depois de lhe juntar a paridade
+ * @arg size_t size: número de bytes de dados
+ * @arg unsigned int roots: bytes de paridade por palavra de código
+ * @return Retorna size mais a paridade de todas as palavras
+ */
+size_t fecEncodedSize(size_t size, unsigned int roots);
+
+/**
+ * @desc Calcula a paridade de um bloco
+ * @arg uint8_t const *data: dados
+ * @arg size_t size: número de bytes de data
+ * @arg unsigned int roots: bytes de paridade por palavra de código
+ * @arg uint8_t *parity: onde escrever fecEncodedSize(size, roots) - size bytes
+ * @return Retorna 0 em caso de sucesso e -1 em caso de erro
+ */
+int fecEncode(uint8_t const *data, size_t size, unsigned int roots, uint8_t *parity);
+
+/**
+ * @desc Corrige um bloco recebido (dados seguidos da paridade)
+ * @arg uint8_t *block: bloco, corrigido no próprio sítio
+ * @arg size_t encodedSize: número de bytes recebidos
+ * @arg unsigned int roots: bytes de paridade por palavra de código
+ * @arg size_t *size: onde escrever o número de bytes de dados
+ * @return Retorna o número de bytes corrigidos, -1 se o bloco não tiver correcção
+ */
+int fecDecode(uint8_t *block, size_t encodedSize, unsigned int roots, size_t *size);
+
+#endif
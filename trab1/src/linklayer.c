@@ -2,6 +2,9 @@
 #define _DEFAULT_SOURCE
 
 #include "linklayer.h"
+#include "serial.h"
+#include "fec.h"
+#include "trace.h"
 
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -27,17 +30,27 @@
 #define C_SET 0x03
 #define C_UA 0x07
 #define C_DISC 0x11
+#define C_BAUD 0x0B
+#define C_BAUD_END 0x0F
 #define C_RR_RAW 0x05
 #define C_REJ_RAW 0x01
+#define C_RNR_RAW 0x09 // Receiver not ready, com N(R) no bit 7 como o RR
 #define C_I_RAW 0x00
 #define ESC 0x7D
 #define STUFFING_XOR_BYTE 0x20
+#define RX_BUFFER_SIZE 4096
+#define NEGOTIATION_PROBES 8
+#define NEGOTIATION_PROBE_TIMEOUT 1
+#define BITS_PER_BYTE 10 // 8N1: start + 8 bits + stop
 
 typedef struct{
     unsigned int numFramesI;
     unsigned int numFramesIResent;
     unsigned int numTimeouts;
     unsigned int numREJ;
+    unsigned int numRNR; // RNR enviados (receptor) ou recebidos (emissor)
+    unsigned int numRepaired; // Tramas I corrigidas pelo FEC, sem REJ
+    unsigned int numBytesRepaired;
     struct timeval startTime;
     struct timeval endTime;
 } Register;
@@ -45,25 +58,54 @@ typedef struct{
 typedef struct {
     bool is_receiver;
     int sequenceNumber;
+    int receiveSequenceNumber; // N(R) em full-duplex
+    bool ackPending; // Full-duplex: trama I recebida ainda sem RR nem N(R) enviado
+    uint8_t * pendingPacket; // Full-duplex: pacote enviado à espera de confirmação
+    size_t pendingPacketSize;
+    bool receiverBusy; // Receptor: confirma com RNR, ver llsetreceiverbusy()
+    bool peerBusy; // Emissor: recebeu um RNR e ainda não chegou o RR
     int serialFileDescriptor;
     struct termios oldtio;
     LinkLayerSettings *settings;
+    unsigned int baudRate; // Actual, pode mudar na negociação
 
     uint8_t * frame;
     size_t frameLength;
+    size_t maxFrameLength; // Com a paridade do FEC, se houver
+
+    uint8_t rxBuffer[RX_BUFFER_SIZE];
+    size_t rxStart;
+    size_t rxEnd;
 
     Register reg;
 } LinkLayer;
 
 typedef enum {
-    START, F_RCV, A_RCV, C_RCV, BCC_OK, RCV_I
+    START, F_RCV, A_RCV, C_RCV, C_ESC, BCC_OK, BCC_OK_CMD, BCC_OK_I, BCC_OK_DROP,
+    RCV_I, RCV_I_ESC, CMD_RCV
 } State;
 
+#define NUM_HEADER_STATES (BCC_OK_DROP + 1)
+
+// Classes de bytes usadas pela tabela de transições do cabeçalho
+typedef enum {
+    CLASS_OTHER, CLASS_F, CLASS_ESC, CLASS_A, CLASS_CMD, CLASS_CMDI, CLASS_BCC,
+    NUM_CLASSES
+} ByteClass;
+
+typedef struct {
+    State state;
+    uint8_t * C;
+    uint8_t BCC1;
+    uint8_t BCC2;
+} FrameParser;
+
 /**
  * Function Prototypes
  */
 
 static void alarm_handler(int signo);
+static void startTimer(void);
 static void print_frame(uint8_t * frame, size_t size);
 static void print_cmd(uint8_t C);
 static uint8_t* buildFrameHeader(uint8_t A, uint8_t C, size_t * headerSize,
@@ -72,10 +114,23 @@ static uint8_t * buildIFrame(uint8_t * packet, size_t packetSize,
         size_t * stuffedFrameSize);
 static uint8_t generateBcc(const uint8_t * data, size_t size);
 static uint8_t * stuff(uint8_t * packet, size_t size, size_t * stuffedSize);
+static bool repairFrame(void);
 static int changeSequenceNumber(void);
+static uint8_t iFrameControl(void);
+static int sendPendingPacket(void);
+static int sendSupervision(uint8_t C);
+static ssize_t sendFrame(const uint8_t * frame, size_t size);
 static bool isCMD(uint8_t ch);
 static bool isCMDI(uint8_t ch);
+static int configurePort(void);
 static bool readCMD(uint8_t * C);
+static bool sendCommand(uint8_t command, unsigned int timeout, unsigned int attempts);
+static int switchBaudRate(unsigned int baudRate);
+static unsigned int probeLink(void);
+static int negotiateBaudRate(void);
+static int followBaudRateNegotiation(void);
+static bool parseFrame(FrameParser * parser, const uint8_t * buffer, size_t size,
+        size_t * consumed);
 static void printRegister();
 static bool random_bool(double probability);
 
@@ -91,6 +146,39 @@ struct sigaction *new_act = NULL;
 
 LinkLayer linkLayer;
 
+// C_SET tem o mesmo valor que A, por isso é da CLASS_A. As tramas I com N(R)
+// (0x80 e 0xC0) só são CLASS_CMDI em full-duplex, ver llinitialize()
+static uint8_t byteClasses[256] = {
+    [F] = CLASS_F,
+    [ESC] = CLASS_ESC,
+    [A_CSENDER_RRECEIVER] = CLASS_A,
+    [C_UA] = CLASS_CMD,
+    [C_DISC] = CLASS_CMD,
+    [C_BAUD] = CLASS_CMD,
+    [C_BAUD_END] = CLASS_CMD,
+    [C_RR_RAW] = CLASS_CMD,
+    [C_RR_RAW | 0x80] = CLASS_CMD,
+    [C_REJ_RAW] = CLASS_CMD,
+    [C_REJ_RAW | 0x80] = CLASS_CMD,
+    [C_RNR_RAW] = CLASS_CMD,
+    [C_RNR_RAW | 0x80] = CLASS_CMD,
+    [C_I_RAW] = CLASS_CMDI,
+    [C_I_RAW | 0x40] = CLASS_CMDI
+};
+
+static const uint8_t headerTransitions[NUM_HEADER_STATES][NUM_CLASSES] = {
+    //               OTHER  F        ESC        A      CMD    CMDI   BCC
+    [START]       = {START, F_RCV,   START,     START, START, START, START},
+    [F_RCV]       = {START, F_RCV,   START,     A_RCV, START, START, START},
+    [A_RCV]       = {START, F_RCV,   START,     C_RCV, C_RCV, C_RCV, START},
+    [C_RCV]       = {START, F_RCV,   C_ESC,     START, START, START, BCC_OK},
+    [C_ESC]       = {START, START,   START,     START, START, START, BCC_OK},
+    [BCC_OK]      = {START, START,   START,     START, START, START, START},
+    [BCC_OK_CMD]  = {START, CMD_RCV, START,     START, START, START, START},
+    [BCC_OK_I]    = {RCV_I, START,   RCV_I_ESC, RCV_I, RCV_I, RCV_I, RCV_I},
+    [BCC_OK_DROP] = {START, START,   START,     START, START, START, START}
+};
+
 /**
  * LinkLayer API
  */
@@ -110,6 +198,17 @@ int llinitialize(LinkLayerSettings *ptr, bool is_receiver) {
     linkLayer.settings = ptr;
     linkLayer.is_receiver = is_receiver;
     linkLayer.sequenceNumber = 0;
+    linkLayer.receiveSequenceNumber = 0;
+    linkLayer.ackPending = false;
+    linkLayer.pendingPacket = NULL;
+    linkLayer.pendingPacketSize = 0;
+    linkLayer.receiverBusy = false;
+    linkLayer.peerBusy = false;
+
+    traceconfigure(ptr->payloadSize, ptr->fecRoots, ptr->fullDuplex, is_receiver);
+
+    byteClasses[C_I_RAW | 0x80] = ptr->fullDuplex ? CLASS_CMDI : CLASS_OTHER;
+    byteClasses[C_I_RAW | 0xC0] = ptr->fullDuplex ? CLASS_CMDI : CLASS_OTHER;
 
     if ( new_act == NULL ) {
         new_act = (struct sigaction *) malloc(sizeof(struct sigaction));
@@ -127,16 +226,31 @@ int llinitialize(LinkLayerSettings *ptr, bool is_receiver) {
         }
     }
 
-    if( (linkLayer.frame = (uint8_t *) malloc(linkLayer.settings->payloadSize + 6) ) == NULL) {
+    if ( ptr->fecRoots > FEC_MAX_ROOTS ) {
+        fprintf(stderr, "Error in llinitialize(): at most %d FEC parity bytes\n", FEC_MAX_ROOTS);
+        errno = EINVAL;
+        return -1;
+    }
+    linkLayer.maxFrameLength = linkLayer.settings->payloadSize + 6;
+    if ( ptr->fecRoots != 0 ) // Payload + BCC2 protegidos pela paridade
+        linkLayer.maxFrameLength += fecEncodedSize(linkLayer.settings->payloadSize + 1, ptr->fecRoots)
+                - (linkLayer.settings->payloadSize + 1);
+
+    if( (linkLayer.frame = (uint8_t *) malloc(linkLayer.maxFrameLength) ) == NULL) {
         fprintf(stderr, "Error in llinitialize(): malloc in Frame was unsuccessful\n");
         return -1;
     }
     linkLayer.frameLength = 0;
+    linkLayer.rxStart = 0;
+    linkLayer.rxEnd = 0;
 
     linkLayer.reg.numFramesI = 0;
     linkLayer.reg.numFramesIResent = 0;
     linkLayer.reg.numTimeouts = 0;
     linkLayer.reg.numREJ = 0;
+    linkLayer.reg.numRNR = 0;
+    linkLayer.reg.numRepaired = 0;
+    linkLayer.reg.numBytesRepaired = 0;
     gettimeofday(&linkLayer.reg.startTime, 0);
     gettimeofday(&linkLayer.reg.endTime, 0);
     blocked = true;
@@ -145,7 +259,6 @@ int llinitialize(LinkLayerSettings *ptr, bool is_receiver) {
 
 int llopen(void) {
     unsigned int tries = 0;
-    struct termios newtio;
 
     if (!blocked) {
         fprintf(stderr, "You have to llinitialize first\n");
@@ -164,30 +277,7 @@ int llopen(void) {
         return -1;
     }
 
-    if (tcgetattr(linkLayer.serialFileDescriptor, &(linkLayer.oldtio)) < 0) { /* save current port settings */
-        perror("tcgetattr");
-        close(linkLayer.serialFileDescriptor);
-        return -1;
-    }
-
-    bzero(&newtio, sizeof(newtio));
-    newtio.c_cflag = linkLayer.settings->baudRate | CS8 | CLOCAL | CREAD;
-    newtio.c_iflag = IGNPAR;
-    newtio.c_oflag = 0;
-
-    /* set input mode (non-canonical, no echo,...) */
-    newtio.c_lflag = 0;
-    newtio.c_cc[VTIME] = 1; /* inter-character timer unused */
-    newtio.c_cc[VMIN] = 0; /* blocking read until 0 chars received */
-
-    /*
-     VTIME e VMIN devem ser alterados de forma a proteger com um temporizador a
-     leitura do(s) próximo(s) caracter(es)
-     */
-    tcflush(linkLayer.serialFileDescriptor, TCIOFLUSH);
-
-    if (tcsetattr(linkLayer.serialFileDescriptor, TCSANOW, &newtio) == -1) {
-        perror("Failed to set new settings for port, tcsetattr");
+    if (configurePort() != 0) {
         close(linkLayer.serialFileDescriptor);
         return -1;
     }
@@ -218,16 +308,16 @@ int llopen(void) {
             alarm(linkLayer.settings->timeout);
             received = readCMD(&C);
             if (received && C == C_SET) {
-                res = write(linkLayer.serialFileDescriptor, cmd, cmdSize);
+                res = sendFrame(cmd, cmdSize);
                 if (res < 1) {
                     tries++;
                     continue;
                 }
                 free(cmd);
-                return 0;
+                return negotiateBaudRate();
             }
         } else {
-            res = write(linkLayer.serialFileDescriptor, cmd, cmdSize);
+            res = sendFrame(cmd, cmdSize);
             if (res < 1) {
                     tries++;
                     continue;
@@ -236,7 +326,7 @@ int llopen(void) {
             received = readCMD(&C);
             if (received && C == C_UA) {
                 free(cmd);
-                return 0;
+                return negotiateBaudRate();
             }
         }
 
@@ -263,7 +353,10 @@ int llwrite(uint8_t *packet, size_t packetSize) {
         return -1;
 
     unsigned int tries = 0;
+    unsigned int busyTimeouts = 0;
     bool received;
+    bool send = !linkLayer.peerBusy; // Receptor ocupado: espera pelo RR antes de enviar
+    bool sent = false;
     ssize_t res;
     uint8_t C;
 
@@ -271,22 +364,42 @@ int llwrite(uint8_t *packet, size_t packetSize) {
         alarmed = false;
         received = false;
 
-        fprintf(stderr, "Sending frame, Tries: %d\n", tries);
-        res = write(linkLayer.serialFileDescriptor, stuffedFrame,
-                stuffedFrameSize);
-        if (res < 1) {
-                    tries++;
-                    continue;
+        if (send) {
+            fprintf(stderr, "Sending frame, Tries: %d\n", tries);
+            res = sendFrame(stuffedFrame,
+                    stuffedFrameSize);
+            if (res < 1) {
+                        tries++;
+                        continue;
+            }
+            sent = true;
         }
-        alarm(linkLayer.settings->timeout);
+        send = true;
+        startTimer();
 
         received = readCMD(&C);
 
         fprintf(stderr, "Receive: %d\n", received);
         if (received) {
             tries = 0;
-            if ( C == (C_RR_RAW | (linkLayer.sequenceNumber << 7)) ) { // RR Errado
-            } else if ( C == (C_RR_RAW | (changeSequenceNumber() << 7)) ) { // RR Certo
+            if ( C == (C_RNR_RAW | (linkLayer.sequenceNumber << 7)) ) { // Ocupado, a trama (se já foi) espera na fila dele
+                fprintf(stderr, "llwrite(): receiver busy, waiting for RR\n");
+                linkLayer.peerBusy = true;
+                linkLayer.reg.numRNR++;
+                send = false;
+                continue;
+            } else if ( C == (C_RR_RAW | (linkLayer.sequenceNumber << 7)) ) { // RR Errado
+                if ( linkLayer.peerBusy ) { // Receptor livre outra vez, só reenvia se ainda não tinha enviado
+                    linkLayer.peerBusy = false;
+                    busyTimeouts = 0;
+                    send = !sent;
+                    continue;
+                }
+            } else if ( C == (C_RR_RAW | (changeSequenceNumber() << 7))
+                    || C == (C_RNR_RAW | (changeSequenceNumber() << 7)) ) { // RR Certo, RNR confirma mas pede para esperar
+                linkLayer.peerBusy = ((C & 0x7F) == C_RNR_RAW);
+                if ( linkLayer.peerBusy )
+                    linkLayer.reg.numRNR++;
                 linkLayer.sequenceNumber = changeSequenceNumber();
                 free(stuffedFrame);
                 linkLayer.reg.numFramesI++;
@@ -300,6 +413,9 @@ int llwrite(uint8_t *packet, size_t packetSize) {
             } else {
                 fprintf(stderr, "Received an unexpected command\n");
             }
+        } else if ( linkLayer.peerBusy && ++busyTimeouts < linkLayer.settings->numAttempts ) {
+            send = false; // Não reenvia enquanto o receptor estiver ocupado, o RR pode ainda vir
+            continue;
         }
         tries++;
         linkLayer.reg.numFramesIResent++;
@@ -309,6 +425,20 @@ int llwrite(uint8_t *packet, size_t packetSize) {
     return -1;
 }
 
+int llsetreceiverbusy(bool busy) {
+    if (!blocked || !linkLayer.is_receiver || linkLayer.settings->fullDuplex) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (busy == linkLayer.receiverBusy)
+        return 0;
+
+    linkLayer.receiverBusy = busy;
+    if (busy)
+        linkLayer.reg.numRNR++;
+    return sendSupervision((uint8_t) ((busy ? C_RNR_RAW : C_RR_RAW) | (linkLayer.sequenceNumber << 7)));
+}
+
 // errno != 0 em caso de erro
 // retorna NULL e errno = 0, se receber disconnect e depois um UA para a applayer depois fazer llclose
 // retorna endereço do pacote, *packetSize tamanho do pacote recebido
@@ -364,8 +494,8 @@ uint8_t* llread(size_t *payloadSize) {
 
         if (received) {
             if (!blockedSet) {
-                if ( C == C_SET ) // Transmitter não recebeu bem o UA
-                    res = write(linkLayer.serialFileDescriptor, uaCmd, uaCmdSize);
+                if ( C == C_SET || C == C_BAUD_END ) // Transmitter não recebeu bem o UA
+                    res = sendFrame(uaCmd, uaCmdSize);
                 else if ( !isCMDI(C) )// Se não for uma trama de informação
                     fprintf(stderr, "Garbage command received"); // O ruído pode 'construir' uma trama sem erros não esperada!
                 else blockedSet = true;
@@ -375,9 +505,9 @@ uint8_t* llread(size_t *payloadSize) {
                     fprintf(stderr, "Cabeça da trama I boa, resto mau, mesma sequência -> rej\n");
                     linkLayer.reg.numREJ++;
                     if (linkLayer.sequenceNumber)
-                        res = write(linkLayer.serialFileDescriptor, rej1Cmd, rej1CmdSize);
+                        res = sendFrame(rej1Cmd, rej1CmdSize);
                     else
-                        res = write(linkLayer.serialFileDescriptor, rej0Cmd, rej0CmdSize);
+                        res = sendFrame(rej0Cmd, rej0CmdSize);
                     if (res < 1) {
                         tries++;
                         continue;
@@ -386,9 +516,9 @@ uint8_t* llread(size_t *payloadSize) {
                 } else if ( (C == (C_I_RAW | (changeSequenceNumber() << 6))) && (linkLayer.frame[linkLayer.frameLength-1] != F) ) { //RR
                     fprintf(stderr, "Cabeça da trama I boa, resto mau, sequência diferente -> rr\n");
                     if (linkLayer.sequenceNumber)
-                        res = write(linkLayer.serialFileDescriptor, rr1Cmd, rr1CmdSize);
+                        res = sendFrame(rr1Cmd, rr1CmdSize);
                     else
-                        res = write(linkLayer.serialFileDescriptor, rr0Cmd, rr0CmdSize);
+                        res = sendFrame(rr0Cmd, rr0CmdSize);
                     if (res < 1) {
                         tries++;
                         continue;
@@ -407,10 +537,12 @@ uint8_t* llread(size_t *payloadSize) {
                     }
                     *payloadSize = tempSize;
                     linkLayer.sequenceNumber = changeSequenceNumber();
-                    if ( linkLayer.sequenceNumber == 0 )
-                        res = write(linkLayer.serialFileDescriptor, rr0Cmd, rr0CmdSize);
+                    if ( linkLayer.receiverBusy )
+                        res = sendSupervision((uint8_t) (C_RNR_RAW | (linkLayer.sequenceNumber << 7))) == 0 ? 1 : 0;
+                    else if ( linkLayer.sequenceNumber == 0 )
+                        res = sendFrame(rr0Cmd, rr0CmdSize);
                     else
-                        res = write(linkLayer.serialFileDescriptor, rr1Cmd, rr1CmdSize);
+                        res = sendFrame(rr1Cmd, rr1CmdSize);
                     if (res < 1) {
                         tries++;
                         continue;
@@ -418,10 +550,12 @@ uint8_t* llread(size_t *payloadSize) {
                     linkLayer.reg.numFramesI++;
                     return payloadToReturn;
                 } else if ( C == (C_I_RAW | (changeSequenceNumber() << 6)) ) { // Trama I duplicada, emissor nao recebeu a confirmação a tempo ou a confirmação foi perdida na rede
-                    if ( linkLayer.sequenceNumber == 0 )
-                        res = write(linkLayer.serialFileDescriptor, rr0Cmd, rr0CmdSize);
+                    if ( linkLayer.receiverBusy )
+                        res = sendSupervision((uint8_t) (C_RNR_RAW | (linkLayer.sequenceNumber << 7))) == 0 ? 1 : 0;
+                    else if ( linkLayer.sequenceNumber == 0 )
+                        res = sendFrame(rr0Cmd, rr0CmdSize);
                     else
-                        res = write(linkLayer.serialFileDescriptor, rr1Cmd, rr1CmdSize);
+                        res = sendFrame(rr1Cmd, rr1CmdSize);
                     if (res < 1) {
                         tries++;
                         continue;
@@ -432,9 +566,9 @@ uint8_t* llread(size_t *payloadSize) {
                     goto cleanUp;
                 } else { // Recebeu uma trama de supervisão ou não numerada válida mas não esperada, ruído tramado!
                     if ( linkLayer.sequenceNumber == 0 )
-                        res = write(linkLayer.serialFileDescriptor, rr0Cmd, rr0CmdSize);
+                        res = sendFrame(rr0Cmd, rr0CmdSize);
                     else
-                        res = write(linkLayer.serialFileDescriptor, rr1Cmd, rr1CmdSize);
+                        res = sendFrame(rr1Cmd, rr1CmdSize);
                     if (res < 1) {
                         tries++;
                         continue;
@@ -465,6 +599,110 @@ uint8_t* llread(size_t *payloadSize) {
     return NULL;
 }
 
+int llexchange(uint8_t * packet, size_t packetSize, uint8_t ** received,
+        size_t * receivedSize) {
+    unsigned int tries = 0;
+    int result = 0;
+    uint8_t C, ns, nr;
+
+    if (!linkLayer.settings->fullDuplex || received == NULL || receivedSize == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (packet != NULL) {
+        if (linkLayer.pendingPacket != NULL) {
+            errno = EBUSY;
+            return -1;
+        }
+        linkLayer.pendingPacket = (uint8_t *) malloc(packetSize);
+        if (linkLayer.pendingPacket == NULL) {
+            errno = ENOMEM;
+            return -1;
+        }
+        memcpy(linkLayer.pendingPacket, packet, packetSize);
+        linkLayer.pendingPacketSize = packetSize;
+        if (sendPendingPacket() != 0)
+            fprintf(stderr, "llexchange(): write failed, will retry\n");
+    }
+
+    // Sem trama I nova para levar o N(R), a confirmação vai num RR
+    if (linkLayer.ackPending) {
+        if (sendSupervision((uint8_t) (C_RR_RAW | (linkLayer.receiveSequenceNumber << 7))) == 0)
+            linkLayer.ackPending = false;
+    }
+
+    *received = NULL;
+    *receivedSize = 0;
+
+    while (tries < linkLayer.settings->numAttempts) {
+        alarmed = false;
+        startTimer();
+
+        if (!readCMD(&C)) {
+            ++tries;
+            if (linkLayer.pendingPacket != NULL) {
+                linkLayer.reg.numFramesIResent++;
+                sendPendingPacket();
+            } else
+                sendSupervision((uint8_t) (C_RR_RAW | (linkLayer.receiveSequenceNumber << 7)));
+            continue;
+        }
+        tries = 0;
+
+        if (isCMDI(C) || (C & 0x7F) == C_RR_RAW || (C & 0x7F) == C_REJ_RAW || (C & 0x7F) == C_RNR_RAW) {
+            // N(R): confirma o pacote pendente se o outro lado já espera o seguinte
+            nr = (uint8_t) (C >> 7);
+            if (linkLayer.pendingPacket != NULL && nr != linkLayer.sequenceNumber) {
+                free(linkLayer.pendingPacket);
+                linkLayer.pendingPacket = NULL;
+                linkLayer.sequenceNumber = changeSequenceNumber();
+                linkLayer.reg.numFramesI++;
+                result |= LL_SENT;
+            } else if ((C & 0x7F) == C_REJ_RAW && linkLayer.pendingPacket != NULL) {
+                linkLayer.reg.numREJ++;
+                linkLayer.reg.numFramesIResent++;
+                sendPendingPacket();
+            }
+        }
+
+        if (isCMDI(C)) {
+            ns = (uint8_t) ((C >> 6) & 0x01);
+            if (linkLayer.frame[linkLayer.frameLength-1] != F) { // Cabeça boa, resto mau
+                if (ns == linkLayer.receiveSequenceNumber) {
+                    linkLayer.reg.numREJ++;
+                    sendSupervision((uint8_t) (C_REJ_RAW | (linkLayer.receiveSequenceNumber << 7)));
+                } else
+                    sendSupervision((uint8_t) (C_RR_RAW | (linkLayer.receiveSequenceNumber << 7)));
+            } else if (ns == linkLayer.receiveSequenceNumber) { // Trama I esperada
+                *receivedSize = linkLayer.frameLength - 6;
+                *received = (uint8_t *) malloc(*receivedSize);
+                if (*received == NULL) {
+                    errno = ENOMEM;
+                    return -1;
+                }
+                memcpy(*received, linkLayer.frame + 4, *receivedSize);
+                linkLayer.receiveSequenceNumber = 1 - linkLayer.receiveSequenceNumber;
+                linkLayer.ackPending = true; // Vai no N(R) da próxima trama I ou num RR
+                result |= LL_RECEIVED;
+            } else // Duplicada, a confirmação perdeu-se
+                sendSupervision((uint8_t) (C_RR_RAW | (linkLayer.receiveSequenceNumber << 7)));
+        } else if (C == C_SET) { // O outro lado não recebeu bem o UA
+            sendSupervision(C_UA);
+        } else if (C == C_DISC) {
+            fprintf(stderr, "llexchange(): received disconnect\n");
+            return result | LL_DISCONNECTED;
+        }
+
+        if (result != 0)
+            return result;
+    }
+
+    fprintf(stderr, "llexchange(): too many timeouts\n");
+    errno = ECONNABORTED;
+    return -1;
+}
+
 int llclose(void) {
     unsigned int tries = 0;
     static bool success = false;
@@ -476,6 +714,12 @@ int llclose(void) {
         return -1;
     }
 
+    // Full-duplex: a última trama I recebida ainda não foi confirmada
+    if (linkLayer.settings->fullDuplex && linkLayer.ackPending) {
+        sendSupervision((uint8_t) (C_RR_RAW | (linkLayer.receiveSequenceNumber << 7)));
+        linkLayer.ackPending = false;
+    }
+
 
     size_t DISCsize, UAsize;
     uint8_t * DISC = buildFrameHeader(A_CSENDER_RRECEIVER, C_DISC, &DISCsize,
@@ -490,7 +734,7 @@ int llclose(void) {
         while (tries < linkLayer.settings->numAttempts) {
             alarmed = false;
             if (linkLayer.is_receiver) {
-                res = write(linkLayer.serialFileDescriptor, DISC, DISCsize);
+                res = sendFrame(DISC, DISCsize);
                 if (res < 1) {
                     tries++;
                     continue;
@@ -503,7 +747,7 @@ int llclose(void) {
                     goto cleanSerial;
                 }
             } else {
-                res = write(linkLayer.serialFileDescriptor, DISC, DISCsize);
+                res = sendFrame(DISC, DISCsize);
                 if (res < 1) {
                         tries++;
                         continue;
@@ -511,7 +755,7 @@ int llclose(void) {
                 alarm(linkLayer.settings->timeout);
                 received = readCMD(&C);
                 if (received && C == C_DISC) {
-                    res = write(linkLayer.serialFileDescriptor, UA, UAsize);
+                    res = sendFrame(UA, UAsize);
                     if (res < 1) {
                         tries++;
                         continue;
@@ -533,6 +777,11 @@ int llclose(void) {
         linkLayer.frame = NULL;
     }
 
+    if ( linkLayer.pendingPacket != NULL ) {
+        free(linkLayer.pendingPacket);
+        linkLayer.pendingPacket = NULL;
+    }
+
     if (success) {
         if (tcsetattr(linkLayer.serialFileDescriptor, TCSANOW, &(linkLayer.oldtio)) < 0) {
             perror("tcsetattr");
@@ -558,10 +807,222 @@ int llclose(void) {
     }
 }
 
+/**
+ * Negociação do baudRate
+ */
+
+// Envia um comando e espera pelo UA
+static bool sendCommand(uint8_t command, unsigned int timeout, unsigned int attempts) {
+    size_t cmdSize;
+    uint8_t * cmd = buildFrameHeader(A_CSENDER_RRECEIVER, command, &cmdSize, false);
+    unsigned int tries;
+    uint8_t C;
+
+    if ( cmd == NULL ) return false;
+
+    for (tries = 0; tries < attempts; ++tries) {
+        alarmed = false;
+        if (sendFrame(cmd, cmdSize) < 1)
+            continue;
+        alarm(timeout);
+        if (readCMD(&C) && C == C_UA) {
+            free(cmd);
+            return true;
+        }
+    }
+
+    free(cmd);
+    return false;
+}
+
+// Espera que o que já foi escrito saia da porta e muda para o novo baudRate
+static int switchBaudRate(unsigned int baudRate) {
+    tcdrain(linkLayer.serialFileDescriptor);
+    if (setBaudRate(linkLayer.serialFileDescriptor, baudRate) == -1) {
+        perror("setBaudRate");
+        return -1;
+    }
+    tcflush(linkLayer.serialFileDescriptor, TCIFLUSH);
+    linkLayer.rxStart = 0;
+    linkLayer.rxEnd = 0;
+    linkLayer.baudRate = baudRate;
+    fprintf(stderr, "BaudRate changed to %u\n", baudRate);
+    return 0;
+}
+
+// Envia NEGOTIATION_PROBES SETs e retorna quantos ficaram sem UA
+static unsigned int probeLink(void) {
+    unsigned int i, errors = 0;
+
+    for (i = 0; i < NEGOTIATION_PROBES; ++i) {
+        if (!sendCommand(C_SET, NEGOTIATION_PROBE_TIMEOUT, 1))
+            ++errors;
+    }
+    fprintf(stderr, "Probe at %u: %u/%d errors\n", linkLayer.baudRate, errors, NEGOTIATION_PROBES);
+    return errors;
+}
+
+/**
+ * Depois do SET/UA o emissor sobe o baudRate um degrau de cada vez (C_BAUD)
+ * até ao maxBaudRate, enquanto a taxa de erros das sondas não aumentar. Quando
+ * aumenta volta ao anterior e espera que o receptor, sem receber nada no novo
+ * baudRate durante um timeout, também volte. C_BAUD_END termina a negociação.
+ */
+static int negotiateBaudRate(void) {
+    unsigned int current = linkLayer.baudRate, next;
+    unsigned int errors, nextErrors;
+
+    if (linkLayer.settings->maxBaudRate <= current)
+        return 0;
+
+    if (linkLayer.is_receiver)
+        return followBaudRateNegotiation();
+
+    errors = probeLink();
+    while ((next = nextBaudRate(current)) != 0 && next <= linkLayer.settings->maxBaudRate) {
+        if (!sendCommand(C_BAUD, linkLayer.settings->timeout, linkLayer.settings->numAttempts))
+            break;
+        if (switchBaudRate(next) != 0)
+            return -1;
+
+        nextErrors = probeLink();
+        if (nextErrors > errors || nextErrors == NEGOTIATION_PROBES) {
+            if (switchBaudRate(current) != 0)
+                return -1;
+            sleep(linkLayer.settings->timeout + 1);
+            tcflush(linkLayer.serialFileDescriptor, TCIFLUSH);
+            break;
+        }
+        current = next;
+        errors = nextErrors;
+    }
+
+    if (!sendCommand(C_BAUD_END, linkLayer.settings->timeout, linkLayer.settings->numAttempts))
+        fprintf(stderr, "negotiateBaudRate(): no UA for C_BAUD_END, carrying on at %u\n", linkLayer.baudRate);
+
+    fprintf(stderr, "Negotiated baudRate: %u\n", linkLayer.baudRate);
+    return 0;
+}
+
+static int followBaudRateNegotiation(void) {
+    unsigned int previous = linkLayer.baudRate, next;
+    unsigned int timeouts = 0;
+    size_t uaSize;
+    uint8_t * ua = buildFrameHeader(A_CSENDER_RRECEIVER, C_UA, &uaSize, false);
+    uint8_t C;
+
+    if ( ua == NULL ) return -1;
+
+    while (timeouts < linkLayer.settings->numAttempts) {
+        alarmed = false;
+        alarm(linkLayer.settings->timeout);
+        if (!readCMD(&C)) {
+            ++timeouts;
+            if (linkLayer.baudRate != previous && switchBaudRate(previous) != 0) {
+                free(ua);
+                return -1;
+            }
+            continue;
+        }
+        timeouts = 0;
+
+        if (isCMDI(C)) { // O emissor não está a negociar, vai reenviar a trama
+            fprintf(stderr, "followBaudRateNegotiation(): transmitter is not negotiating\n");
+            break;
+        } else if (C == C_BAUD) {
+            previous = linkLayer.baudRate; // O emissor só pede para subir se este baudRate for bom
+            next = nextBaudRate(linkLayer.baudRate);
+            if (next == 0 || next > linkLayer.settings->maxBaudRate)
+                continue; // Sem UA o emissor desiste de subir
+            sendFrame(ua, uaSize);
+            if (switchBaudRate(next) != 0) {
+                free(ua);
+                return -1;
+            }
+        } else if (C == C_SET || C == C_BAUD_END) {
+            sendFrame(ua, uaSize);
+            if (C == C_BAUD_END)
+                break;
+        }
+    }
+
+    fprintf(stderr, "Negotiated baudRate: %u\n", linkLayer.baudRate);
+    free(ua);
+    return 0;
+}
+
 /**
  * More Functions
  */
 
+static int configurePort(void) {
+    struct termios newtio;
+
+    if (tcgetattr(linkLayer.serialFileDescriptor, &(linkLayer.oldtio)) < 0) { /* save current port settings */
+        perror("tcgetattr");
+        return -1;
+    }
+
+    bzero(&newtio, sizeof(newtio));
+    newtio.c_cflag = CS8 | CLOCAL | CREAD;
+    if (linkLayer.settings->hwFlowControl)
+        newtio.c_cflag |= CRTSCTS;
+    cfsetispeed(&newtio, cfgetispeed(&(linkLayer.oldtio))); // O baudRate é mudado a seguir
+    cfsetospeed(&newtio, cfgetospeed(&(linkLayer.oldtio)));
+    newtio.c_iflag = IGNPAR;
+    newtio.c_oflag = 0;
+
+    /* set input mode (non-canonical, no echo,...) */
+    newtio.c_lflag = 0;
+
+    /*
+     Com VMIN = 0 o read() retorna o que houver ao fim de VTIME sem bytes; com
+     VMIN > 0 bloqueia até VMIN bytes (ou VTIME entre bytes, depois do primeiro),
+     e nesse caso é o alarme que o interrompe se não chegar nada
+     */
+    newtio.c_cc[VTIME] = linkLayer.settings->vtime;
+    newtio.c_cc[VMIN] = linkLayer.settings->vmin;
+
+    tcflush(linkLayer.serialFileDescriptor, TCIOFLUSH);
+    linkLayer.rxStart = 0;
+    linkLayer.rxEnd = 0;
+
+    if (tcsetattr(linkLayer.serialFileDescriptor, TCSANOW, &newtio) == -1) {
+        perror("Failed to set new settings for port, tcsetattr");
+        return -1;
+    }
+
+    if (setBaudRate(linkLayer.serialFileDescriptor, linkLayer.settings->baudRate) == -1) {
+        perror("Failed to set the baudRate, setBaudRate");
+        tcsetattr(linkLayer.serialFileDescriptor, TCSANOW, &(linkLayer.oldtio));
+        return -1;
+    }
+    linkLayer.baudRate = linkLayer.settings->baudRate;
+
+    if (linkLayer.settings->lowLatency && setLowLatency(linkLayer.serialFileDescriptor) == -1)
+        perror("ASYNC_LOW_LATENCY not available, setLowLatency");
+
+    return 0;
+}
+
+// O write() volta quando o driver aceita os bytes, não quando saem pela linha: a
+// baudRates baixas uma trama grande pode demorar mais a sair do que o próprio
+// timeout. Ao timeout junta-se o tempo que a fila de saída ainda leva a esvaziar.
+static void startTimer(void) {
+    struct itimerval timer;
+    unsigned long long usec = linkLayer.settings->timeout * 1000000ULL;
+    int queued = outputQueued(linkLayer.serialFileDescriptor);
+
+    if (queued > 0 && linkLayer.baudRate != 0)
+        usec += (unsigned long long) queued * BITS_PER_BYTE * 1000000ULL / linkLayer.baudRate;
+
+    timer.it_interval.tv_sec = 0;
+    timer.it_interval.tv_usec = 0;
+    timer.it_value.tv_sec = (time_t) (usec / 1000000ULL);
+    timer.it_value.tv_usec = (suseconds_t) (usec % 1000000ULL);
+    setitimer(ITIMER_REAL, &timer, NULL);
+}
+
 static void alarm_handler(int signo) {
     alarmed = true;
     linkLayer.reg.numTimeouts++;
@@ -572,6 +1033,51 @@ static int changeSequenceNumber(void) {
     return 1 - linkLayer.sequenceNumber;
 }
 
+// Campo C das tramas I: N(S) no bit 6 e, em full-duplex, N(R) no bit 7
+static uint8_t iFrameControl(void) {
+    uint8_t C = (uint8_t) (C_I_RAW | (linkLayer.sequenceNumber << 6));
+    if (linkLayer.settings->fullDuplex)
+        C |= (uint8_t) (linkLayer.receiveSequenceNumber << 7);
+    return C;
+}
+
+// (Re)envia o pacote pendente; o N(R) é o actual, por isso leva a confirmação
+static int sendPendingPacket(void) {
+    size_t stuffedFrameSize;
+    ssize_t res;
+    uint8_t * stuffedFrame = buildIFrame(linkLayer.pendingPacket,
+            linkLayer.pendingPacketSize, &stuffedFrameSize);
+    if ( stuffedFrame == NULL )
+        return -1;
+
+    res = sendFrame(stuffedFrame, stuffedFrameSize);
+    free(stuffedFrame);
+    if (res < 1)
+        return -1;
+    linkLayer.ackPending = false;
+    return 0;
+}
+
+static int sendSupervision(uint8_t C) {
+    size_t cmdSize;
+    ssize_t res;
+    uint8_t * cmd = buildFrameHeader(A_CSENDER_RRECEIVER, C, &cmdSize, false);
+    if ( cmd == NULL )
+        return -1;
+
+    res = sendFrame(cmd, cmdSize);
+    free(cmd);
+    return (res < 1) ? -1 : 0;
+}
+
+// Todas as tramas vão para a linha por aqui, para ficarem no trace
+static ssize_t sendFrame(const uint8_t * frame, size_t size) {
+    ssize_t res = write(linkLayer.serialFileDescriptor, frame, size);
+
+    tracerecord(TRACE_TX, size > 2 ? frame[2] : 0, size, res == (ssize_t) size ? TRACE_OK : TRACE_FAILED);
+    return res;
+}
+
 static void print_frame(uint8_t * frame, size_t size) {
     size_t i;
     for (i = 0; i < size; ++i)
@@ -590,6 +1096,12 @@ static void print_cmd(uint8_t C) {
     case C_DISC:
         fprintf(stderr, "C_DISC");
         break;
+    case C_BAUD:
+        fprintf(stderr, "C_BAUD");
+        break;
+    case C_BAUD_END:
+        fprintf(stderr, "C_BAUD_END");
+        break;
     case C_RR_RAW:
         fprintf(stderr, "C_RR_0");
         break;
@@ -602,6 +1114,12 @@ static void print_cmd(uint8_t C) {
     case (C_REJ_RAW | 0x80):
         fprintf(stderr, "C_REJ_1");
         break;
+    case C_RNR_RAW:
+        fprintf(stderr, "C_RNR_0");
+        break;
+    case (C_RNR_RAW | 0x80):
+        fprintf(stderr, "C_RNR_1");
+        break;
     case C_I_RAW:
         fprintf(stderr, "C_I_0");
         break;
@@ -614,158 +1132,221 @@ static void print_cmd(uint8_t C) {
 }
 
 static bool isCMD(uint8_t ch) {
-    return (ch == C_SET || ch == C_UA || ch == C_DISC || (ch & 0x7F) == C_RR_RAW
-            || (ch & 0x7F) == C_REJ_RAW);
+    return (ch == C_SET || ch == C_UA || ch == C_DISC || ch == C_BAUD
+            || ch == C_BAUD_END || (ch & 0x7F) == C_RR_RAW || (ch & 0x7F) == C_REJ_RAW
+            || (ch & 0x7F) == C_RNR_RAW);
 }
 
 static bool isCMDI(uint8_t ch) {
+    if (linkLayer.settings->fullDuplex)
+        return (ch & 0x3F) == C_I_RAW;
     return (ch & 0xBF) == C_I_RAW;
 }
 
 static bool readCMD(uint8_t * C) {
+    FrameParser parser;
     ssize_t res;
-    uint8_t ch, BCC1 = 0x00, BCC2 = 0x00, temp;
-    bool stuffing = false;
-    State state = START;
+    size_t consumed;
+    bool complete;
+    unsigned int repaired;
+
+    parser.state = START;
+    parser.C = C;
+    parser.BCC1 = 0x00;
+    parser.BCC2 = 0x00;
+    linkLayer.frameLength = 0;
+
+    while (!alarmed) {
+        if (linkLayer.rxStart == linkLayer.rxEnd) {
+            res = read(linkLayer.serialFileDescriptor, linkLayer.rxBuffer, RX_BUFFER_SIZE);
+            if (res == 0)
+                parser.state = START;
+            if (res <= 0)
+                continue;
+            linkLayer.rxStart = 0;
+            linkLayer.rxEnd = (size_t) res;
+            traceraw(linkLayer.rxBuffer, (size_t) res);
+        }
+
+        repaired = linkLayer.reg.numRepaired;
+        complete = parseFrame(&parser, linkLayer.rxBuffer + linkLayer.rxStart,
+                linkLayer.rxEnd - linkLayer.rxStart, &consumed);
+        linkLayer.rxStart += consumed;
+        if (complete) {
+            if (isCMD(*C))
+                tracerecord(TRACE_RX, *C, 5, TRACE_OK);
+            else if (linkLayer.frame[linkLayer.frameLength - 1] != F)
+                tracerecord(TRACE_RX, *C, linkLayer.frameLength, TRACE_BAD);
+            else
+                tracerecord(TRACE_RX, *C, linkLayer.frameLength,
+                        repaired != linkLayer.reg.numRepaired ? TRACE_REPAIRED : TRACE_OK);
+            return true;
+        }
+    }
+    tracerecord(TRACE_RX, 0, 0, TRACE_TIMEOUT);
+    return false;
+}
+
+static bool parseFrame(FrameParser * parser, const uint8_t * buffer, size_t size,
+        size_t * consumed) {
+    const size_t maxFrameLength = linkLayer.maxFrameLength;
     bool headerErrorTest = false;
+    bool frameOk;
     bool bodyErrorTest = false;
+    size_t i = 0, run, room;
+    uint8_t ch, byteClass;
+    State next;
+
+    while (i < size) {
+        ch = buffer[i];
+
+        if (parser->state == RCV_I) {
+            if (linkLayer.frameLength >= maxFrameLength) {
+                fprintf(stderr, "This payload is invalid cause it exceeds the max number of bytes\n");
+                linkLayer.frameLength = 0;
+                parser->state = (ch == F) ? F_RCV : START;
+                ++i;
+                continue;
+            }
 
-    linkLayer.frameLength = 0;
+            // Caminho rápido: copia de uma vez a sequência de bytes sem F nem ESC
+            room = maxFrameLength - linkLayer.frameLength;
+            for (run = 0; run < room && i + run < size; ++run) {
+                ch = buffer[i + run];
+                if (ch == F || ch == ESC)
+                    break;
+                parser->BCC2 ^= ch;
+            }
+            if (run != 0) {
+                memcpy(linkLayer.frame + linkLayer.frameLength, buffer + i, run);
+                linkLayer.frameLength += run;
+                i += run;
+                continue;
+            }
 
-    while (!alarmed) {
-        res = read(linkLayer.serialFileDescriptor, &ch, 1);
-
-        if(res == 0)
-            state = START;
-        else if ( res == 1 ) {
-            fprintf(stderr, "State: %d      Res: %lu      C: %X\n", state, res, ch);
-            switch (state) {
-            case START:
-                if (ch == F)
-                    state = F_RCV;
-                break;
-            case F_RCV:
-                if (ch == A_CSENDER_RRECEIVER) {
-                    state = A_RCV;
-                    BCC1 = ch;
-                } else if (ch != F)
-                    state = START;
-                break;
-            case A_RCV:
-                if (ch == F)
-                    state = F_RCV;
-                else {
-                    if (isCMD(ch) || isCMDI(ch)) {
-                        BCC1 ^= ch;
-                        *C = ch;
-                        state = C_RCV;
-                    } else
-                        state = START;
-                }
-                break;
-            case C_RCV:
-                 //headerErrorTest = random_bool(0.15); //Gerador de erros no header em software 15% probabilidade
-                 if( headerErrorTest ) {   //Random error generator
-                        fprintf(stderr, "Erro aleatório, header tem erros\n");
-                        BCC1 ^= 0x05;
-                        headerErrorTest = false;
-                 }
-
-                if (stuffing) { //Destuffing in run-time
-                    stuffing = false;
-                    if ((ch ^ STUFFING_XOR_BYTE) == BCC1) {
-                        state = BCC_OK;
-                    }
-                    else
-                         state = START;
-
-                } else if (ch == ESC) {
-                    stuffing = true;
-                } else if (ch == BCC1) {
-                    state = BCC_OK;
-                } else if (ch == F)
-                    state = F_RCV;
-                else
-                    state = START;
-                break;
-            case BCC_OK:
-                if (ch == F && isCMD(*C)) {
-                    fprintf(stderr, "Received CMD: ");
-                    print_cmd(*C);
-                    fprintf(stderr, "\n");
-                    return true;
-                } else if (isCMDI(*C) && (ch != F) && linkLayer.is_receiver) {
-                    linkLayer.frame[linkLayer.frameLength++] = F;
-                    linkLayer.frame[linkLayer.frameLength++] = A_CSENDER_RRECEIVER;
-                    linkLayer.frame[linkLayer.frameLength++] = *C;
-                    linkLayer.frame[linkLayer.frameLength++] = BCC1;
-                    if ( ch == ESC ) {
-                        stuffing = true;
-                        BCC2 = 0x00;
-                    } else {
-                        linkLayer.frame[linkLayer.frameLength++] = ch;
-                        BCC2 = ch;
-                    }
-                    state = RCV_I;
-                    fprintf(stderr, "Receiving Frame I\n");
-                } else
-                    state = START;
-                break;
-            case RCV_I:
-                if (linkLayer.frameLength >= (linkLayer.settings->payloadSize + 6)) {
-                    fprintf(stderr, "This payload is invalid cause it exceeds the max number of bytes\n");
-                    linkLayer.frameLength = 0;
-                    if (ch == F)
-                        state = F_RCV;
-                    else
-                        state = START;
-                } else if ( (ch == F) && stuffing ) {
-                    state = F_RCV;
-                    linkLayer.frameLength = 0;
-                    stuffing = false;
-                } else if (ch == F) {
-                    //bodyErrorTest = random_bool(0.30); //Gerador de erros em software no campo de dados
-                    if( bodyErrorTest ) {
-                        fprintf(stderr, "Erro aleatório, body tem erros\n");
-                        BCC2 ^= 0x05;
-                        bodyErrorTest = false;
-                    }
-                    BCC2 ^= linkLayer.frame[linkLayer.frameLength - 1]; // Reverter, pois o ultimo é o BCC
-                    if (BCC2 == linkLayer.frame[linkLayer.frameLength - 1]) {
-                        linkLayer.frame[linkLayer.frameLength++] = ch;
-                        fprintf(stderr, "Received Frame I, Length: %lu\n", linkLayer.frameLength);
-                    }
-                    return true; // Uma vez que tem o cabeçalho da header válido, Rej e RR, fora ele verifica se o último elemento é F ou não
-                } else if (stuffing) {  //Destuffing in run-time
-                    stuffing = false;
-                    temp = ch ^ STUFFING_XOR_BYTE;
-                    linkLayer.frame[linkLayer.frameLength++] = temp;
-                    BCC2 ^= temp;
-                } else if (ch == ESC) {
-                    stuffing = true;
-                } else {
-                    BCC2 ^= ch;
-                    linkLayer.frame[linkLayer.frameLength++] = ch;
-                }
-                break;
-            default:
-                return false;
-                break;
+            ++i;
+            if (ch == ESC) {
+                parser->state = RCV_I_ESC;
+                continue;
             }
+
+            // ch == F, fim da trama I
+            //bodyErrorTest = random_bool(0.30); //Gerador de erros em software no campo de dados
+            if( bodyErrorTest ) {
+                fprintf(stderr, "Erro aleatório, body tem erros\n");
+                parser->BCC2 ^= 0x05;
+                bodyErrorTest = false;
+            }
+            if (linkLayer.settings->fecRoots != 0)
+                frameOk = repairFrame();
+            else {
+                parser->BCC2 ^= linkLayer.frame[linkLayer.frameLength - 1]; // Reverter, pois o ultimo é o BCC
+                frameOk = (parser->BCC2 == linkLayer.frame[linkLayer.frameLength - 1]);
+            }
+            if (frameOk) {
+                linkLayer.frame[linkLayer.frameLength++] = ch;
+                fprintf(stderr, "Received Frame I, Length: %lu\n", linkLayer.frameLength);
+            }
+            *consumed = i;
+            return true; // Uma vez que tem o cabeçalho da header válido, Rej e RR, fora ele verifica se o último elemento é F ou não
+        }
+
+        ++i;
+
+        if (parser->state == RCV_I_ESC) { //Destuffing in run-time
+            if (linkLayer.frameLength >= maxFrameLength) {
+                fprintf(stderr, "This payload is invalid cause it exceeds the max number of bytes\n");
+                linkLayer.frameLength = 0;
+                parser->state = (ch == F) ? F_RCV : START;
+            } else if (ch == F) {
+                linkLayer.frameLength = 0;
+                parser->state = F_RCV;
+            } else {
+                ch ^= STUFFING_XOR_BYTE;
+                linkLayer.frame[linkLayer.frameLength++] = ch;
+                parser->BCC2 ^= ch;
+                parser->state = RCV_I;
+            }
+            continue;
+        }
+
+        // Fase do cabeçalho: transição dada pela tabela (estado x classe do byte)
+        byteClass = byteClasses[ch];
+        if (parser->state == C_RCV || parser->state == C_ESC) {
+            //headerErrorTest = random_bool(0.15); //Gerador de erros no header em software 15% probabilidade
+            if( headerErrorTest ) {   //Random error generator
+                fprintf(stderr, "Erro aleatório, header tem erros\n");
+                parser->BCC1 ^= 0x05;
+                headerErrorTest = false;
+            }
+            if (parser->state == C_RCV && ch == parser->BCC1)
+                byteClass = CLASS_BCC;
+            else if (parser->state == C_ESC && (ch ^ STUFFING_XOR_BYTE) == parser->BCC1)
+                byteClass = CLASS_BCC;
+        }
+        next = (State) headerTransitions[parser->state][byteClass];
+
+        switch (next) {
+        case A_RCV:
+            parser->BCC1 = ch;
+            break;
+        case C_RCV:
+            *parser->C = ch;
+            parser->BCC1 ^= ch;
+            break;
+        case BCC_OK:
+            if (isCMD(*parser->C))
+                next = BCC_OK_CMD;
+            else if (linkLayer.is_receiver || linkLayer.settings->fullDuplex)
+                next = BCC_OK_I;
+            else
+                next = BCC_OK_DROP;
+            break;
+        case CMD_RCV:
+            fprintf(stderr, "Received CMD: ");
+            print_cmd(*parser->C);
+            fprintf(stderr, "\n");
+            parser->state = START;
+            *consumed = i;
+            return true;
+        case RCV_I:
+        case RCV_I_ESC:
+            linkLayer.frameLength = 0;
+            linkLayer.frame[linkLayer.frameLength++] = F;
+            linkLayer.frame[linkLayer.frameLength++] = A_CSENDER_RRECEIVER;
+            linkLayer.frame[linkLayer.frameLength++] = *parser->C;
+            linkLayer.frame[linkLayer.frameLength++] = parser->BCC1;
+            if (next == RCV_I) {
+                linkLayer.frame[linkLayer.frameLength++] = ch;
+                parser->BCC2 = ch;
+            } else
+                parser->BCC2 = 0x00;
+            fprintf(stderr, "Receiving Frame I\n");
+            break;
+        case START: // Estados sem nada a guardar
+        case F_RCV:
+        case C_ESC:
+        case BCC_OK_CMD:
+        case BCC_OK_I:
+        case BCC_OK_DROP:
+            break;
+        default:
+            break;
         }
+        parser->state = next;
     }
+
+    *consumed = i;
     return false;
 }
 
 static uint8_t * stuff(uint8_t * packet, size_t size, size_t * stuffedSize) {
-    *stuffedSize = size+1;
-
     if ( size == 0 || stuffedSize == NULL || packet == NULL ) {
         errno = EINVAL;
         return NULL;
     }
 
-    uint8_t BCC = generateBcc(packet, size);
+    *stuffedSize = size;
 
     size_t i;
     for (i = 0; i < size; ++i) {
@@ -773,9 +1354,6 @@ static uint8_t * stuff(uint8_t * packet, size_t size, size_t * stuffedSize) {
             (*stuffedSize)++;
     }
 
-    if(BCC == ESC || BCC == F)
-        (*stuffedSize)++;
-
     uint8_t * stuffed = (uint8_t *) malloc(*stuffedSize);
     if ( stuffed == NULL ) {
         errno = ENOMEM;
@@ -791,15 +1369,32 @@ static uint8_t * stuff(uint8_t * packet, size_t size, size_t * stuffedSize) {
             stuffed[j++] = packet[i];
     }
 
-    if(BCC == ESC || BCC == F) {
-        stuffed[j++] = ESC;
-        stuffed[j] = BCC ^ STUFFING_XOR_BYTE;
-    } else
-        stuffed[j] = BCC;
-
     return stuffed;
 }
 
+// Corrige o corpo da trama I recebida (payload + BCC2 + paridade) e tira-lhe a paridade
+static bool repairFrame(void) {
+    size_t bodySize;
+    int repaired;
+
+    repaired = fecDecode(linkLayer.frame + 4, linkLayer.frameLength - 4, linkLayer.settings->fecRoots, &bodySize);
+    if (repaired < 0 || bodySize < 2) {
+        fprintf(stderr, "FEC: too many errors to repair the frame\n");
+        return false;
+    }
+    linkLayer.frameLength = 4 + bodySize;
+    if (generateBcc(linkLayer.frame + 4, bodySize - 1) != linkLayer.frame[linkLayer.frameLength - 1]) {
+        fprintf(stderr, "FEC: repaired frame fails the BCC2\n");
+        return false;
+    }
+    if (repaired > 0) {
+        fprintf(stderr, "FEC: repaired %d bytes\n", repaired);
+        linkLayer.reg.numRepaired++;
+        linkLayer.reg.numBytesRepaired += (unsigned int) repaired;
+    }
+    return true;
+}
+
 static uint8_t* buildFrameHeader(uint8_t A, uint8_t C, size_t *headerSize,
         bool is_IframeHead) {
 
@@ -848,20 +1443,37 @@ static uint8_t* buildFrameHeader(uint8_t A, uint8_t C, size_t *headerSize,
 static uint8_t * buildIFrame(uint8_t * packet, size_t packetSize,
         size_t * stuffedFrameSize) {
 
-    if ( packet == NULL || stuffedFrameSize == NULL ) {
+    if ( packet == NULL || packetSize == 0 || stuffedFrameSize == NULL ) {
         errno = EINVAL;
         return NULL;
     }
 
     size_t stuffedHeaderSize;
     uint8_t * stuffedHeader = buildFrameHeader(A_CSENDER_RRECEIVER,
-            (linkLayer.sequenceNumber << 6), &stuffedHeaderSize, true);
+            iFrameControl(), &stuffedHeaderSize, true);
     if ( stuffedHeader == NULL ) {
         errno = ENOMEM;
         return NULL;
     }
+
+    // Corpo: payload + BCC2, seguidos da paridade Reed-Solomon se houver FEC
+    size_t bodySize = packetSize + 1;
+    if ( linkLayer.settings->fecRoots != 0 )
+        bodySize = fecEncodedSize(packetSize + 1, linkLayer.settings->fecRoots);
+    uint8_t * body = (uint8_t *) malloc(bodySize);
+    if ( body == NULL ) {
+        free(stuffedHeader);
+        errno = ENOMEM;
+        return NULL;
+    }
+    memcpy(body, packet, packetSize);
+    body[packetSize] = generateBcc(packet, packetSize);
+    if ( linkLayer.settings->fecRoots != 0 )
+        fecEncode(body, packetSize + 1, linkLayer.settings->fecRoots, body + packetSize + 1);
+
     size_t stuffedPacketSize;
-    uint8_t * stuffedPacket = stuff(packet, packetSize, &stuffedPacketSize);
+    uint8_t * stuffedPacket = stuff(body, bodySize, &stuffedPacketSize);
+    free(body);
     if ( stuffedPacket == NULL ) {
         free(stuffedHeader);
         errno = ENOMEM;
@@ -906,6 +1518,11 @@ static void printRegister() {
     fprintf(stderr, "/////////////////////////////////////\n");
     fprintf(stderr, "Number of Frames I sent: %d\nNumber of Frames I resent: %d\n", linkLayer.reg.numFramesI, linkLayer.reg.numFramesIResent);
     fprintf(stderr, "Number of Timeouts: %d\nNumber of REJ: %d\nTime Spent: %li milliseconds\n", linkLayer.reg.numTimeouts, linkLayer.reg.numREJ, milliseconds);
+    if (linkLayer.reg.numRNR != 0)
+        fprintf(stderr, "Number of RNR: %u\n", linkLayer.reg.numRNR);
+    if (linkLayer.settings->fecRoots != 0)
+        fprintf(stderr, "Number of Frames I repaired by FEC: %u (%u bytes)\n", linkLayer.reg.numRepaired, linkLayer.reg.numBytesRepaired);
+    fprintf(stderr, "BaudRate: %u\n", linkLayer.baudRate);
     fprintf(stderr, "/////////////////////////////////////\n");
 }
 
@@ -15,6 +15,29 @@ int llwrite(uint8_t * packet, size_t packetSize);
 
 uint8_t * llread(size_t *payloadSize);
 
+/**
+ * Receptor, só sem full-duplex: com busy a true envia logo um RNR e confirma as
+ * tramas I com RNR em vez de RR, e o emissor fica à espera sem as reenviar
+ * (janela de recepção fechada). Com busy a false envia um RR e o emissor continua.
+ * Retorna 0 ou -1 (errno)
+ */
+int llsetreceiverbusy(bool busy);
+
+// Resultados do llexchange, podem vir combinados
+#define LL_SENT 0x01 // O pacote pendente foi confirmado
+#define LL_RECEIVED 0x02 // *received tem um pacote novo
+#define LL_DISCONNECTED 0x04 // O outro lado enviou DISC
+
+/**
+ * Full-duplex (settings->fullDuplex): envia packet (se não for NULL) e espera
+ * até o pacote pendente ser confirmado e/ou chegar um pacote do outro lado.
+ * As confirmações vão no N(R) das tramas I enviadas, ou num RR quando não há
+ * nada para enviar. Só pode haver um pacote pendente de cada vez.
+ * Retorna uma combinação de LL_SENT/LL_RECEIVED/LL_DISCONNECTED ou -1 (errno)
+ */
+int llexchange(uint8_t * packet, size_t packetSize, uint8_t ** received,
+        size_t * receivedSize);
+
 int llclose(void);
 
 #endif
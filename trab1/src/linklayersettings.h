@@ -1,14 +1,22 @@
 #ifndef LINK_LAYER_SETTINGS_H
 #define LINK_LAYER_SETTINGS_H
 
-#include <termios.h>
+#include "useful.h"
 
 typedef struct {
     char const * port;
     unsigned int timeout;
     unsigned int numAttempts;
     unsigned int payloadSize;
-    tcflag_t baudRate;
+    unsigned int baudRate; // bits/s
+    unsigned int maxBaudRate; // Negociar até este baudRate, 0 para não negociar
+    unsigned char vmin; // VMIN do termios, bytes mínimos por read()
+    unsigned char vtime; // VTIME do termios, em décimas de segundo
+    bool lowLatency; // ASYNC_LOW_LATENCY
+    bool hwFlowControl; // RTS/CTS
+    bool fullDuplex; // Tramas I nos dois sentidos, com N(R) no campo C
+    unsigned int fecRoots; // Bytes de paridade Reed-Solomon por palavra de código das tramas I, 0 sem FEC
+    char const * traceFile; // Onde escrever o trace das tramas no fim, NULL para só o escrever se a ligação falhar
 } LinkLayerSettings;
 
 #endif
@@ -0,0 +1,334 @@
+#define _POSIX_C_SOURCE 200809L // pthread_sigmask
+
+#include "llasync.h"
+#include "linklayer.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <pthread.h>
+
+typedef struct {
+    uint8_t *packet;
+    size_t size;
+    LLCompletion done;
+    void *context;
+    int result;
+    int error;
+} Submission;
+
+typedef struct {
+    uint8_t *packet; // NULL no DISC ou em caso de erro
+    size_t size;
+    int error;
+} Delivery;
+
+typedef struct {
+    pthread_t worker;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    sigset_t savedMask; // Máscara de quem chamou o llasyncstart
+    int fds[2]; // Pipe das notificações: [0] para o poll, [1] para a thread
+    bool running;
+    bool receiver;
+    bool stopping;
+    bool failed; // Um llwrite falhou, o resto da fila já não vai para a linha
+    // Os contadores só crescem, o lugar na fila é contador % LL_QUEUE_SIZE
+    Submission queue[LL_QUEUE_SIZE];
+    unsigned long int submitted, sent, reaped;
+    Delivery ring[LL_QUEUE_SIZE];
+    unsigned long int delivered, consumed;
+} Async;
+
+static Async async = { .running = false, .fds = { -1, -1 } };
+
+/**
+ * @desc Thread do emissor: llwrite dos pacotes da fila, por ordem
+ */
+static void * sendWorker(void *arg);
+
+/**
+ * @desc Thread do receptor: llread para o anel até ao DISC ou a um erro
+ */
+static void * receiveWorker(void *arg);
+
+/**
+ * @desc Acorda quem espera pela thread, com o lock fechado
+ */
+static void notify(void);
+
+/**
+ * @desc Esvazia o pipe das notificações
+ */
+static void drainNotifications(void);
+
+int llasyncstart(bool receiver) {
+    sigset_t alarmSet;
+    int i;
+
+    if ( async.running ) {
+        errno = EBUSY;
+        return -1;
+    }
+    memset(async.queue, 0, sizeof(async.queue));
+    memset(async.ring, 0, sizeof(async.ring));
+    async.submitted = async.sent = async.reaped = 0;
+    async.delivered = async.consumed = 0;
+    async.receiver = receiver;
+    async.stopping = false;
+    async.failed = false;
+
+    if ( pipe(async.fds) != 0 )
+        return -1;
+    for (i = 0; i < 2; ++i)
+        fcntl(async.fds[i], F_SETFL, fcntl(async.fds[i], F_GETFL) | O_NONBLOCK);
+    pthread_mutex_init(&async.lock, NULL);
+    pthread_cond_init(&async.changed, NULL);
+
+    // Os alarmes da linklayer têm de interromper a thread que está na porta série:
+    // quem chama bloqueia o SIGALRM e a thread (que herda a máscara) desbloqueia-o
+    sigemptyset(&alarmSet);
+    sigaddset(&alarmSet, SIGALRM);
+    pthread_sigmask(SIG_BLOCK, &alarmSet, &async.savedMask);
+    if ( (errno = pthread_create(&async.worker, NULL, receiver ? receiveWorker : sendWorker, NULL)) != 0 ) {
+        pthread_sigmask(SIG_SETMASK, &async.savedMask, NULL);
+        close(async.fds[0]);
+        close(async.fds[1]);
+        return -1;
+    }
+    async.running = true;
+    return 0;
+}
+
+bool llasyncactive(void) {
+    return async.running;
+}
+
+int llsubmit(uint8_t const *packet, size_t packetSize, LLCompletion done, void *context) {
+    Submission *slot;
+    uint8_t *copy;
+
+    if ( !async.running || async.receiver || packet == NULL || packetSize == 0 ) {
+        errno = EINVAL;
+        return -1;
+    }
+    if ( (copy = (uint8_t *) malloc(packetSize)) == NULL ) {
+        errno = ENOMEM;
+        return -1;
+    }
+    memcpy(copy, packet, packetSize);
+
+    pthread_mutex_lock(&async.lock);
+    while ( async.submitted - async.reaped == LL_QUEUE_SIZE ) {
+        // Fila cheia: espera que a thread acabe um e recolhe-o para libertar o lugar
+        while ( async.sent == async.reaped )
+            pthread_cond_wait(&async.changed, &async.lock);
+        pthread_mutex_unlock(&async.lock);
+        llreap();
+        pthread_mutex_lock(&async.lock);
+    }
+    if ( async.failed ) {
+        pthread_mutex_unlock(&async.lock);
+        free(copy);
+        errno = ECONNABORTED;
+        return -1;
+    }
+    slot = &async.queue[async.submitted % LL_QUEUE_SIZE];
+    slot->packet = copy;
+    slot->size = packetSize;
+    slot->done = done;
+    slot->context = context;
+    ++async.submitted;
+    pthread_cond_broadcast(&async.changed);
+    pthread_mutex_unlock(&async.lock);
+    return 0;
+}
+
+int llcompletionfd(void) {
+    return async.running ? async.fds[0] : -1;
+}
+
+int llreap(void) {
+    Submission slot;
+    int count = 0;
+    bool failed;
+
+    drainNotifications();
+    while (1) {
+        pthread_mutex_lock(&async.lock);
+        if ( async.reaped == async.sent ) {
+            failed = async.failed;
+            pthread_mutex_unlock(&async.lock);
+            break;
+        }
+        slot = async.queue[async.reaped % LL_QUEUE_SIZE];
+        ++async.reaped;
+        pthread_mutex_unlock(&async.lock);
+
+        // Sem o lock: o callback pode voltar a submeter
+        if ( slot.done != NULL )
+            slot.done(slot.context, slot.result, slot.error);
+        free(slot.packet);
+        ++count;
+    }
+    return failed ? -1 : count;
+}
+
+uint8_t * llreceive(size_t *payloadSize) {
+    Delivery entry;
+
+    if ( !async.running || !async.receiver || payloadSize == NULL ) {
+        errno = EINVAL;
+        return NULL;
+    }
+    pthread_mutex_lock(&async.lock);
+    while ( async.consumed == async.delivered )
+        pthread_cond_wait(&async.changed, &async.lock);
+    entry = async.ring[async.consumed % LL_QUEUE_SIZE];
+    ++async.consumed;
+    pthread_cond_broadcast(&async.changed);
+    pthread_mutex_unlock(&async.lock);
+    drainNotifications();
+
+    *payloadSize = entry.size;
+    errno = entry.error;
+    return entry.packet;
+}
+
+int llasyncstop(void) {
+    bool failed;
+
+    if ( !async.running ) {
+        errno = EINVAL;
+        return -1;
+    }
+    pthread_mutex_lock(&async.lock);
+    async.stopping = true;
+    pthread_cond_broadcast(&async.changed);
+    pthread_mutex_unlock(&async.lock);
+    // O emissor só acaba com a fila vazia; o receptor já acabou ou acaba no próximo llread
+    pthread_join(async.worker, NULL);
+    pthread_sigmask(SIG_SETMASK, &async.savedMask, NULL);
+
+    llreap();
+    while ( async.consumed != async.delivered )
+        free(async.ring[async.consumed++ % LL_QUEUE_SIZE].packet);
+    failed = async.failed;
+
+    close(async.fds[0]);
+    close(async.fds[1]);
+    async.fds[0] = async.fds[1] = -1;
+    pthread_cond_destroy(&async.changed);
+    pthread_mutex_destroy(&async.lock);
+    async.running = false;
+    return failed ? -1 : 0;
+}
+
+static void * sendWorker(void *arg) {
+    Submission *slot;
+    sigset_t alarmSet;
+    int res, error;
+
+    (void) arg;
+    sigemptyset(&alarmSet);
+    sigaddset(&alarmSet, SIGALRM);
+    pthread_sigmask(SIG_UNBLOCK, &alarmSet, NULL);
+
+    pthread_mutex_lock(&async.lock);
+    while (1) {
+        while ( async.sent == async.submitted && !async.stopping )
+            pthread_cond_wait(&async.changed, &async.lock);
+        if ( async.sent == async.submitted )
+            break;
+        slot = &async.queue[async.sent % LL_QUEUE_SIZE];
+        pthread_mutex_unlock(&async.lock);
+
+        if ( async.failed ) { // Só esta thread o põe a true
+            res = -1;
+            error = ECONNABORTED;
+        } else {
+            res = llwrite(slot->packet, slot->size);
+            error = errno;
+        }
+
+        pthread_mutex_lock(&async.lock);
+        slot->result = res;
+        slot->error = res == 0 ? 0 : error;
+        if ( res != 0 )
+            async.failed = true;
+        ++async.sent;
+        notify();
+    }
+    pthread_mutex_unlock(&async.lock);
+    return NULL;
+}
+
+static void * receiveWorker(void *arg) {
+    Delivery *entry;
+    sigset_t alarmSet;
+    uint8_t *packet;
+    size_t size = 0;
+    bool busy = false;
+    int error;
+
+    (void) arg;
+    sigemptyset(&alarmSet);
+    sigaddset(&alarmSet, SIGALRM);
+    pthread_sigmask(SIG_UNBLOCK, &alarmSet, NULL);
+
+    do {
+        pthread_mutex_lock(&async.lock);
+        while ( async.delivered - async.consumed == LL_QUEUE_SIZE && !async.stopping ) {
+            // Anel cheio: a applayer está atrasada, o emissor espera sem reenviar
+            if ( !busy ) {
+                pthread_mutex_unlock(&async.lock);
+                llsetreceiverbusy(true);
+                busy = true;
+                pthread_mutex_lock(&async.lock);
+                continue;
+            }
+            pthread_cond_wait(&async.changed, &async.lock);
+        }
+        if ( async.stopping ) {
+            pthread_mutex_unlock(&async.lock);
+            break;
+        }
+        pthread_mutex_unlock(&async.lock);
+        if ( busy ) {
+            llsetreceiverbusy(false);
+            busy = false;
+        }
+
+        packet = llread(&size);
+        error = errno;
+
+        pthread_mutex_lock(&async.lock);
+        entry = &async.ring[async.delivered % LL_QUEUE_SIZE];
+        entry->packet = packet;
+        entry->size = size;
+        entry->error = error;
+        ++async.delivered;
+        notify();
+        pthread_mutex_unlock(&async.lock);
+    } while ( packet != NULL );
+    return NULL;
+}
+
+static void notify(void) {
+    uint8_t byte = 1;
+
+    pthread_cond_broadcast(&async.changed);
+    // Com o pipe cheio o descritor já está pronto, não faz mal perder este byte
+    if ( write(async.fds[1], &byte, 1) < 0 && errno != EAGAIN )
+        perror("llasync notify");
+}
+
+static void drainNotifications(void) {
+    uint8_t bytes[64];
+
+    while ( read(async.fds[0], bytes, sizeof(bytes)) > 0 )
+        ;
+}
@@ -0,0 +1,74 @@
+#ifndef LL_ASYNC_H
+#define LL_ASYNC_H
+
+#include "useful.h"
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define LL_QUEUE_SIZE 8 // Pacotes à espera de cada lado (envio e recepção)
+
+/**
+ * Interface assíncrona da linklayer, só sem full-duplex. Uma thread fica com a
+ * ligação (llwrite ou llread) e a applayer continua a ler e escrever ficheiros
+ * enquanto as tramas anteriores estão na linha.
+ * Emissor: llsubmit mete o pacote na fila e retorna logo, o resultado chega
+ * depois pelo callback, chamado dentro do llreap na thread de quem o chama.
+ * Receptor: a thread faz llread para um anel e o llreceive tira de lá os
+ * pacotes; com o anel cheio o emissor fica parado por um RNR.
+ */
+
+/**
+ * Resultado de um pacote submetido
+ * @arg void *context: o que foi dado ao llsubmit
+ * @arg int result: 0 se foi confirmado, -1 se não
+ * @arg int error: errno do llwrite quando result é -1
+ */
+typedef void (*LLCompletion)(void *context, int result, int error);
+
+/**
+ * @desc Passa a ligação (já aberta com llopen) para a thread
+ * @arg bool receiver: true para receber (llread), false para enviar (llwrite)
+ * @return Retorna 0 em caso de sucesso e -1 em caso de erro
+ */
+int llasyncstart(bool receiver);
+
+/**
+ * @desc Se a ligação está com a thread
+ */
+bool llasyncactive(void);
+
+/**
+ * @desc Mete uma cópia do pacote na fila de envio, só espera se a fila estiver cheia
+ * @arg LLCompletion done: pode ser NULL
+ * @return Retorna 0 em caso de sucesso e -1 se um pacote anterior falhou ou em caso de erro
+ */
+int llsubmit(uint8_t const *packet, size_t packetSize, LLCompletion done, void *context);
+
+/**
+ * @desc Descritor que fica pronto para leitura (poll/select) quando há pacotes
+ * confirmados por recolher ou pacotes recebidos no anel
+ * @return Retorna o descritor, -1 se a thread não estiver a correr
+ */
+int llcompletionfd(void);
+
+/**
+ * @desc Chama os callbacks dos pacotes já tratados pela thread, sem esperar
+ * @return Retorna quantos recolheu, -1 se algum pacote falhou
+ */
+int llreap(void);
+
+/**
+ * @desc Como o llread, mas tira o próximo pacote do anel
+ * @return Retorna o pacote (a libertar com free), NULL com errno a 0 no DISC e
+ * NULL com errno diferente de 0 em caso de erro
+ */
+uint8_t * llreceive(size_t *payloadSize);
+
+/**
+ * @desc Espera que a fila de envio se esvazie e pára a thread; depois disto já se pode chamar llclose
+ * @return Retorna 0 se todos os pacotes foram confirmados e -1 se não
+ */
+int llasyncstop(void);
+
+#endif
@@ -0,0 +1,132 @@
+#include "mux.h"
+#include "linklayer.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+typedef struct {
+    unsigned int weight;
+    MuxProducer producer;
+    void *context;
+    uint8_t *head; // Próximo pacote do canal, já com o cabeçalho
+    size_t headSize; // 0 se ainda não foi produzido
+    size_t deficit; // Crédito em bytes (DRR)
+    bool done;
+    unsigned long int bytesSent;
+} Channel;
+
+typedef struct {
+    Channel channels[MUX_MAX_CHANNELS];
+    size_t numChannels;
+    size_t maxPacketSize;
+} Mux;
+
+static Mux mux;
+
+/**
+ * @desc Garante que o canal tem o próximo pacote em head
+ * @return Retorna 1 se tiver, 0 se o canal acabou e -1 em caso de erro
+ */
+static int fillHead(Channel *channel);
+
+int muxinitialize(size_t maxPacketSize) {
+    if ( maxPacketSize == 0 ) {
+        errno = EINVAL;
+        return -1;
+    }
+    muxclose();
+    mux.maxPacketSize = maxPacketSize;
+    return 0;
+}
+
+int muxaddchannel(unsigned int weight, MuxProducer producer, void *context) {
+    Channel *channel;
+
+    if ( producer == NULL || weight == 0 || mux.numChannels == MUX_MAX_CHANNELS ) {
+        errno = EINVAL;
+        return -1;
+    }
+    channel = &mux.channels[mux.numChannels];
+    channel->head = (uint8_t *) malloc(MUX_HEADER_SIZE + mux.maxPacketSize);
+    if ( channel->head == NULL ) {
+        errno = ENOMEM;
+        return -1;
+    }
+    channel->head[0] = C_MUX;
+    channel->head[1] = (uint8_t) mux.numChannels;
+    channel->headSize = 0;
+    channel->weight = weight;
+    channel->producer = producer;
+    channel->context = context;
+    channel->deficit = 0;
+    channel->done = false;
+    channel->bytesSent = 0;
+    return (int) mux.numChannels++;
+}
+
+int muxrun(void) {
+    Channel *channel;
+    size_t i, active;
+    int res;
+
+    do {
+        active = 0;
+        for (i = 0; i < mux.numChannels; ++i) {
+            channel = &mux.channels[i];
+            if ( channel->done )
+                continue;
+
+            channel->deficit += channel->weight * mux.maxPacketSize;
+            while ( (res = fillHead(channel)) == 1 && channel->headSize - MUX_HEADER_SIZE <= channel->deficit ) {
+                if ( llwrite(channel->head, channel->headSize) != 0 ) {
+                    fprintf(stderr, "muxrun: llwrite failed on channel %lu\n", i);
+                    return -1;
+                }
+                channel->deficit -= channel->headSize - MUX_HEADER_SIZE;
+                channel->bytesSent += channel->headSize - MUX_HEADER_SIZE;
+                channel->headSize = 0;
+            }
+            if ( res == -1 )
+                return -1;
+            if ( res == 0 ) { // Canal vazio não guarda crédito
+                channel->done = true;
+                channel->deficit = 0;
+                fprintf(stderr, "muxrun: channel %lu finished, %lu bytes\n", i, channel->bytesSent);
+            } else ++active;
+        }
+    } while ( active > 0 );
+    return 0;
+}
+
+uint8_t * muxunwrap(uint8_t *packet, size_t size, uint8_t *channel, size_t *innerSize) {
+    if ( packet == NULL || size <= MUX_HEADER_SIZE || packet[0] != C_MUX )
+        return NULL;
+    *channel = packet[1];
+    *innerSize = size - MUX_HEADER_SIZE;
+    return packet + MUX_HEADER_SIZE;
+}
+
+void muxclose(void) {
+    size_t i;
+
+    for (i = 0; i < mux.numChannels; ++i)
+        free(mux.channels[i].head);
+    mux.numChannels = 0;
+}
+
+static int fillHead(Channel *channel) {
+    size_t size = 0;
+    int res;
+
+    if ( channel->headSize != 0 )
+        return 1;
+    res = channel->producer(channel->context, channel->head + MUX_HEADER_SIZE, &size);
+    if ( res == 1 ) {
+        if ( size == 0 || size > mux.maxPacketSize ) {
+            errno = EINVAL;
+            return -1;
+        }
+        channel->headSize = MUX_HEADER_SIZE + size;
+    }
+    return res;
+}
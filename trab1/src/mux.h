@@ -0,0 +1,60 @@
+#ifndef MUX_H
+#define MUX_H
+
+#include "useful.h"
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define C_MUX 0x07 // Primeiro byte dos pacotes multiplexados, os pacotes da applayer não o podem usar
+#define MUX_HEADER_SIZE 2 // C_MUX + canal
+#define MUX_MAX_CHANNELS 16
+
+/**
+ * Produz o próximo pacote de um canal
+ * @arg void *context: o que foi dado ao muxaddchannel
+ * @arg uint8_t *packet: onde escrever o pacote
+ * @arg size_t *size: número de bytes escritos
+ * @return Retorna 1 se escreveu um pacote, 0 se o canal acabou e -1 em caso de erro
+ */
+typedef int (*MuxProducer)(void *context, uint8_t *packet, size_t *size);
+
+/**
+ * @desc Prepara o multiplexer, sem canais
+ * @arg size_t maxPacketSize: tamanho máximo dos pacotes produzidos pelos canais
+ * @return Retorna 0 em caso de sucesso e -1 em caso de erro
+ */
+int muxinitialize(size_t maxPacketSize);
+
+/**
+ * @desc Junta um canal, com o id igual à ordem em que foi adicionado
+ * @arg unsigned int weight: peso no escalonamento, um canal de peso 2 recebe o dobro dos bytes da linha
+ * @return Retorna o id do canal ou -1 em caso de erro
+ */
+int muxaddchannel(unsigned int weight, MuxProducer producer, void *context);
+
+/**
+ * @desc Envia os pacotes de todos os canais pela mesma ligação, até todos acabarem.
+ * Escalonamento deficit round robin: em cada volta cada canal ganha peso * maxPacketSize
+ * bytes de crédito e envia pacotes enquanto o crédito chegar, por isso um ficheiro
+ * pequeno não fica à espera que acabe uma transferência grande
+ * @return Retorna 0 em caso de sucesso e -1 em caso de erro
+ */
+int muxrun(void);
+
+/**
+ * @desc Tira o cabeçalho de um pacote recebido
+ * @arg uint8_t *packet: pacote recebido do llread
+ * @arg size_t size: número de bytes de packet
+ * @arg uint8_t *channel: onde escrever o canal
+ * @arg size_t *innerSize: número de bytes do pacote do canal
+ * @return Retorna o pacote do canal, NULL se packet não for multiplexado
+ */
+uint8_t * muxunwrap(uint8_t *packet, size_t size, uint8_t *channel, size_t *innerSize);
+
+/**
+ * @desc Liberta os canais
+ */
+void muxclose(void);
+
+#endif
@@ -1,21 +1,47 @@
 #include "useful.h"
 #include "parser.h"
+#include "fec.h"
+#include "trace.h"
 
 #include <string.h>
 #include <getopt.h>
 #include <limits.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <dirent.h>
+#include <sys/stat.h>
 
 #define DEFAULT_BAUDRATE 38400
+#define DEFAULT_MAX_BAUDRATE 0
+#define DEFAULT_VMIN 0
+#define DEFAULT_VTIME 1
 #define DEFAULT_MODEMDEVICE "/dev/ttyS1"
 #define DEFAULT_TIMEOUT 3
 #define DEFAULT_NUMATTEMPTS 3
 #define DEFAULT_PAYLOAD_SIZE 100
 #define DEFAULT_PACKETBODY_SIZE 50
+#define DEFAULT_FLUSH_DELAY 20 // ms
 
 static unsigned long parse_ulong(char const * const str, int base); // From the function manual
 
+/**
+ * @desc Acrescenta um ficheiro ao lote
+ * @arg AppLayerSettings *settings: definições do bundle
+ * @arg char const *path: caminho do ficheiro
+ * @arg size_t nameOffset: onde começa, em path, o nome enviado no C_START
+ * @return Retorna 0 em caso de sucesso e -1 em caso de erro
+ */
+static int addBatchFile(AppLayerSettings *settings, char const *path, size_t nameOffset);
+
+/**
+ * @desc Acrescenta ao lote todos os ficheiros regulares dentro da pasta (e subpastas)
+ * @arg AppLayerSettings *settings: definições do bundle
+ * @arg char const *dir: pasta a percorrer
+ * @arg size_t nameOffset: tamanho do prefixo (pasta de topo) que não faz parte dos nomes enviados
+ * @return Retorna 0 em caso de sucesso e -1 em caso de erro
+ */
+static int walkDirectory(AppLayerSettings *settings, char const *dir, size_t nameOffset);
+
 void print_usage(char **argv) {
 
     char const *ptr;
@@ -37,9 +63,19 @@ void print_usage(char **argv) {
     fprintf(stderr,
             " -h  \t\tFor help\n");
     fprintf(stderr,
-            " -b  Number\tChange baudRate to a certain value, defaults to 38400\n");
+            " -b  Number\tChange baudRate to a certain value (bits/s), defaults to 38400\n");
+    fprintf(stderr,
+            " -B  Number\tAfter connecting step the baudRate up to this value while the error rate does not rise, both ends must use it\n");
     fprintf(stderr,
             " -d  Path\tSet the serial port device file, defaults to /dev/ttyS0\n");
+    fprintf(stderr,
+            " -M  Number\tVMIN, minimum bytes per read of the serial port, defaults to 0\n");
+    fprintf(stderr,
+            " -T  Number\tVTIME, read timer in tenths of a second, defaults to 1\n");
+    fprintf(stderr,
+            " -l  \t\tLow latency mode (ASYNC_LOW_LATENCY), where the driver supports it\n");
+    fprintf(stderr,
+            " -c  \t\tHardware flow control (RTS/CTS)\n");
     fprintf(stderr, " -t  Number\tSeconds to timeout, defaults to 3 seconds\n");
     fprintf(stderr,
             " -r  Number\tNumber of retries before aborting connection, defaults to 3\n");
@@ -49,6 +85,11 @@ void print_usage(char **argv) {
             " -f  Number\tTamanho máximo do payload das tramas I (sem stuffing)\n");
     fprintf(stderr,
             " -s  Number\tTamanho máximo da parte do pacote(body) que contém a informação útil\n");
+    fprintf(stderr,
+            " -X  Path\tWrite the frame trace (events and received bytes) there at the end, read it with bin/replay;\n"
+            "     \t\twithout -X it is only written, to " TRACE_DEFAULT_FILE ", when the connection fails\n");
+    fprintf(stderr,
+            " -e  Number\tReed-Solomon parity bytes per 255 byte codeword of the I frames, repairs half as many bad bytes without a retransmission, both ends must use it, defaults to 0 (off)\n");
 
     fprintf(stderr, "\nMODE");
     fprintf(stderr, "\n Sender:\n");
@@ -56,12 +97,25 @@ void print_usage(char **argv) {
             "     -x \t\tInformation to send is read from stdin be it a pipe or redirection\n");
     fprintf(stderr,
             "     < PathToFile\tSends a file must be used along with option -x\n");
+    fprintf(stderr,
+            "     -L  Number\tWith -x, milliseconds small writes wait to be packed with the next ones, defaults to %d\n",
+            DEFAULT_FLUSH_DELAY);
     fprintf(stderr, "     -m Message\t\tSends a message\n");
     fprintf(stderr, "\n Receiver (default (no args))\n");
     fprintf(stderr, "     > PathToFile\tReceive information and place it in a file\n");
-    fprintf(stderr, "     -S  Path\t\tFile to send\n");
+    fprintf(stderr, "     -S  Path\t\tFile to send, repeat it to send several files over one connection\n");
+    fprintf(stderr, "     -W  Path\t\tSend every file under the directory over one connection (names relative to it)\n");
     fprintf(stderr, "     -R  Path\t\tWhere to place received file\n");
     fprintf(stderr, "     -D  \t\tUse the fileName that comes in control packet start\n");
+    fprintf(stderr, "\n Full-duplex (both ends send a file, the received one keeps its name)\n");
+    fprintf(stderr, "     -F  Path\t\tFile to send, this end opens the connection\n");
+    fprintf(stderr, "     -P  Path\t\tFile to send, this end waits for the connection\n");
+    fprintf(stderr, "\n Delta (only the blocks that changed cross the link)\n");
+    fprintf(stderr, "     -U  Path\t\tNew version of the file to send\n");
+    fprintf(stderr, "     -K  Path\t\tOld copy to update in place, created if it does not exist\n");
+    fprintf(stderr, "\n Multiplexed (several files at once, receive with -D)\n");
+    fprintf(stderr, "     -C  Path[:Weight]\tFile to send on its own channel, repeat it for each file;\n");
+    fprintf(stderr, "       \t\ta channel of weight 2 gets twice the bytes of the link (default 1)\n");
 
     fprintf(stderr, "\n--- Examples ---\n");
     fprintf(stderr, "%s -h\n", ptr);
@@ -85,6 +139,7 @@ Bundle** parse_args(int argc, char **argv, size_t *NBundles) {
     size_t i;
     unsigned long parsedNumber;
     char *ptr;
+    unsigned int weight;
     /*regex_t deviceRegex;*/
     Bundle **Bundles;
 
@@ -120,6 +175,14 @@ Bundle** parse_args(int argc, char **argv, size_t *NBundles) {
         Bundles[i] = (Bundle *) malloc(sizeof(Bundle));
         // Set defaults to all Bundles
         Bundles[i]->llSettings.baudRate = DEFAULT_BAUDRATE;
+        Bundles[i]->llSettings.maxBaudRate = DEFAULT_MAX_BAUDRATE;
+        Bundles[i]->llSettings.vmin = DEFAULT_VMIN;
+        Bundles[i]->llSettings.vtime = DEFAULT_VTIME;
+        Bundles[i]->llSettings.lowLatency = false;
+        Bundles[i]->llSettings.hwFlowControl = false;
+        Bundles[i]->llSettings.fullDuplex = false;
+        Bundles[i]->llSettings.fecRoots = 0;
+        Bundles[i]->llSettings.traceFile = NULL;
         Bundles[i]->llSettings.port = DEFAULT_MODEMDEVICE;
         Bundles[i]->llSettings.timeout = DEFAULT_TIMEOUT;
         Bundles[i]->llSettings.numAttempts = DEFAULT_NUMATTEMPTS;
@@ -127,7 +190,10 @@ Bundle** parse_args(int argc, char **argv, size_t *NBundles) {
         Bundles[i]->alSettings.status = STATUS_UNSET;
         Bundles[i]->alSettings.io.fptr = NULL;
         Bundles[i]->alSettings.packetBodySize = DEFAULT_PACKETBODY_SIZE;
+        Bundles[i]->alSettings.flushDelay = DEFAULT_FLUSH_DELAY;
         Bundles[i]->alSettings.fileName = NULL;
+        Bundles[i]->alSettings.files = NULL;
+        Bundles[i]->alSettings.numFiles = 0;
         Bundles[i]->name = NULL;
     }
 
@@ -157,17 +223,23 @@ Bundle** parse_args(int argc, char **argv, size_t *NBundles) {
             return NULL;
         }
 
-        while ((c = getopt((int) subArgc, oldSubArgv, "N:b:d:t:r:n:S:R:m:f:s:xhD"))
+        while ((c = getopt((int) subArgc, oldSubArgv, "N:b:B:d:t:r:n:S:W:R:F:P:U:K:C:m:f:s:e:L:M:T:X:lcxhD"))
                 != -1) {
 
-            if (c == 'b' || c == 't' || c == 'r' || c == 'f' || c == 's') {
+            if (c == 'b' || c == 'B' || c == 't' || c == 'r' || c == 'f' || c == 's'
+                    || c == 'e' || c == 'L' || c == 'M' || c == 'T') {
                 parsedNumber = parse_ulong(optarg, 10);
                 if (parsedNumber == ULONG_MAX) {
                     fprintf(stderr, "-%c must be followed by a number\n", c);
                     return NULL;
                 }
-            } else if (c == 'S' || c == 'R' || c == 'x' || c == 'm' || c == 'D') {
-                if (ioSet) {
+            } else if (c == 'S' || c == 'W' || c == 'R' || c == 'F' || c == 'P' || c == 'U' || c == 'K'
+                    || c == 'C' || c == 'x' || c == 'm' || c == 'D') {
+                // -S e -W podem repetir-se, juntam ficheiros ao lote, tal como -C aos canais
+                if (ioSet && !((c == 'S' || c == 'W')
+                        && (Bundles[i]->alSettings.status == STATUS_TRANSMITTER_FILE
+                        || Bundles[i]->alSettings.status == STATUS_TRANSMITTER_BATCH))
+                        && !(c == 'C' && Bundles[i]->alSettings.status == STATUS_TRANSMITTER_MUX)) {
                     fprintf(stderr, "There can only be a mode for each bunnel");
                     return NULL;
                 }
@@ -184,7 +256,18 @@ Bundle** parse_args(int argc, char **argv, size_t *NBundles) {
                 ++checkNDuplication;
                 break;
             case 'b':
-                Bundles[i]->llSettings.baudRate = (tcflag_t) parsedNumber;
+                if (parsedNumber == 0 || parsedNumber > UINT_MAX) {
+                    fprintf(stderr, "-b must be a valid baudRate\n");
+                    return NULL;
+                }
+                Bundles[i]->llSettings.baudRate = (unsigned int) parsedNumber;
+                break;
+            case 'B':
+                if (parsedNumber > UINT_MAX) {
+                    fprintf(stderr, "-B must be a valid baudRate\n");
+                    return NULL;
+                }
+                Bundles[i]->llSettings.maxBaudRate = (unsigned int) parsedNumber;
                 break;
             case 'd':
                 /* Regex testing */
@@ -207,18 +290,43 @@ Bundle** parse_args(int argc, char **argv, size_t *NBundles) {
                 Bundles[i]->name = optarg;
                 break;
             case 'S':
+                ptr = strrchr(optarg, '/');
+                if (addBatchFile(&Bundles[i]->alSettings, optarg,
+                        ptr == NULL ? 0 : (size_t) (ptr + 1 - optarg)) != 0)
+                    return NULL;
+                if (Bundles[i]->alSettings.status == STATUS_TRANSMITTER_FILE) { // Segundo -S, passa a lote
+                    fclose(Bundles[i]->alSettings.io.fptr);
+                    Bundles[i]->alSettings.io.fptr = NULL;
+                    Bundles[i]->alSettings.fileName = NULL;
+                    Bundles[i]->alSettings.status = STATUS_TRANSMITTER_BATCH;
+                    break;
+                } else if (Bundles[i]->alSettings.status == STATUS_TRANSMITTER_BATCH)
+                    break;
                 if ((Bundles[i]->alSettings.io.fptr = fopen(optarg, "rb"))
                         == NULL) {
                     fprintf(stderr, "Error opening the file for reading\n");
                     return NULL;
                 }
                 Bundles[i]->alSettings.status = STATUS_TRANSMITTER_FILE;
-                ptr = strrchr(optarg, '/');
                 if (ptr == NULL)
                     Bundles[i]->alSettings.fileName = optarg;
                 else
                     Bundles[i]->alSettings.fileName = ++ptr;
                 break;
+            case 'W':
+                if (Bundles[i]->alSettings.status == STATUS_TRANSMITTER_FILE) { // Já havia um -S
+                    fclose(Bundles[i]->alSettings.io.fptr);
+                    Bundles[i]->alSettings.io.fptr = NULL;
+                    Bundles[i]->alSettings.fileName = NULL;
+                }
+                Bundles[i]->alSettings.status = STATUS_TRANSMITTER_BATCH;
+                if (walkDirectory(&Bundles[i]->alSettings, optarg, strlen(optarg) + 1) != 0)
+                    return NULL;
+                if (Bundles[i]->alSettings.numFiles == 0) {
+                    fprintf(stderr, "No files to send in '%s'\n", optarg);
+                    return NULL;
+                }
+                break;
             case 'R':
                 if ((Bundles[i]->alSettings.io.fptr = fopen(optarg, "w+b"))
                         == NULL) {
@@ -232,6 +340,61 @@ Bundle** parse_args(int argc, char **argv, size_t *NBundles) {
                 else
                     Bundles[i]->alSettings.fileName = ++ptr;
                 break;
+            case 'F':
+            case 'P':
+                if ((Bundles[i]->alSettings.io.fptr = fopen(optarg, "rb"))
+                        == NULL) {
+                    fprintf(stderr, "Error opening the file for reading\n");
+                    return NULL;
+                }
+                Bundles[i]->alSettings.status = (c == 'F') ?
+                        STATUS_TRANSMITTER_DUPLEX_FILE : STATUS_RECEIVER_DUPLEX_FILE;
+                Bundles[i]->llSettings.fullDuplex = true;
+                ptr = strrchr(optarg, '/');
+                if (ptr == NULL)
+                    Bundles[i]->alSettings.fileName = optarg;
+                else
+                    Bundles[i]->alSettings.fileName = ++ptr;
+                break;
+            case 'U':
+                if ((Bundles[i]->alSettings.io.fptr = fopen(optarg, "rb"))
+                        == NULL) {
+                    fprintf(stderr, "Error opening the file for reading\n");
+                    return NULL;
+                }
+                Bundles[i]->alSettings.status = STATUS_TRANSMITTER_DELTA;
+                Bundles[i]->llSettings.fullDuplex = true; // As checksums vêm do receptor
+                ptr = strrchr(optarg, '/');
+                if (ptr == NULL)
+                    Bundles[i]->alSettings.fileName = optarg;
+                else
+                    Bundles[i]->alSettings.fileName = ++ptr;
+                break;
+            case 'C':
+                // Peso opcional no fim, "path:peso"
+                weight = 1;
+                ptr = strrchr(optarg, ':');
+                if (ptr != NULL && (parsedNumber = parse_ulong(ptr + 1, 10)) != ULONG_MAX) {
+                    if (parsedNumber == 0 || parsedNumber > UINT_MAX) {
+                        fprintf(stderr, "-C weight must be a positive number\n");
+                        return NULL;
+                    }
+                    weight = (unsigned int) parsedNumber;
+                    *ptr = '\0';
+                }
+                ptr = strrchr(optarg, '/');
+                if (addBatchFile(&Bundles[i]->alSettings, optarg,
+                        ptr == NULL ? 0 : (size_t) (ptr + 1 - optarg)) != 0)
+                    return NULL;
+                Bundles[i]->alSettings.files[Bundles[i]->alSettings.numFiles - 1].weight = weight;
+                Bundles[i]->alSettings.status = STATUS_TRANSMITTER_MUX;
+                break;
+            case 'K':
+                // Aberto pelo applayer, pode ainda não existir
+                Bundles[i]->alSettings.status = STATUS_RECEIVER_DELTA;
+                Bundles[i]->llSettings.fullDuplex = true;
+                Bundles[i]->alSettings.fileName = optarg;
+                break;
             case 'm':
                 Bundles[i]->alSettings.io.chptr = optarg;
                 Bundles[i]->alSettings.status = STATUS_TRANSMITTER_STRING;
@@ -244,6 +407,40 @@ Bundle** parse_args(int argc, char **argv, size_t *NBundles) {
                 Bundles[i]->alSettings.packetBodySize =
                         (unsigned int) parsedNumber;
                 break;
+            case 'e':
+                if (parsedNumber > FEC_MAX_ROOTS) {
+                    fprintf(stderr, "-e must be at most %d\n", FEC_MAX_ROOTS);
+                    return NULL;
+                }
+                Bundles[i]->llSettings.fecRoots = (unsigned int) parsedNumber;
+                break;
+            case 'L':
+                if (parsedNumber > INT_MAX) {
+                    fprintf(stderr, "-L must be a valid number of milliseconds\n");
+                    return NULL;
+                }
+                Bundles[i]->alSettings.flushDelay = (unsigned int) parsedNumber;
+                break;
+            case 'M':
+            case 'T':
+                if (parsedNumber > 255) {
+                    fprintf(stderr, "-%c must be between 0 and 255\n", c);
+                    return NULL;
+                }
+                if (c == 'M')
+                    Bundles[i]->llSettings.vmin = (unsigned char) parsedNumber;
+                else
+                    Bundles[i]->llSettings.vtime = (unsigned char) parsedNumber;
+                break;
+            case 'X':
+                Bundles[i]->llSettings.traceFile = optarg;
+                break;
+            case 'l':
+                Bundles[i]->llSettings.lowLatency = true;
+                break;
+            case 'c':
+                Bundles[i]->llSettings.hwFlowControl = true;
+                break;
             case 'x':
                 Bundles[i]->alSettings.status = STATUS_TRANSMITTER_STREAM;
                 break;
@@ -286,3 +483,56 @@ static unsigned long parse_ulong(char const * const str, int base) {
     return val;
 }
 
+static int addBatchFile(AppLayerSettings *settings, char const *path, size_t nameOffset) {
+    BatchFile *files;
+
+    files = (BatchFile *) realloc(settings->files, sizeof(BatchFile) * (settings->numFiles + 1));
+    if (files == NULL) {
+        fprintf(stderr, "Error: realloc\n");
+        return -1;
+    }
+    settings->files = files;
+    if ((files[settings->numFiles].path = (char *) malloc(strlen(path) + 1)) == NULL) {
+        fprintf(stderr, "Error: malloc\n");
+        return -1;
+    }
+    strcpy(files[settings->numFiles].path, path);
+    files[settings->numFiles].name = files[settings->numFiles].path + nameOffset;
+    files[settings->numFiles].weight = 1;
+    ++settings->numFiles;
+    return 0;
+}
+
+static int walkDirectory(AppLayerSettings *settings, char const *dir, size_t nameOffset) {
+    DIR *dirp;
+    struct dirent *entry;
+    struct stat info;
+    char *path;
+    int res = 0;
+
+    if ((dirp = opendir(dir)) == NULL) {
+        fprintf(stderr, "Error opening the directory '%s'\n", dir);
+        return -1;
+    }
+
+    while (res == 0 && (entry = readdir(dirp)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+            continue;
+        path = (char *) malloc(strlen(dir) + strlen(entry->d_name) + 2);
+        if (path == NULL) {
+            res = -1;
+            break;
+        }
+        sprintf(path, "%s/%s", dir, entry->d_name);
+        if (stat(path, &info) != 0)
+            fprintf(stderr, "Skipping '%s', can't stat it\n", path);
+        else if (S_ISDIR(info.st_mode))
+            res = walkDirectory(settings, path, nameOffset);
+        else if (S_ISREG(info.st_mode))
+            res = addBatchFile(settings, path, nameOffset);
+        free(path);
+    }
+
+    closedir(dirp);
+    return res;
+}
@@ -25,12 +25,15 @@ int main(int argc, char *argv[])
         if ( Bundles[i]->name != NULL)
             fprintf(stderr, "Name: %s\n", Bundles[i]->name);
 
-        fprintf(stderr, "baudRate: %d\n", Bundles[i]->llSettings.baudRate);
+        fprintf(stderr, "baudRate: %u\n", Bundles[i]->llSettings.baudRate);
+        if ( Bundles[i]->llSettings.maxBaudRate != 0 )
+            fprintf(stderr, "maxBaudRate: %u\n", Bundles[i]->llSettings.maxBaudRate);
 
         if ( Bundles[i]->llSettings.port != NULL )
             fprintf(stderr, "port: %s\n", Bundles[i]->llSettings.port);
 
         fprintf(stderr, "timeout: %d\n", Bundles[i]->llSettings.timeout);
+        fprintf(stderr, "VMIN: %u VTIME: %u\n", Bundles[i]->llSettings.vmin, Bundles[i]->llSettings.vtime);
         fprintf(stderr, "numAttempts: %d\n", Bundles[i]->llSettings.numAttempts);
         fprintf(stderr, "status: %d\n", Bundles[i]->alSettings.status);
         fprintf(stderr, "packetBodySize: %lu\n", Bundles[i]->alSettings.packetBodySize);
@@ -47,7 +50,9 @@ int main(int argc, char *argv[])
     /*else fprintf(stderr, "llopen() was successful\n");*/
 
     if( initAppLayer(Bundles[0]) != 0) {
-        if ( Bundles[0]->alSettings.status == STATUS_TRANSMITTER_FILE || Bundles[0]->alSettings.status == STATUS_RECEIVER_FILE )
+        if ( Bundles[0]->alSettings.status == STATUS_TRANSMITTER_FILE || Bundles[0]->alSettings.status == STATUS_RECEIVER_FILE
+                || Bundles[0]->alSettings.status == STATUS_TRANSMITTER_DUPLEX_FILE || Bundles[0]->alSettings.status == STATUS_RECEIVER_DUPLEX_FILE
+                || Bundles[0]->alSettings.status == STATUS_TRANSMITTER_DELTA )
             fclose(Bundles[0]->alSettings.io.fptr);
         fprintf(stderr, "Error: Initializing app layer\n");
     }
@@ -0,0 +1,169 @@
+#define _DEFAULT_SOURCE
+
+#include "serial.h"
+
+#include <stddef.h>
+#include <sys/ioctl.h>
+
+#ifdef __linux__
+#include <asm/termbits.h> // termios2, não pode ser incluído junto com termios.h
+#include <linux/serial.h>
+#else
+#include <termios.h>
+#endif
+
+typedef struct {
+    unsigned int baudRate;
+    unsigned int speed; // Constante Bxxxx
+} BaudRate;
+
+static const BaudRate baudRates[] = {
+    { 50, B50 }, { 75, B75 }, { 110, B110 }, { 134, B134 }, { 150, B150 },
+    { 200, B200 }, { 300, B300 }, { 600, B600 }, { 1200, B1200 },
+    { 1800, B1800 }, { 2400, B2400 }, { 4800, B4800 }, { 9600, B9600 },
+    { 19200, B19200 }, { 38400, B38400 },
+#ifdef B57600
+    { 57600, B57600 },
+#endif
+#ifdef B115200
+    { 115200, B115200 },
+#endif
+#ifdef B230400
+    { 230400, B230400 },
+#endif
+#ifdef B460800
+    { 460800, B460800 },
+#endif
+#ifdef B500000
+    { 500000, B500000 },
+#endif
+#ifdef B576000
+    { 576000, B576000 },
+#endif
+#ifdef B921600
+    { 921600, B921600 },
+#endif
+#ifdef B1000000
+    { 1000000, B1000000 },
+#endif
+#ifdef B1152000
+    { 1152000, B1152000 },
+#endif
+#ifdef B1500000
+    { 1500000, B1500000 },
+#endif
+#ifdef B2000000
+    { 2000000, B2000000 },
+#endif
+#ifdef B2500000
+    { 2500000, B2500000 },
+#endif
+#ifdef B3000000
+    { 3000000, B3000000 },
+#endif
+#ifdef B3500000
+    { 3500000, B3500000 },
+#endif
+#ifdef B4000000
+    { 4000000, B4000000 },
+#endif
+};
+
+#define NUM_BAUDRATES (sizeof(baudRates) / sizeof(baudRates[0]))
+
+static const BaudRate * findBaudRate(unsigned int baudRate) {
+    size_t i;
+    for (i = 0; i < NUM_BAUDRATES; ++i) {
+        if (baudRates[i].baudRate == baudRate)
+            return &baudRates[i];
+    }
+    return NULL;
+}
+
+bool isStandardBaudRate(unsigned int baudRate) {
+    return findBaudRate(baudRate) != NULL;
+}
+
+unsigned int nextBaudRate(unsigned int baudRate) {
+    size_t i;
+    for (i = 0; i < NUM_BAUDRATES; ++i) {
+        if (baudRates[i].baudRate > baudRate)
+            return baudRates[i].baudRate;
+    }
+    return 0;
+}
+
+#ifdef __linux__
+
+int setBaudRate(int fd, unsigned int baudRate) {
+    const BaudRate * standard = findBaudRate(baudRate);
+    struct termios2 tio;
+
+    if (baudRate == 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (ioctl(fd, TCGETS2, &tio) == -1)
+        return -1;
+
+    tio.c_cflag &= ~(tcflag_t) CBAUD;
+    tio.c_cflag |= (standard != NULL) ? standard->speed : BOTHER;
+    tio.c_ispeed = baudRate;
+    tio.c_ospeed = baudRate;
+
+    return ioctl(fd, TCSETS2, &tio);
+}
+
+#else
+
+int setBaudRate(int fd, unsigned int baudRate) {
+    const BaudRate * standard = findBaudRate(baudRate);
+    struct termios tio;
+
+    if (standard == NULL) { // Sem termios2 só há os valores standard
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (tcgetattr(fd, &tio) == -1)
+        return -1;
+
+    if (cfsetispeed(&tio, standard->speed) == -1 || cfsetospeed(&tio, standard->speed) == -1)
+        return -1;
+
+    return tcsetattr(fd, TCSANOW, &tio);
+}
+
+#endif
+
+int setLowLatency(int fd) {
+#if defined(TIOCGSERIAL) && defined(ASYNC_LOW_LATENCY)
+    struct serial_struct serial;
+
+    if (ioctl(fd, TIOCGSERIAL, &serial) == -1)
+        return -1;
+
+    serial.flags = (int) ((unsigned int) serial.flags | ASYNC_LOW_LATENCY);
+
+    return ioctl(fd, TIOCSSERIAL, &serial);
+#else
+    (void) fd;
+    errno = ENOTSUP;
+    return -1;
+#endif
+}
+
+int outputQueued(int fd) {
+#ifdef TIOCOUTQ
+    int queued;
+
+    if (ioctl(fd, TIOCOUTQ, &queued) == -1)
+        return -1;
+    return queued;
+#else
+    (void) fd;
+    errno = ENOTSUP;
+    return -1;
+#endif
+}
@@ -0,0 +1,40 @@
+#ifndef SERIAL_H
+#define SERIAL_H
+
+#include "useful.h"
+
+/**
+ * @desc Muda o baudRate da porta série; os valores sem constante Bxxxx
+ * (ex: 250000) são configurados com termios2/BOTHER onde existir
+ * @arg int fd: descritor da porta série
+ * @arg unsigned int baudRate: baudRate em bits/s
+ * @return Retorna 0 em caso de sucesso e -1 em caso de erro
+ */
+int setBaudRate(int fd, unsigned int baudRate);
+
+/**
+ * @desc Verifica se baudRate tem uma constante Bxxxx correspondente
+ */
+bool isStandardBaudRate(unsigned int baudRate);
+
+/**
+ * @desc Próximo baudRate standard acima de baudRate, usado na negociação
+ * @return Retorna o próximo baudRate ou 0 se não houver nenhum
+ */
+unsigned int nextBaudRate(unsigned int baudRate);
+
+/**
+ * @desc Liga o ASYNC_LOW_LATENCY do driver (TIOCSSERIAL), para o driver
+ * entregar os bytes recebidos sem esperar pelo seu temporizador interno
+ * @return Retorna 0 em caso de sucesso e -1 se a porta/sistema não o suportar
+ */
+int setLowLatency(int fd);
+
+/**
+ * @desc Bytes escritos que ainda estão na fila de saída do driver (TIOCOUTQ),
+ * isto é, que o write() já aceitou mas ainda não saíram pela linha
+ * @return Retorna o número de bytes ou -1 se a porta/sistema não o suportar
+ */
+int outputQueued(int fd);
+
+#endif
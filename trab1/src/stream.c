@@ -0,0 +1,118 @@
+#define _POSIX_C_SOURCE 200809L // clock_gettime
+
+#include "stream.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <time.h>
+
+typedef struct {
+    int fd;
+    uint8_t *buffer;
+    size_t capacity;
+    size_t used;
+    unsigned int flushDelay; // ms
+    struct timespec first; // Quando chegou o primeiro byte do buffer
+    bool eof;
+    unsigned long int reads; // Leituras com dados
+    unsigned long int chunks; // Pedaços entregues
+} Stream;
+
+static Stream stream;
+
+/**
+ * @desc Milissegundos que o buffer ainda pode esperar por mais bytes
+ */
+static int remaining(void);
+
+int streaminitialize(int fd, size_t capacity, unsigned int flushDelay) {
+    if ( fd < 0 || capacity == 0 ) {
+        errno = EINVAL;
+        return -1;
+    }
+    streamclose();
+    if ( (stream.buffer = (uint8_t *) malloc(capacity)) == NULL ) {
+        errno = ENOMEM;
+        return -1;
+    }
+    stream.fd = fd;
+    stream.capacity = capacity;
+    stream.flushDelay = flushDelay;
+    return 0;
+}
+
+int streamnext(uint8_t *data, size_t *size) {
+    struct pollfd pfd;
+    ssize_t res;
+    int timeout;
+
+    if ( stream.buffer == NULL || data == NULL || size == NULL ) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    while ( stream.used < stream.capacity && !stream.eof ) {
+        // Buffer vazio espera o que for preciso, senão só até acabar o atraso;
+        // acabado o atraso ainda junta o que já estiver no pipe
+        timeout = stream.used == 0 ? -1 : remaining();
+
+        pfd.fd = stream.fd;
+        pfd.events = POLLIN;
+        res = poll(&pfd, 1, timeout);
+        if ( res < 0 ) {
+            if ( errno == EINTR ) // Alarmes da linklayer
+                continue;
+            return -1;
+        }
+        if ( res == 0 ) // Passou o atraso, ou já não há mais no pipe
+            break;
+
+        res = read(stream.fd, stream.buffer + stream.used, stream.capacity - stream.used);
+        if ( res < 0 ) {
+            if ( errno == EINTR )
+                continue;
+            return -1;
+        }
+        if ( res == 0 ) {
+            stream.eof = true;
+            break;
+        }
+        if ( stream.used == 0 )
+            clock_gettime(CLOCK_MONOTONIC, &stream.first);
+        stream.used += (size_t) res;
+        ++stream.reads;
+    }
+
+    if ( stream.used == 0 ) // Só chega aqui vazio no fim
+        return 0;
+    memcpy(data, stream.buffer, stream.used);
+    *size = stream.used;
+    stream.used = 0;
+    ++stream.chunks;
+    return 1;
+}
+
+bool streamconsumed(void) {
+    return stream.reads != 0 || stream.eof;
+}
+
+void streamclose(void) {
+    if ( stream.chunks != 0 )
+        fprintf(stderr, "Stream: %lu reads coalesced into %lu packets\n", stream.reads, stream.chunks);
+    free(stream.buffer);
+    memset(&stream, 0, sizeof(stream));
+}
+
+static int remaining(void) {
+    struct timespec now;
+    long int elapsed;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    elapsed = (now.tv_sec - stream.first.tv_sec) * 1000 + (now.tv_nsec - stream.first.tv_nsec) / 1000000;
+    if ( elapsed >= (long int) stream.flushDelay )
+        return 0;
+    return (int) ((long int) stream.flushDelay - elapsed);
+}
@@ -0,0 +1,45 @@
+#ifndef STREAM_H
+#define STREAM_H
+
+#include "useful.h"
+
+#include <stdint.h>
+#include <stddef.h>
+
+/**
+ * Leitura de um pipe ou redirecção (-x) com junção das escritas pequenas do
+ * produtor, como o algoritmo de Nagle: os bytes ficam no buffer até encher um
+ * pacote ou até passar flushDelay desde o primeiro byte guardado. Um produtor
+ * que escreve linha a linha deixa de gastar uma trama e uma confirmação por linha.
+ */
+
+/**
+ * @desc Prepara a leitura
+ * @arg int fd: descritor de onde ler
+ * @arg size_t capacity: bytes de um pacote cheio
+ * @arg unsigned int flushDelay: milissegundos que os bytes podem esperar por mais, 0 só junta o que já estiver no pipe
+ * @return Retorna 0 em caso de sucesso e -1 em caso de erro
+ */
+int streaminitialize(int fd, size_t capacity, unsigned int flushDelay);
+
+/**
+ * @desc Espera pelo próximo pedaço do stream
+ * @arg uint8_t *data: onde escrever, com espaço para capacity bytes
+ * @arg size_t *size: número de bytes escritos
+ * @return Retorna 1 se escreveu um pedaço, 0 no fim do stream e -1 em caso de erro
+ */
+int streamnext(uint8_t *data, size_t *size);
+
+/**
+ * @desc Diz se já se leu alguma coisa do fd; o stdin não volta atrás, por isso
+ * depois disso uma transferência falhada não pode recomeçar
+ * @return Retorna true se já foram lidos bytes ou o fim do stream
+ */
+bool streamconsumed(void);
+
+/**
+ * @desc Liberta o buffer e mostra quantas escritas couberam em cada pacote
+ */
+void streamclose(void);
+
+#endif
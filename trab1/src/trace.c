@@ -0,0 +1,131 @@
+#define _POSIX_C_SOURCE 200809L // clock_gettime
+
+#include "trace.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <time.h>
+
+static TraceEvent events[TRACE_EVENTS];
+static atomic_uint_fast64_t nextEvent = 0; // Eventos registados desde o início
+static uint8_t raw[TRACE_RAW_SIZE];
+static atomic_uint_fast64_t rawTotal = 0; // Bytes recebidos desde o início
+static TraceHeader config;
+
+void traceconfigure(unsigned int payloadSize, unsigned int fecRoots, bool fullDuplex, bool receiver) {
+    config.payloadSize = (uint32_t) payloadSize;
+    config.fecRoots = (uint8_t) fecRoots;
+    config.fullDuplex = fullDuplex;
+    config.receiver = receiver;
+}
+
+void tracerecord(uint8_t direction, uint8_t control, size_t length, uint8_t outcome) {
+    struct timespec now;
+    TraceEvent *event;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    // Cada thread fica com o seu lugar, o anel escreve por cima dos mais antigos
+    event = &events[atomic_fetch_add_explicit(&nextEvent, 1, memory_order_relaxed) & (TRACE_EVENTS - 1)];
+    event->timestamp = (uint64_t) now.tv_sec * 1000000000u + (uint64_t) now.tv_nsec;
+    event->length = (uint32_t) length;
+    event->rawOffset = (uint32_t) atomic_load_explicit(&rawTotal, memory_order_relaxed);
+    event->direction = direction;
+    event->control = control;
+    event->outcome = outcome;
+}
+
+void traceraw(uint8_t const *bytes, size_t size) {
+    uint64_t total = atomic_load_explicit(&rawTotal, memory_order_relaxed);
+    size_t start, first;
+
+    if ( size > TRACE_RAW_SIZE ) { // Só cabem os últimos
+        total += size - TRACE_RAW_SIZE;
+        bytes += size - TRACE_RAW_SIZE;
+        size = TRACE_RAW_SIZE;
+    }
+    start = (size_t) (total & (TRACE_RAW_SIZE - 1));
+    first = TRACE_RAW_SIZE - start < size ? TRACE_RAW_SIZE - start : size;
+    memcpy(raw + start, bytes, first);
+    memcpy(raw, bytes + first, size - first);
+    atomic_store_explicit(&rawTotal, total + size, memory_order_release);
+}
+
+int tracedump(char const *path) {
+    TraceHeader header = config;
+    uint64_t count = atomic_load_explicit(&nextEvent, memory_order_acquire);
+    uint64_t total = atomic_load_explicit(&rawTotal, memory_order_acquire);
+    uint64_t first, start;
+    size_t size, begin;
+    FILE *file;
+    bool ok;
+
+    first = count > TRACE_EVENTS ? count - TRACE_EVENTS : 0;
+    start = total > TRACE_RAW_SIZE ? total - TRACE_RAW_SIZE : 0;
+    memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+    header.version = TRACE_VERSION;
+    header.numEvents = (uint32_t) (count - first);
+    header.rawSize = (uint32_t) (total - start);
+    header.rawStart = start;
+    header.droppedEvents = first;
+
+    if ( (file = fopen(path, "wb")) == NULL ) {
+        fprintf(stderr, "tracedump: Error opening '%s'\n", path);
+        return -1;
+    }
+    ok = fwrite(&header, sizeof(header), 1, file) == 1;
+
+    // Do mais antigo para o mais recente, em dois pedaços se o anel deu a volta
+    begin = (size_t) (first & (TRACE_EVENTS - 1));
+    size = header.numEvents < TRACE_EVENTS - begin ? header.numEvents : TRACE_EVENTS - begin;
+    ok = ok && fwrite(events + begin, sizeof(TraceEvent), size, file) == size;
+    ok = ok && fwrite(events, sizeof(TraceEvent), header.numEvents - size, file) == header.numEvents - size;
+
+    begin = (size_t) (start & (TRACE_RAW_SIZE - 1));
+    size = header.rawSize < TRACE_RAW_SIZE - begin ? header.rawSize : TRACE_RAW_SIZE - begin;
+    ok = ok && fwrite(raw + begin, 1, size, file) == size;
+    ok = ok && fwrite(raw, 1, header.rawSize - size, file) == header.rawSize - size;
+
+    if ( fclose(file) != 0 || !ok ) {
+        fprintf(stderr, "tracedump: Error writing '%s'\n", path);
+        return -1;
+    }
+    fprintf(stderr, "Trace: %u frame events and %u received bytes written to '%s'\n",
+            header.numEvents, header.rawSize, path);
+    return 0;
+}
+
+int traceload(char const *path, TraceHeader *header, TraceEvent **eventsRead, uint8_t **rawRead) {
+    FILE *file;
+    bool ok;
+
+    *eventsRead = NULL;
+    *rawRead = NULL;
+    if ( (file = fopen(path, "rb")) == NULL )
+        return -1;
+    if ( fread(header, sizeof(*header), 1, file) != 1
+            || memcmp(header->magic, TRACE_MAGIC, sizeof(header->magic)) != 0
+            || header->version != TRACE_VERSION
+            || header->numEvents > TRACE_EVENTS || header->rawSize > TRACE_RAW_SIZE ) {
+        fclose(file);
+        errno = EINVAL;
+        return -1;
+    }
+    // +1: malloc(0) pode dar NULL
+    *eventsRead = (TraceEvent *) malloc(sizeof(TraceEvent) * header->numEvents + 1);
+    *rawRead = (uint8_t *) malloc(header->rawSize + 1);
+    ok = *eventsRead != NULL && *rawRead != NULL
+            && fread(*eventsRead, sizeof(TraceEvent), header->numEvents, file) == header->numEvents
+            && fread(*rawRead, 1, header->rawSize, file) == header->rawSize;
+    fclose(file);
+    if ( !ok ) {
+        free(*eventsRead);
+        free(*rawRead);
+        *eventsRead = NULL;
+        *rawRead = NULL;
+        errno = EINVAL;
+        return -1;
+    }
+    return 0;
+}
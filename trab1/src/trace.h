@@ -0,0 +1,88 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include "useful.h"
+
+#include <stdint.h>
+#include <stddef.h>
+
+/**
+ * Gravador de eventos das tramas, sempre ligado. Cada trama enviada ou
+ * recebida ocupa um TraceEvent num anel em memória (sem locks, basta um
+ * fetch-add atómico), e os bytes lidos da porta série vão para outro anel,
+ * para poderem voltar a passar pelo descodificador (bin/replay). O anel só
+ * vai para um ficheiro no tracedump, no fim da ligação com -X ou quando ela falha.
+ *
+ * Ficheiro, na ordem dos bytes da máquina: TraceHeader, os eventos do mais
+ * antigo para o mais recente e depois os bytes recebidos, também por ordem.
+ */
+
+#define TRACE_MAGIC "RCTR"
+#define TRACE_VERSION 1
+#define TRACE_EVENTS 16384 // Potência de 2
+#define TRACE_RAW_SIZE (1 << 20) // Bytes recebidos guardados, potência de 2
+#define TRACE_DEFAULT_FILE "serius.trace" // Dump quando a ligação falha sem -X
+
+#define TRACE_TX 0
+#define TRACE_RX 1
+
+#define TRACE_OK 0
+#define TRACE_BAD 1 // Trama I com o BCC2 errado
+#define TRACE_REPAIRED 2 // Trama I corrigida pelo FEC
+#define TRACE_TIMEOUT 3 // O alarme tocou antes de chegar uma trama (control a 0)
+#define TRACE_FAILED 4 // write() da trama falhou ou ficou a meio
+
+typedef struct {
+    uint64_t timestamp; // ns, CLOCK_MONOTONIC
+    uint32_t length; // Bytes da trama na linha (enviada) ou do destuffing (recebida)
+    uint32_t rawOffset; // Bytes recebidos até aqui, para alinhar com os bytes do ficheiro
+    uint8_t direction;
+    uint8_t control; // Campo C
+    uint8_t outcome;
+    uint8_t reserved[5];
+} TraceEvent;
+
+typedef struct {
+    char magic[4];
+    uint32_t version;
+    uint32_t numEvents;
+    uint32_t rawSize; // Bytes recebidos no ficheiro
+    uint64_t rawStart; // Bytes recebidos antes do primeiro do ficheiro (o anel deu a volta)
+    uint64_t droppedEvents; // Eventos perdidos pelo anel ter dado a volta
+    uint32_t payloadSize; // Configuração do descodificador, para o replay
+    uint8_t fecRoots;
+    uint8_t fullDuplex;
+    uint8_t receiver;
+    uint8_t reserved;
+} TraceHeader;
+
+/**
+ * @desc Guarda a configuração da ligação, vai no cabeçalho do dump
+ */
+void traceconfigure(unsigned int payloadSize, unsigned int fecRoots, bool fullDuplex, bool receiver);
+
+/**
+ * @desc Regista um evento de uma trama, pode ser chamado de qualquer thread
+ */
+void tracerecord(uint8_t direction, uint8_t control, size_t length, uint8_t outcome);
+
+/**
+ * @desc Guarda bytes lidos da porta série; só a thread que está na porta o chama
+ */
+void traceraw(uint8_t const *bytes, size_t size);
+
+/**
+ * @desc Escreve o que está nos anéis para um ficheiro
+ * @return Retorna 0 em caso de sucesso e -1 em caso de erro
+ */
+int tracedump(char const *path);
+
+/**
+ * @desc Lê um ficheiro do tracedump
+ * @arg TraceEvent **events: array alocado, a libertar com free
+ * @arg uint8_t **raw: bytes recebidos, a libertar com free
+ * @return Retorna 0 em caso de sucesso e -1 em caso de erro
+ */
+int traceload(char const *path, TraceHeader *header, TraceEvent **events, uint8_t **raw);
+
+#endif
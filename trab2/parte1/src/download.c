@@ -1,9 +1,109 @@
+#define _POSIX_C_SOURCE 200809L /* getopt */
 #include "ftp.h"
 #include "url.h"
+#include "pool.h"
+#include "engine.h"
+#include "mirror.h"
 #include <stdio.h>      /* printf */
+#include <stdlib.h>     /* strtoul */
 #include <string.h>     /* strcmp */
+#include <unistd.h>     /* getopt */
 
-#define SERVER_PORT 21  /* Default Server Port */
+#define MAX_SEGMENTS 64 /* Max connections of a segmented download */
+#define MAX_SESSIONS 64 /* Max sessions of the pool */
+
+/**
+* Downloads one file over the logged in session, the data connection is opened with the download commands
+* @arg ftp FTP Struct of the server
+* @arg ip IP of the server, used for the extra connections of segmented downloads
+* @arg url URL with the user and password of the session
+* @arg path Path of the file
+* @arg segments Number of segments (connections) to use
+* @return Returns 0 in case of success, 1 in case of error
+*/
+static int download_file(FTP * ftp, const char * ip, const URL * url, const char * path, unsigned int segments) {
+  int res;
+
+  fprintf(stderr, "%s\n", path);
+  if(segments > 1)  /* Download the file split over several connections */
+    res = ftp_download_segmented(ftp, ip, url->user, url->password, path, segments);
+  else  /* Download the file */
+    res = ftp_download(ftp, path);
+  if(res)
+    fprintf(stderr, "Error: ftp_download %s\n", path);
+  else
+    fprintf(stderr, "ftp_download was sucessful\n");
+  return res;
+}
+
+/**
+* Downloads every path listed in the file, one per line, over the same session
+* @arg ftp FTP Struct of the server
+* @arg ip IP of the server
+* @arg url URL with the user and password of the session
+* @arg list File with the paths
+* @arg segments Number of segments (connections) to use for each file
+* @return Returns the number of files that failed
+*/
+static unsigned int download_list(FTP * ftp, const char * ip, const URL * url, FILE * list, unsigned int segments) {
+  unsigned int failed = 0;
+  char * line = NULL;
+  size_t capacity = 0;
+  ssize_t length;
+
+  while((length = getline(&line, &capacity, list)) != -1) {
+    while(length > 0 && (line[length - 1] == '\n' || line[length - 1] == '\r'))
+      line[--length] = '\0';
+    if(length == 0)  /* Skip empty lines */
+      continue;
+    if(download_file(ftp, ip, url, line, segments))
+      failed++;
+  }
+  free(line);
+  return failed;
+}
+
+/**
+* Appends a copy of the path to the array of paths
+* @arg paths Array of paths, grows as needed
+* @arg count Number of paths in the array
+* @arg path Path to add
+* @return Returns 0 in case of success, 1 in case of error
+*/
+static int add_path(char *** paths, size_t * count, const char * path) {
+  char ** grown = (char **) realloc(*paths, (*count + 1) * sizeof(char *));
+
+  if(!grown)
+    return 1;
+  *paths = grown;
+  if(!(grown[*count] = strdup(path)))
+    return 1;
+  (*count)++;
+  return 0;
+}
+
+/**
+* Reads the paths in the file, one per line, to the array of paths
+* @arg list File with the paths
+* @arg paths Array of paths, grows as needed
+* @arg count Number of paths in the array
+* @return Returns 0 in case of success, 1 in case of error
+*/
+static int read_list(FILE * list, char *** paths, size_t * count) {
+  char * line = NULL;
+  size_t capacity = 0;
+  ssize_t length;
+  int res = 0;
+
+  while(!res && (length = getline(&line, &capacity, list)) != -1) {
+    while(length > 0 && (line[length - 1] == '\n' || line[length - 1] == '\r'))
+      line[--length] = '\0';
+    if(length > 0)  /* Skip empty lines */
+      res = add_path(paths, count, line);
+  }
+  free(line);
+  return res;
+}
 
 /**
 * Prints the usage of this application
@@ -11,28 +111,100 @@
 */
 void print_usage(char * name) {
     fprintf(stderr, "\nDownloads files using the FTP application protocol\n");
-    fprintf(stderr, "Usage: %s ftp://[<user>:<password>@]<host>/<url-path>\n", name);
+    fprintf(stderr, "Usage: %s [-b <bytes>] [-z] [-r] [-s <segments>] [-p <sessions>] [-e <sessions>] [-l <list>] [-m <dir>] ftp://[<user>:<password>@]<host>/<url-path> [<url-path> ...]\n", name);
     fprintf(stderr, "Usage: %s ftp://<host>/<url-path>\n", name);
     fprintf(stderr, "Usage: %s ftp://<host>\n", name);
     fprintf(stderr, "Usage: %s\n", name);
-    fprintf(stderr, "Usage: %s -h  \t\tFor help\n\n", name);
+    fprintf(stderr, "Usage: %s -h  \t\tFor help\n", name);
+    fprintf(stderr, "\n -b <bytes>\tSize of each read from the data connection, defaults to %d\n", DATA_BUFFER_SIZE);
+    fprintf(stderr, " -z\t\tZero copy, splice the data connection straight into the file (Linux only)\n");
+    fprintf(stderr, " -r\t\tResume, continue partial local files from where they stopped (REST), not with -s\n");
+    fprintf(stderr, " -s <segments>\tSplit the file in segments downloaded in parallel, each on its own connection\n");
+    fprintf(stderr, " -l <list>\tAlso download the paths in the file list, one per line ('-' for stdin)\n");
+    fprintf(stderr, " -p <sessions>\tDownload the files in parallel over a pool of sessions, largest first\n");
+    fprintf(stderr, " -e <sessions>\tDownload the files over many sessions driven by one thread (epoll), up to %d\n", MAX_ENGINE_SESSIONS);
+    fprintf(stderr, " -m <dir>\tMirror the remote directory <url-path> into dir, only new or changed files\n");
+    fprintf(stderr, "\nAll the paths are downloaded from the same host over one login\n\n");
 }
 
 int main(int argc, char * argv[]) {
   URL url = {};
+  size_t buffer_size = DATA_BUFFER_SIZE;
+  int zero_copy = 0;
+  int resume = 0;
+  unsigned long segments = 1;
+  unsigned long sessions = 1;
+  unsigned long engine_sessions = 0;
+  char ** paths = NULL;
+  size_t count = 0;
+  unsigned int failed = 0;
+  const char * list_path = NULL;
+  const char * mirror_path = NULL;
+  Mirror mirror;
+  FILE * list = NULL;
+  int i;
+  char * end;
+  int opt;
 
-  if (argc > 2) {
-    fprintf(stderr, "Error: Too many arguments\n");
-    print_usage(argv[0]);
-    return 0;
+  while((opt = getopt(argc, argv, "b:zrs:p:e:l:m:h")) != -1) {
+    switch(opt) {
+      case 'b':
+        buffer_size = strtoul(optarg, &end, 10);
+        if(*end != '\0' || buffer_size == 0) {
+          fprintf(stderr, "Error: -b must be a positive number of bytes\n");
+          return 1;
+        }
+        break;
+      case 'z':
+        zero_copy = 1;
+        break;
+      case 'r':
+        resume = 1;
+        break;
+      case 's':
+        segments = strtoul(optarg, &end, 10);
+        if(*end != '\0' || segments == 0 || segments > MAX_SEGMENTS) {
+          fprintf(stderr, "Error: -s must be between 1 and %d\n", MAX_SEGMENTS);
+          return 1;
+        }
+        break;
+      case 'p':
+        sessions = strtoul(optarg, &end, 10);
+        if(*end != '\0' || sessions == 0 || sessions > MAX_SESSIONS) {
+          fprintf(stderr, "Error: -p must be between 1 and %d\n", MAX_SESSIONS);
+          return 1;
+        }
+        break;
+      case 'e':
+        engine_sessions = strtoul(optarg, &end, 10);
+        if(*end != '\0' || engine_sessions == 0 || engine_sessions > MAX_ENGINE_SESSIONS) {
+          fprintf(stderr, "Error: -e must be between 1 and %d\n", MAX_ENGINE_SESSIONS);
+          return 1;
+        }
+        break;
+      case 'l':
+        list_path = optarg;
+        break;
+      case 'm':
+        mirror_path = optarg;
+        break;
+      case 'h':
+        print_usage(argv[0]);
+        return 0;
+      default:
+        print_usage(argv[0]);
+        return 1;
+    }
   }
 
-  else if (argc == 2) { /* FTP URL was specified */
-    if(!strcmp(argv[1], "-h")) {
-      print_usage(argv[0]);
-      return 0;
-    }
-    if (url_parser(argv[1], &url)) {
+  /* The segments are written into a new preallocated file, there's no partial file to continue */
+  if(resume && segments > 1) {
+    fprintf(stderr, "Error: -r can't be used with -s\n");
+    return 1;
+  }
+
+  if (argc - optind >= 1) { /* FTP URL was specified, the other arguments are more paths */
+    if (url_parser(argv[optind], &url)) {
       fprintf(stderr, "Error: url_parser\n");
       url_clear(&url);
       return 1;
@@ -42,24 +214,31 @@ int main(int argc, char * argv[]) {
   if(url.hostSize <= 0) /* IF host was not specified, ask the user */
     url_getInput("Host", &url.host, &url.hostSize);
 
-  char ip[MAX_IP_SIZE];
-  if(url_getIP(url.host, ip)) { /* Get IP */
-    fprintf(stderr, "Error: url_getIP\n");
-    url_clear(&url);
-    return 1;
-  }
-
   FTP ftp;
-  if(ftp_connect( ip , SERVER_PORT, &ftp.control_socket_fd)) {  /* Connect to the FTP server */
+  memset(&ftp, 0, sizeof(FTP));
+  ftp.buffer_size = buffer_size;
+  ftp.zero_copy = zero_copy;
+  ftp.resume = resume;
+  ftp.data_socket_fd = -1;
+  if(ftp_connect(url.host, SERVER_PORT, &ftp.control_socket_fd)) {  /* Connect to the FTP server, any of its addresses */
     fprintf(stderr, "Error: ftp_connect\n");
     url_clear(&url);
     return 1;
   }
 
+  char ip[MAX_IP_SIZE];
+  if(ftp_peer(ftp.control_socket_fd, ip)) { /* The other sessions go to the address that won */
+    fprintf(stderr, "Error: ftp_peer\n");
+    goto disconnect;
+  }
+  printf("Host name  : %s\n", url.host);
+  printf("IP Address : %s\n", ip);
+
   char temp[INPUT_SIZE];
-  memset(temp, 0, INPUT_SIZE);
-  if(ftp_read(ftp.control_socket_fd, temp, INPUT_SIZE)) { /* Read Server Connection Welcome */
-    fprintf(stderr, "Error: ftp_read\n");
+  int code;
+  while((code = ftp_reply(&ftp, temp, INPUT_SIZE)) == 120); /* Read Server Connection Welcome, all of its lines */
+  if(code != 220) {
+    fprintf(stderr, "Error: ftp_reply\n");
     goto disconnect;
   }
   fprintf(stderr, "%s", temp);
@@ -89,31 +268,76 @@ int main(int argc, char * argv[]) {
       goto disconnect;
   }
 
-  if(ftp_pasv(&ftp)) {  /* Enter Passive mode */
-    fprintf(stderr, "Error: ftp_pasv\n");
-    goto disconnect;
+  if(list_path) {
+    list = strcmp(list_path, "-") ? fopen(list_path, "r") : stdin;
+    if(!list) {
+      fprintf(stderr, "Error: fopen %s\n", list_path);
+      goto disconnect;
+    }
   }
 
-  if(url.pathSize <= 0) { /* If path wasn't specified ask the user */
+  if(url.pathSize <= 0 && argc - optind <= 1 && !list && !mirror_path) { /* If no path was specified ask the user */
     if(url_getInput("PATH", &url.path, &url.pathSize)) {
       fprintf(stderr, "Error: url_getInput\n");
       goto disconnect;
     }
   }
-  fprintf(stderr, "%s\n", url.path);
 
-  if(ftp_download(&ftp, url.path)) {  /* Download the file */
-    fprintf(stderr, "Error: ftp_download\n");
-    goto disconnect;
+  if(mirror_path) {  /* Syncs the whole tree under the path */
+    memset(&mirror, 0, sizeof(mirror));
+    mirror_tree(&ftp, &mirror, url.pathSize > 0 ? url.path : "", mirror_path);  /* Failures are counted in mirror */
+    failed = mirror.failed + mirror.unlisted;
+    fprintf(stderr, "Mirror: %u files, %u downloaded (%.2f MB), %u up to date\n", mirror.files, mirror.downloaded,
+        (double) mirror.bytes / (1024.0 * 1024.0), mirror.files - mirror.downloaded - mirror.failed);
+    if(mirror.unlisted)
+      fprintf(stderr, "Error: %u directories couldn't be listed\n", mirror.unlisted);
   }
-  else
-    fprintf(stderr, "ftp_download was sucessful\n");
+
+  else if(sessions > 1 || engine_sessions > 0) {  /* Every file is queued for the pool or the engine */
+    if(url.pathSize > 0 && add_path(&paths, &count, url.path)) {
+      fprintf(stderr, "Error: add_path\n");
+      goto disconnect;
+    }
+    for(i = optind + 1; i < argc; i++) {
+      if(add_path(&paths, &count, argv[i])) {
+        fprintf(stderr, "Error: add_path\n");
+        goto disconnect;
+      }
+    }
+    if(list && read_list(list, &paths, &count)) {
+      fprintf(stderr, "Error: read_list\n");
+      goto disconnect;
+    }
+    if(engine_sessions > 0)
+      failed = engine_download(ip, url.user, url.password, paths, count, (unsigned int) engine_sessions, buffer_size);
+    else
+      failed = pool_download(&ftp, ip, url.user, url.password, paths, count, (unsigned int) sessions);
+  }
+
+  else {  /* Every file goes over this session, only the data connection is new */
+    if(url.pathSize > 0)
+      if(download_file(&ftp, ip, &url, url.path, (unsigned int) segments))
+        failed++;
+    for(i = optind + 1; i < argc; i++)
+      if(download_file(&ftp, ip, &url, argv[i], (unsigned int) segments))
+        failed++;
+    if(list)
+      failed += download_list(&ftp, ip, &url, list, (unsigned int) segments);
+  }
+
+  if(failed)
+    fprintf(stderr, "Error: %u downloads failed\n", failed);
 
   disconnect:
     url_clear(&url);            /* Clear URL fields */
+    if(list && list != stdin)
+      fclose(list);
+    while(count > 0)
+      free(paths[--count]);
+    free(paths);
     if(ftp_disconnect(&ftp)) {  /* Disconnect from the server */
       fprintf(stderr, "Error: ftp_disconnect\n");
       return 1;
     }
-  return 0;
+  return failed != 0;
 }
@@ -0,0 +1,666 @@
+#define _GNU_SOURCE       /* SOCK_NONBLOCK, clock_gettime */
+#include "engine.h"
+#include <stdio.h>        /* printf */
+#include <stdlib.h>       /* malloc */
+#include <string.h>       /* strrchr */
+#include <stdarg.h>       /* va_list */
+#include <ctype.h>        /* isdigit */
+#include <unistd.h>       /* read / close */
+#include <errno.h>        /* errno */
+#include <fcntl.h>        /* open */
+#include <time.h>         /* clock_gettime */
+#include <sys/epoll.h>    /* epoll_wait */
+#include <sys/socket.h>   /* socket / connect */
+#include <sys/resource.h> /* setrlimit */
+#include <netdb.h>        /* getaddrinfo */
+#include <netinet/in.h>   /* sockaddr_in6 */
+
+#define ENGINE_EVENTS 256  /* Events handled per epoll_wait */
+#define COMMAND_SIZE (3 * INPUT_SIZE) /* Commands of a session waiting to be sent */
+#define READ_SIZE 4096     /* Size of each read from a Control Socket */
+#define MEGABYTE (1024.0 * 1024.0)
+
+/**
+* Where a session is in its conversation with the server, each state waits for one reply
+*/
+typedef enum State {
+  STATE_CONNECT,            /* Control Socket connecting */
+  STATE_WELCOME,            /* Waiting for 220 */
+  STATE_USER,               /* Waiting for the reply to USER */
+  STATE_PASS,               /* Waiting for the reply to PASS */
+  STATE_PASS_IGNORED,       /* USER was enough (230), the reply to PASS doesn't matter */
+  STATE_TYPE,               /* Waiting for the reply to TYPE I */
+  STATE_PASV,               /* Waiting for 229 (EPSV) or 227 (PASV) */
+  STATE_RETR,               /* Waiting for 150, the data channel may still be connecting */
+  STATE_TRANSFER,           /* Receiving the file, waiting for the data to end and for 226 */
+  STATE_QUIT,               /* Waiting for 221 */
+  STATE_DONE                /* Closed */
+} State;
+
+struct Session;
+
+/**
+* Socket registered in the epoll set, the events point back to it
+*/
+typedef struct Channel {
+  struct Session * session;
+  int fd;                   /* -1 if closed */
+  int connected;            /* The non-blocking connect has completed */
+  unsigned int events;      /* Events being watched */
+} Channel;
+
+/**
+* One logged in session and the file it is downloading
+*/
+typedef struct Session {
+  State state;
+  unsigned int id;
+  Channel control, data;
+  char out[COMMAND_SIZE];   /* Commands not sent yet */
+  size_t out_start, out_end;
+  char line[REPLY_LINE_SIZE]; /* Reply line being received */
+  size_t line_size;
+  int code;                 /* Code of the reply being received, 0 between replies */
+  char text[REPLY_LINE_SIZE]; /* First line of the reply being received */
+  size_t file;              /* Index of the file being downloaded */
+  int file_fd;              /* Local file, -1 if not open */
+  int data_done;            /* The data channel reached end of file */
+  int reply_done;           /* The end of transfer reply arrived */
+  int file_failed;          /* Something went wrong with the file, it's only waiting for the replies */
+} Session;
+
+/**
+* State shared by all the sessions, the only thread owns it
+*/
+typedef struct Engine {
+  int epoll_fd;
+  struct sockaddr_storage server; /* Address of the Control Sockets */
+  socklen_t server_size;
+  int epsv;                 /* IPv6 server, data channels need EPSV */
+  const char * user, * password;
+  char * const * paths;     /* Files to download */
+  size_t count;             /* Number of files */
+  size_t next;              /* Next file to dispatch */
+  char * buffer;            /* Data buffer shared by every data channel */
+  size_t buffer_size;
+  unsigned int active;      /* Sessions not closed yet */
+  unsigned int downloaded;  /* Files downloaded */
+  long int bytes;           /* Bytes downloaded */
+} Engine;
+
+/**
+* Seconds since an arbitrary point, for measuring intervals
+*/
+static double now(void) {
+  struct timespec time;
+
+  clock_gettime(CLOCK_MONOTONIC, &time);
+  return (double) time.tv_sec + (double) time.tv_nsec / 1e9;
+}
+
+/**
+* Changes the events watched on the channel
+* @arg engine Engine of the channel
+* @arg channel Channel already in the epoll set
+* @arg events New events
+* @return Returns 0 in case of success, 1 in case of error
+*/
+static int watch(Engine * engine, Channel * channel, unsigned int events) {
+  struct epoll_event event;
+
+  if(channel->events == events)
+    return 0;
+  event.events = events;
+  event.data.ptr = channel;
+  if(epoll_ctl(engine->epoll_fd, EPOLL_CTL_MOD, channel->fd, &event) < 0) {
+    fprintf(stderr, "Error: epoll_ctl\n");
+    return 1;
+  }
+  channel->events = events;
+  return 0;
+}
+
+/**
+* Starts a non-blocking connect and adds the channel to the epoll set, it becomes writable once connected
+* @arg engine Engine of the channel
+* @arg channel Channel to open
+* @arg address Address to connect to
+* @return Returns 0 in case of success, 1 in case of error
+*/
+static int open_channel(Engine * engine, Channel * channel, const struct sockaddr_storage * address) {
+  struct epoll_event event;
+
+  channel->connected = 0;
+  channel->events = EPOLLOUT;
+  channel->fd = socket(address->ss_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+  if(channel->fd < 0) {
+    fprintf(stderr, "Error: socket()\n");
+    return 1;
+  }
+  if(connect(channel->fd, (const struct sockaddr *) address, engine->server_size) < 0 && errno != EINPROGRESS) {
+    fprintf(stderr, "Error: connect()\n");
+    close(channel->fd);
+    channel->fd = -1;
+    return 1;
+  }
+
+  event.events = channel->events;
+  event.data.ptr = channel;
+  if(epoll_ctl(engine->epoll_fd, EPOLL_CTL_ADD, channel->fd, &event) < 0) {
+    fprintf(stderr, "Error: epoll_ctl\n");
+    close(channel->fd);
+    channel->fd = -1;
+    return 1;
+  }
+  return 0;
+}
+
+/**
+* Removes the channel from the epoll set and closes it
+*/
+static void close_channel(Engine * engine, Channel * channel) {
+  if(channel->fd < 0)
+    return;
+  epoll_ctl(engine->epoll_fd, EPOLL_CTL_DEL, channel->fd, NULL);
+  close(channel->fd);
+  channel->fd = -1;
+}
+
+/**
+* Checks if the non-blocking connect of the channel succeeded
+* @return Returns 0 if connected, 1 otherwise
+*/
+static int check_connect(Channel * channel) {
+  socklen_t length = sizeof(int);
+  int error = 0;
+
+  if(getsockopt(channel->fd, SOL_SOCKET, SO_ERROR, &error, &length) < 0 || error) {
+    fprintf(stderr, "Error: session %u connect()\n", channel->session->id);
+    return 1;
+  }
+  channel->connected = 1;
+  return 0;
+}
+
+/**
+* Closes the session, whatever file it was downloading fails
+*/
+static void end_session(Engine * engine, Session * session) {
+  if(session->state == STATE_DONE)
+    return;
+  if(session->state == STATE_PASV || session->state == STATE_RETR || session->state == STATE_TRANSFER)
+    fprintf(stderr, "Error: session %u failed %s\n", session->id, engine->paths[session->file]);
+  if(session->file_fd >= 0)
+    close(session->file_fd);
+  session->file_fd = -1;
+  close_channel(engine, &session->data);
+  close_channel(engine, &session->control);
+  session->state = STATE_DONE;
+  engine->active--;
+}
+
+/**
+* Sends as much of the pending commands as the Control Socket takes, the rest waits for it to be writable
+* @return Returns 0 in case of success, 1 in case of error
+*/
+static int flush(Engine * engine, Session * session) {
+  ssize_t res;
+
+  while(session->control.connected && session->out_start < session->out_end) {
+    res = send(session->control.fd, session->out + session->out_start, session->out_end - session->out_start,
+        MSG_NOSIGNAL);
+    if(res < 0) {
+      if(errno == EINTR)
+        continue;
+      if(errno == EAGAIN)
+        break;
+      fprintf(stderr, "Error: session %u send\n", session->id);
+      return 1;
+    }
+    session->out_start += (size_t) res;
+  }
+  if(session->out_start == session->out_end)
+    session->out_start = session->out_end = 0;
+
+  if(!session->control.connected)
+    return 0;
+  return watch(engine, &session->control, session->out_end > 0 ? EPOLLIN | EPOLLOUT : EPOLLIN);
+}
+
+/**
+* Queues commands on the session and starts sending them
+* @arg format Commands, printf style, each ending in CRLF
+* @return Returns 0 in case of success, 1 if the session had to end
+*/
+static int send_commands(Engine * engine, Session * session, const char * format, ...) {
+  va_list args;
+  int res;
+
+  va_start(args, format);
+  res = vsnprintf(session->out + session->out_end, COMMAND_SIZE - session->out_end, format, args);
+  va_end(args);
+  if(res < 0 || (size_t) res >= COMMAND_SIZE - session->out_end) {
+    fprintf(stderr, "Error: session %u command too long\n", session->id);
+    end_session(engine, session);
+    return 1;
+  }
+  session->out_end += (size_t) res;
+  if(flush(engine, session)) {
+    end_session(engine, session);
+    return 1;
+  }
+  return 0;
+}
+
+/**
+* Dispatches the next file of the queue to the session, or ends it if the queue is empty
+* @return Returns 0 in case of success, 1 if the session had to end
+*/
+static int next_file(Engine * engine, Session * session) {
+  if(engine->next >= engine->count) {
+    session->state = STATE_QUIT;
+    return send_commands(engine, session, "QUIT\r\n");
+  }
+
+  session->file = engine->next++;
+  session->data_done = session->reply_done = session->file_failed = 0;
+  session->state = STATE_PASV;
+  return send_commands(engine, session, "%s\r\nRETR %s\r\n", engine->epsv ? "EPSV" : "PASV",
+      engine->paths[session->file]);
+}
+
+/**
+* Ends the current file of the session once both the data and the end of transfer reply are in
+* @arg ok 1 if the reply said the transfer was complete
+* @return Returns 0 in case of success, 1 if the session had to end
+*/
+static int end_file(Engine * engine, Session * session, int ok) {
+  const char * path = engine->paths[session->file];
+
+  if(session->file_fd >= 0 && close(session->file_fd) < 0)
+    ok = 0;
+  session->file_fd = -1;
+  close_channel(engine, &session->data);
+
+  if(ok && !session->file_failed)
+    engine->downloaded++;
+  else
+    fprintf(stderr, "Error: session %u failed %s\n", session->id, path);
+  return next_file(engine, session);
+}
+
+/**
+* Opens the local file of the current download, named after the last part of its path
+* @return Returns 0 in case of success, 1 in case of error
+*/
+static int open_file(Engine * engine, Session * session) {
+  const char * path = engine->paths[session->file];
+  const char * name = strrchr(path, '/');
+
+  session->file_fd = open(name ? name + 1 : path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if(session->file_fd < 0) {
+    fprintf(stderr, "Error: open %s\n", name ? name + 1 : path);
+    return 1;
+  }
+  return 0;
+}
+
+/**
+* Reads everything the data channel has into the file
+* @return Returns 0 in case of success, 1 if the session had to end
+*/
+static int receive_data(Engine * engine, Session * session) {
+  ssize_t res, written;
+  size_t done;
+
+  while(1) {
+    res = read(session->data.fd, engine->buffer, engine->buffer_size);
+    if(res < 0) {
+      if(errno == EINTR)
+        continue;
+      if(errno == EAGAIN)
+        return 0;
+      fprintf(stderr, "Error: session %u read\n", session->id);
+      session->file_failed = 1;
+      res = 0;
+    }
+    if(res == 0) { /* Server closed the data channel, the file is complete once the reply says so */
+      session->data_done = 1;
+      close_channel(engine, &session->data);
+      return session->reply_done ? end_file(engine, session, session->reply_done == 2) : 0;
+    }
+
+    for(done = 0; !session->file_failed && done < (size_t) res; done += (size_t) written) {
+      written = write(session->file_fd, engine->buffer + done, (size_t) res - done);
+      if(written < 0 && errno == EINTR)
+        written = 0;
+      else if(written < 0) {
+        fprintf(stderr, "Error: write\n");
+        session->file_failed = 1;
+      }
+    }
+    engine->bytes += (long int) res;
+  }
+}
+
+/**
+* Connects the data channel to the port given in the 229 reply, or the address given in the 227 reply
+* @return Returns 0 in case of success, 1 in case of error
+*/
+static int open_data(Engine * engine, Session * session) {
+  int ip1, ip2, ip3, ip4, port1, port2, port;
+  char * address = strchr(session->text, '(');
+  struct sockaddr_storage data;
+  struct sockaddr_in * data4 = (struct sockaddr_in *) &data;
+  char delimiter[4];
+
+  memcpy(&data, &engine->server, sizeof(data));
+  if(engine->epsv) { /* "(|||port|)", same address as the Control Socket */
+    if(!address || sscanf(address, "(%c%c%c%d%c", &delimiter[0], &delimiter[1], &delimiter[2], &port, &delimiter[3]) != 5
+        || port <= 0 || port > 65535) {
+      fprintf(stderr, "Error: sscanf\n");
+      return 1;
+    }
+    ((struct sockaddr_in6 *) &data)->sin6_port = htons((uint16_t) port);
+  }
+  else {
+    if(!address || sscanf(address, "(%d,%d,%d,%d,%d,%d)", &ip1, &ip2, &ip3, &ip4, &port1, &port2) != 6) {
+      fprintf(stderr, "Error: sscanf\n");
+      return 1;
+    }
+    data4->sin_addr.s_addr = htonl((uint32_t) ((ip1 << 24) | (ip2 << 16) | (ip3 << 8) | ip4));
+    data4->sin_port = htons((uint16_t) (port1 * 256 + port2));
+  }
+  return open_channel(engine, &session->data, &data);
+}
+
+/**
+* Moves the session forward with a complete reply
+* @arg code Code of the reply, its first line is in session->text
+* @return Returns 0 in case of success, 1 if the session had to end
+*/
+static int on_reply(Engine * engine, Session * session, int code) {
+  switch(session->state) {
+    case STATE_WELCOME:
+      if(code == 120) /* The welcome comes later */
+        return 0;
+      if(code != 220)
+        break;
+      session->state = STATE_USER;
+      return send_commands(engine, session, "USER %s\r\nPASS %s\r\nTYPE I\r\n", engine->user, engine->password);
+
+    case STATE_USER:
+      if(code == 230)
+        session->state = STATE_PASS_IGNORED;
+      else if(code == 331 || code == 332)
+        session->state = STATE_PASS;
+      else {
+        fprintf(stderr, "Error: session %u user refused\n", session->id);
+        break;
+      }
+      return 0;
+
+    case STATE_PASS:
+      if(code / 100 != 2) {
+        fprintf(stderr, "Error: session %u wrong password\n", session->id);
+        break;
+      }
+      session->state = STATE_TYPE;
+      return 0;
+
+    case STATE_PASS_IGNORED:
+      session->state = STATE_TYPE;
+      return 0;
+
+    case STATE_TYPE: /* Without binary mode the server may translate line endings */
+      if(code / 100 != 2)
+        fprintf(stderr, "Warning: session %u server refused binary mode (TYPE I)\n", session->id);
+      return next_file(engine, session);
+
+    case STATE_PASV: /* RETR is already on its way, its reply still has to be read */
+      session->state = STATE_RETR;
+      if(code != (engine->epsv ? 229 : 227) || open_data(engine, session))
+        session->file_failed = 1;
+      return 0;
+
+    case STATE_RETR:
+      if(code / 100 != 1) /* No transfer, no end of transfer reply */
+        return end_file(engine, session, 0);
+      session->state = STATE_TRANSFER;
+      if(session->data.fd < 0 || session->file_failed || open_file(engine, session)) {
+        session->file_failed = 1;
+        session->data_done = 1;
+        close_channel(engine, &session->data);
+        return 0;
+      }
+      if(session->data.connected && watch(engine, &session->data, EPOLLIN)) /* Otherwise it's watched when the connect completes */
+        break;
+      return 0;
+
+    case STATE_TRANSFER:
+      if(code / 100 == 1) /* Extra preliminary reply */
+        return 0;
+      session->reply_done = (code / 100 == 2) ? 2 : 1;
+      return session->data_done ? end_file(engine, session, session->reply_done == 2) : 0;
+
+    case STATE_QUIT:
+      end_session(engine, session);
+      return 1;
+
+    case STATE_CONNECT:
+    case STATE_DONE:
+    default:
+      break;
+  }
+
+  end_session(engine, session);
+  return 1;
+}
+
+/**
+* Parses a reply line, multi-line replies ("ddd-" up to "ddd ") are only complete on their last line
+* @return Returns 0 in case of success, 1 if the session had to end
+*/
+static int on_line(Engine * engine, Session * session) {
+  const char * line = session->line;
+  int code;
+
+  if(session->code == 0) { /* First line of a reply */
+    if(!isdigit((unsigned char) line[0]) || !isdigit((unsigned char) line[1]) || !isdigit((unsigned char) line[2])) {
+      fprintf(stderr, "Error: session %u bad reply '%s'\n", session->id, line);
+      end_session(engine, session);
+      return 1;
+    }
+    session->code = (line[0] - '0') * 100 + (line[1] - '0') * 10 + (line[2] - '0');
+    memcpy(session->text, line, session->line_size + 1);
+    if(line[3] == '-')
+      return 0;
+  }
+  else if(line[0] - '0' != session->code / 100 || line[1] - '0' != session->code / 10 % 10
+      || line[2] - '0' != session->code % 10 || (line[3] != ' ' && line[3] != '\0'))
+    return 0; /* Middle of a multi-line reply */
+
+  code = session->code;
+  session->code = 0;
+  return on_reply(engine, session, code);
+}
+
+/**
+* Reads what the Control Socket has and feeds it to the reply parser a byte at a time
+* @return Returns 0 in case of success, 1 if the session had to end
+*/
+static int receive_replies(Engine * engine, Session * session) {
+  char bytes[READ_SIZE];
+  ssize_t res, i;
+
+  while(1) {
+    res = read(session->control.fd, bytes, READ_SIZE);
+    if(res < 0 && errno == EINTR)
+      continue;
+    if(res < 0 && (errno == EAGAIN))
+      return 0;
+    if(res <= 0) {
+      if(session->state != STATE_QUIT)
+        fprintf(stderr, "Error: session %u lost the connection\n", session->id);
+      end_session(engine, session);
+      return 1;
+    }
+
+    for(i = 0; i < res; i++) {
+      if(bytes[i] == '\n') {
+        if(session->line_size > 0 && session->line[session->line_size - 1] == '\r')
+          session->line_size--;
+        session->line[session->line_size] = '\0';
+        if(on_line(engine, session))
+          return 1;
+        session->line_size = 0;
+      }
+      else if(session->line_size < REPLY_LINE_SIZE - 1) /* Longer lines are cut */
+        session->line[session->line_size++] = bytes[i];
+    }
+  }
+}
+
+/**
+* Handles the events of one channel
+* @arg channel Channel with events
+* @arg events Events that happened
+*/
+static void on_event(Engine * engine, Channel * channel, unsigned int events) {
+  Session * session = channel->session;
+
+  if(channel->fd < 0) /* Closed by an earlier event of the same batch */
+    return;
+
+  if(channel == &session->control) {
+    if(!channel->connected) {
+      if(check_connect(channel)) {
+        end_session(engine, session);
+        return;
+      }
+      session->state = STATE_WELCOME;
+      if(flush(engine, session))
+        end_session(engine, session);
+      return;
+    }
+    if((events & EPOLLOUT) && flush(engine, session)) {
+      end_session(engine, session);
+      return;
+    }
+    if(events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+      receive_replies(engine, session);
+    return;
+  }
+
+  /* Data channel */
+  if(!channel->connected) {
+    if(check_connect(channel)) {
+      session->file_failed = 1;
+      session->data_done = 1;
+      close_channel(engine, channel);
+      if(session->state == STATE_TRANSFER && session->reply_done)
+        end_file(engine, session, 0);
+      return;
+    }
+    /* Only read once the file is open, the data can be ahead of the 150 reply */
+    if(watch(engine, channel, session->state == STATE_TRANSFER ? EPOLLIN : 0))
+      end_session(engine, session);
+    return;
+  }
+  if(session->state == STATE_TRANSFER)
+    receive_data(engine, session);
+}
+
+unsigned int engine_download(const char * ip, const char * user, const char * password,
+    char * const * paths, size_t count, unsigned int sessions, size_t buffer_size) {
+  struct epoll_event events[ENGINE_EVENTS];
+  struct addrinfo hints, * address;
+  char service[8];
+  Session * list;
+  struct rlimit limit;
+  double start, seconds;
+  Engine engine;
+  unsigned int i;
+  int ready, j;
+
+  memset(&engine, 0, sizeof(engine));
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_NUMERICHOST;
+  snprintf(service, sizeof(service), "%d", SERVER_PORT);
+  if(getaddrinfo(ip, service, &hints, &address)) {
+    fprintf(stderr, "Error: getaddrinfo %s\n", ip);
+    return (unsigned int) count;
+  }
+  memcpy(&engine.server, address->ai_addr, address->ai_addrlen);
+  engine.server_size = address->ai_addrlen;
+  engine.epsv = (address->ai_family == AF_INET6);
+  freeaddrinfo(address);
+  engine.user = user;
+  engine.password = password;
+  engine.paths = paths;
+  engine.count = count;
+  engine.buffer_size = buffer_size;
+
+  if(sessions > count)
+    sessions = (unsigned int) count;
+  if(sessions == 0)
+    return 0;
+
+  /* Each session takes up to three descriptors (control, data, file) */
+  if(!getrlimit(RLIMIT_NOFILE, &limit) && limit.rlim_cur < limit.rlim_max) {
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+  }
+
+  engine.epoll_fd = epoll_create1(0);
+  engine.buffer = (char *) malloc(buffer_size);
+  list = (Session *) calloc(sessions, sizeof(Session));
+  if(engine.epoll_fd < 0 || !engine.buffer || !list) {
+    fprintf(stderr, "Error: engine_download\n");
+    if(engine.epoll_fd >= 0)
+      close(engine.epoll_fd);
+    free(engine.buffer);
+    free(list);
+    return (unsigned int) count;
+  }
+
+  start = now();
+  for(i = 0; i < sessions; i++) {
+    list[i].id = i;
+    list[i].file_fd = -1;
+    list[i].control.session = list[i].data.session = &list[i];
+    list[i].data.fd = -1;
+    if(open_channel(&engine, &list[i].control, &engine.server)) {
+      list[i].state = STATE_DONE;
+      continue;
+    }
+    list[i].state = STATE_CONNECT;
+    engine.active++;
+  }
+
+  while(engine.active > 0) {
+    ready = epoll_wait(engine.epoll_fd, events, ENGINE_EVENTS, -1);
+    if(ready < 0) {
+      if(errno == EINTR)
+        continue;
+      fprintf(stderr, "Error: epoll_wait\n");
+      break;
+    }
+    for(j = 0; j < ready; j++)
+      on_event(&engine, (Channel *) events[j].data.ptr, events[j].events);
+  }
+
+  for(i = 0; i < sessions; i++)
+    end_session(&engine, &list[i]);
+  seconds = now() - start;
+  fprintf(stderr, "Engine: %u sessions, %u of %lu files, %.2f MB in %.2f s (%.2f MB/s)\n", sessions,
+      engine.downloaded, (unsigned long) count, (double) engine.bytes / MEGABYTE, seconds,
+      seconds > 0 ? (double) engine.bytes / MEGABYTE / seconds : 0.0);
+
+  close(engine.epoll_fd);
+  free(engine.buffer);
+  free(list);
+  return (unsigned int) count - engine.downloaded;
+}
@@ -0,0 +1,25 @@
+#ifndef ENGINE_H
+#define ENGINE_H
+
+#include "ftp.h"
+
+#define MAX_ENGINE_SESSIONS 1024  /* Most sessions the engine drives at once */
+
+/**
+* Downloads the files over many sessions driven by a single thread. Every socket is non-blocking and
+* registered in one epoll set: connects, replies (parsed as they arrive, a byte at a time) and data
+* channels all progress as events, so a session waiting on the server costs no thread. Memory is bounded:
+* each session has fixed size buffers and the data is read through one buffer shared by all of them
+* @arg ip IP of the FTP server (IPv4 or IPv6, data channels use EPSV over IPv6)
+* @arg user Name of the user used to log in
+* @arg password Password of the user used to log in
+* @arg paths Paths of the files, dispatched in order to whichever session is free
+* @arg count Number of paths
+* @arg sessions Number of sessions
+* @arg buffer_size Size of each read from the data channels
+* @return Returns the number of files that failed
+*/
+unsigned int engine_download(const char * ip, const char * user, const char * password,
+    char * const * paths, size_t count, unsigned int sessions, size_t buffer_size);
+
+#endif
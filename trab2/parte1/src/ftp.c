@@ -1,44 +1,185 @@
+#define _GNU_SOURCE       /* splice, fallocate */
 #include "ftp.h"
 #include <stdio.h>        /* printf */
+#include <ctype.h>        /* isdigit */
 #include <stdlib.h>       /* malloc */
 #include <string.h>       /* strlen */
-#include <strings.h>      /* bzero */
 #include <unistd.h>       /* read / write */
-#include <arpa/inet.h>    /* inet_addr */
+#include <errno.h>        /* errno */
+#include <fcntl.h>        /* open */
+#include <sys/stat.h>     /* stat */
+#include <pthread.h>      /* pthread_create */
+#include <time.h>         /* timegm */
+#include <poll.h>         /* poll */
+#include <netdb.h>        /* getaddrinfo */
+#include <sys/socket.h>   /* socket / connect */
 
-int ftp_connect(const char * ip, const int port, int * socket_fd) {
-  struct	sockaddr_in server_addr;
+#define MAX_ADDRESSES 16          /* Addresses of a host tried when connecting */
+#define CONNECT_ATTEMPT_DELAY 250 /* Milliseconds before racing the next address (RFC 8305) */
 
-  /*server address handling*/
-  bzero((char*)&server_addr,sizeof(server_addr));
-  server_addr.sin_family = AF_INET;
-  server_addr.sin_addr.s_addr = inet_addr( ip );	/*32 bit Internet address network byte ordered*/
-  server_addr.sin_port = htons(port);		  /*server TCP port must be network byte ordered */
+/**
+* Part of a file downloaded by its own session
+*/
+typedef struct Segment {
+  const char * ip, * user, * password, * path;  /* Where and how to open the session */
+  int fd;                   /* Output file, shared by all segments */
+  long int offset;          /* First byte of the segment */
+  long int length;          /* Number of bytes of the segment */
+  size_t buffer_size;       /* Size of each read from the Data Socket */
+  int epsv;                 /* EPSV support, as known by the main session */
+  int result;               /* 0 in case of success, 1 in case of error */
+} Segment;
 
-  /*open an TCP socket*/
-  if ((*socket_fd = socket(AF_INET,SOCK_STREAM,0)) < 0) {
-    fprintf(stderr, "Error: socket()\n");
+/**
+* Writes the whole buffer, retrying on partial writes
+* @arg fd File Descriptor to write to
+* @arg buffer Data to write
+* @arg size Number of bytes to write
+* @return Returns 0 in case of success, 1 in case of error
+*/
+static int write_all(const int fd, const char * buffer, size_t size) {
+  ssize_t res;
+
+  while(size > 0) {
+    res = write(fd, buffer, size);
+    if(res < 0) {
+      if(errno == EINTR)
+        continue;
+      return 1;
+    }
+    buffer += res;
+    size -= (size_t) res;
+  }
+  return 0;
+}
+
+/**
+* Starts a non-blocking connect to the address
+* @arg address Address to connect to
+* @arg socket_fd Socket File Descriptor of the attempt, -1 if it failed right away
+* @return Returns 0 if the connection is up, 1 if it's in progress or failed
+*/
+static int start_connect(const struct addrinfo * address, int * socket_fd) {
+  *socket_fd = socket(address->ai_family, address->ai_socktype | SOCK_NONBLOCK, address->ai_protocol);
+  if(*socket_fd < 0)
     return 1;
+  if(!connect(*socket_fd, address->ai_addr, address->ai_addrlen))
+    return 0;
+  if(errno != EINPROGRESS) {
+    close(*socket_fd);
+    *socket_fd = -1;
+  }
+  return 1;
+}
+
+int ftp_connect(const char * host, const int port, int * socket_fd) {
+  const struct addrinfo * ordered[MAX_ADDRESSES];
+  struct pollfd attempts[MAX_ADDRESSES];
+  struct addrinfo hints, * list, * entry;
+  size_t count = 0, started = 0, pending = 0, first = 0, second = 0, i;
+  char service[8];
+  int family, fd, error, res;
+  socklen_t length;
+
+  /* Resolves the host to all of its addresses, IPv6 and IPv4 */
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  snprintf(service, sizeof(service), "%d", port);
+  if((res = getaddrinfo(host, service, &hints, &list))) {
+    fprintf(stderr, "Error: getaddrinfo %s: %s\n", host, gai_strerror(res));
+    return 1;
+  }
+
+  /* Alternates the families, starting with the one the resolver put first */
+  family = list->ai_family;
+  for(entry = list; entry; entry = entry->ai_next) {
+    if(entry->ai_family == family && first < MAX_ADDRESSES / 2)
+      ordered[2 * first++] = entry;
+    else if(entry->ai_family != family && second < MAX_ADDRESSES / 2)
+      ordered[2 * second++ + 1] = entry;
   }
+  for(i = 0; i < MAX_ADDRESSES; i++) /* Packs the slots the shorter family left empty */
+    if((i % 2 == 0 && i / 2 < first) || (i % 2 == 1 && i / 2 < second))
+      ordered[count++] = ordered[i];
 
-  /*connect to the server*/
-  if(connect(*socket_fd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
+  /* Happy eyeballs: every CONNECT_ATTEMPT_DELAY (or as soon as one fails) the next address joins the race,
+     the first connect to complete wins */
+  *socket_fd = -1;
+  while(*socket_fd < 0) {
+    if(started < count) {
+      if(!start_connect(ordered[started++], &fd)) {
+        *socket_fd = fd;
+        break;
+      }
+      if(fd >= 0) {
+        attempts[pending].fd = fd;
+        attempts[pending].events = POLLOUT;
+        pending++;
+      }
+    }
+    if(pending == 0) {
+      if(started == count)
+        break;
+      continue;
+    }
+
+    res = poll(attempts, (nfds_t) pending, started < count ? CONNECT_ATTEMPT_DELAY : -1);
+    if(res < 0 && errno != EINTR)
+      break;
+    for(i = 0; res > 0 && i < pending;) {
+      if(!attempts[i].revents) {
+        i++;
+        continue;
+      }
+      error = 0;
+      length = sizeof(error);
+      fd = attempts[i].fd;
+      attempts[i] = attempts[--pending];
+      if(getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &length) < 0 || error)
+        close(fd);
+      else {
+        *socket_fd = fd;
+        break;
+      }
+    }
+  }
+
+  while(pending > 0) /* Losers of the race */
+    close(attempts[--pending].fd);
+  freeaddrinfo(list);
+  if(*socket_fd < 0) {
     fprintf(stderr, "Error: connect()\n");
     return 1;
   }
 
+  /* The rest of the client uses blocking sockets */
+  fcntl(*socket_fd, F_SETFL, fcntl(*socket_fd, F_GETFL) & ~O_NONBLOCK);
+  return 0;
+}
+
+int ftp_peer(const int socket_fd, char * ip) {
+  struct sockaddr_storage address;
+  socklen_t length = sizeof(address);
+
+  if(getpeername(socket_fd, (struct sockaddr *) &address, &length) < 0
+      || getnameinfo((struct sockaddr *) &address, length, ip, MAX_IP_SIZE, NULL, 0, NI_NUMERICHOST)) {
+    fprintf(stderr, "Error: getpeername\n");
+    return 1;
+  }
   return 0;
 }
 
 int ftp_disconnect(FTP * ftp) {
-  if(ftp_write(ftp->control_socket_fd, "QUIT\n")) { /* Send QUIT command to end connection */
+  if(ftp_write(ftp->control_socket_fd, "QUIT\r\n")) { /* Send QUIT command to end connection */
     fprintf(stderr, "Error: ftp_disconnect\n");
     return 1;
   }
 
   /* Close sockets */
   close(ftp->control_socket_fd);
-  close(ftp->data_socket_fd);
+  if(ftp->data_socket_fd >= 0)
+    close(ftp->data_socket_fd);
   return 0;
 }
 
@@ -51,6 +192,89 @@ int ftp_read(const int socket_fd, char * message, size_t size) {
   return (res == 0);
 }
 
+/**
+* Reads one line of the Control Socket through the reply buffer, without the CRLF
+* @arg ftp FTP Struct of the server
+* @arg line Line read, NUL terminated and cut to size
+* @arg size Size of line
+* @return Returns 0 in case of success, 1 in case of error
+*/
+static int read_line(FTP * ftp, char * line, size_t size) {
+  char * start, * end;
+  size_t length;
+  ssize_t res;
+
+  while(!(end = memchr(ftp->reply + ftp->reply_start, '\n', ftp->reply_end - ftp->reply_start))) {
+    if(ftp->reply_start > 0) { /* Moves the partial line to the start to make room */
+      memmove(ftp->reply, ftp->reply + ftp->reply_start, ftp->reply_end - ftp->reply_start);
+      ftp->reply_end -= ftp->reply_start;
+      ftp->reply_start = 0;
+    }
+    if(ftp->reply_end == REPLY_BUFFER_SIZE) { /* Line longer than the buffer, taken as it is */
+      end = ftp->reply + REPLY_BUFFER_SIZE - 1;
+      break;
+    }
+    res = read(ftp->control_socket_fd, ftp->reply + ftp->reply_end, REPLY_BUFFER_SIZE - ftp->reply_end);
+    if(res < 0 && errno == EINTR)
+      continue;
+    if(res <= 0) {
+      fprintf(stderr, "Error: read\n");
+      return 1;
+    }
+    ftp->reply_end += (size_t) res;
+  }
+
+  start = ftp->reply + ftp->reply_start;
+  length = (size_t) (end - start);
+  ftp->reply_start += length + 1;
+  if(length > 0 && start[length - 1] == '\r')
+    length--;
+  if(length > size - 1)
+    length = size - 1;
+  memcpy(line, start, length);
+  line[length] = '\0';
+  return 0;
+}
+
+int ftp_reply(FTP * ftp, char * message, size_t size) {
+  char line[REPLY_LINE_SIZE];
+  size_t used = 0, length;
+  int code = -1, multiline = 0;
+
+  if(message && size > 0)
+    message[0] = '\0';
+
+  do {
+    if(read_line(ftp, line, REPLY_LINE_SIZE))
+      return -1;
+
+    if(code == -1) { /* First line: "ddd text" or "ddd-text" if more lines follow */
+      if(!isdigit((unsigned char) line[0]) || !isdigit((unsigned char) line[1]) || !isdigit((unsigned char) line[2])) {
+        fprintf(stderr, "Error: bad reply '%s'\n", line);
+        return -1;
+      }
+      code = (line[0] - '0') * 100 + (line[1] - '0') * 10 + (line[2] - '0');
+      multiline = (line[3] == '-');
+    }
+    else if(line[0] - '0' == code / 100 && line[1] - '0' == code / 10 % 10 && line[2] - '0' == code % 10
+        && (line[3] == ' ' || line[3] == '\0')) /* Last line: same code and a space */
+      multiline = 0;
+
+    /* Keeps as much of the text as fits */
+    if(message && used + 2 <= size) {
+      length = strlen(line);
+      if(length > size - used - 2)
+        length = size - used - 2;
+      memcpy(message + used, line, length);
+      used += length;
+      message[used++] = '\n';
+      message[used] = '\0';
+    }
+  } while(multiline);
+
+  return code;
+}
+
 int ftp_write(const int socket_fd, const char * message)
 {
   if(write(socket_fd, message, strlen(message)) < 0) {  /* Write message to the server */
@@ -61,109 +285,677 @@ int ftp_write(const int socket_fd, const char * message)
 }
 
 int ftp_login(FTP * ftp, const char * user, const char * password) {
-  char buffer[INPUT_SIZE];
+  char buffer[2 * INPUT_SIZE + 32];
+  int code_user, code_pass, code_type;
 
-  /* Send user */
-  sprintf(buffer, "USER %s\n", user);
+  /* Sends user, password and binary mode together, one round trip. Each command gets a reply even if an
+     earlier one failed, so all three are always read */
+  snprintf(buffer, sizeof(buffer), "USER %s\r\nPASS %s\r\nTYPE I\r\n", user, password);
   if(ftp_write(ftp->control_socket_fd, buffer)) {
     fprintf(stderr, "Error: ftp_write\n");
     return 1;
   }
 
-  /* Read response for the user */
-  if(ftp_read(ftp->control_socket_fd, buffer, INPUT_SIZE)) {
-    fprintf(stderr, "Error: ftp_read\n");
+  code_user = ftp_reply(ftp, NULL, 0);
+  code_pass = code_user < 0 ? -1 : ftp_reply(ftp, NULL, 0);
+  code_type = code_pass < 0 ? -1 : ftp_reply(ftp, NULL, 0);
+  if(code_type < 0) {
+    fprintf(stderr, "Error: ftp_reply\n");
     return 1;
   }
 
-  /* Send password */
-  sprintf(buffer, "PASS %s\n", password);
+  if(code_user != 230 && code_user != 331 && code_user != 332) {
+    fprintf(stderr, "Error: user refused\n");
+    return 1;
+  }
+
+  /* Detects Invalid Password Response, it doesn't matter if the user needed none (230) */
+  if(code_user != 230 && code_pass / 100 != 2) {
+    fprintf(stderr, "Error: wrong password\n");
+    return 1;
+  }
+
+  /* Without binary mode the server may translate line endings and the sizes won't match */
+  if(code_type / 100 != 2)
+    fprintf(stderr, "Warning: server refused binary mode (TYPE I)\n");
+  return 0;
+}
+
+/**
+* Reads the reply to SIZE
+* @arg ftp FTP Struct of the server
+* @arg size Size of the file, -1 if the server doesn't know it
+* @return Returns 0 in case of success, 1 in case of error on the Control Socket
+*/
+static int size_reply(FTP * ftp, long int * size) {
+  char buffer[INPUT_SIZE];
+  int code = ftp_reply(ftp, buffer, INPUT_SIZE);
+
+  if(code < 0)
+    return 1;
+  if(code != 213 || sscanf(buffer + 4, "%ld", size) != 1) /* Server doesn't support SIZE or file doesn't exist */
+    *size = -1;
+  return 0;
+}
+
+int ftp_size(FTP * ftp, const char * path, long int * size) {
+  char buffer[INPUT_SIZE];
+
+  /* Sends size command with file path */
+  snprintf(buffer, INPUT_SIZE, "SIZE %s\r\n", path);
   if(ftp_write(ftp->control_socket_fd, buffer)) {
     fprintf(stderr, "Error: ftp_write\n");
     return 1;
   }
 
-  /* Read response for the password */
-  if(ftp_read(ftp->control_socket_fd, buffer, INPUT_SIZE)) {
-    fprintf(stderr, "Error: ftp_read\n");
+  /* Reads response "213 <size>" */
+  if(size_reply(ftp, size) || *size < 0)
     return 1;
-  }
+  return 0;
+}
 
-  /* Detects Invalid Password Response */
-  if(buffer[0] == '5') {
-    fprintf(stderr, "Error: wrong password\n");
+/**
+* Receives the file from the data socket reading it in blocks of buffer_size bytes
+* @arg ftp FTP Struct of the server
+* @arg fd File Descriptor of the output file
+* @arg buffer_size Size of each read
+* @return Returns 0 in case of success, 1 in case of error
+*/
+static int receive_buffered(FTP * ftp, const int fd, size_t buffer_size) {
+  char * buffer;
+  ssize_t res;
+
+  buffer = (char *) malloc(buffer_size);
+  if(!buffer) {
+    fprintf(stderr, "Error: malloc\n");
     return 1;
   }
+
+  /* Receives File from the server in blocks and writes them to the file */
+  while((res = read(ftp->data_socket_fd, buffer, buffer_size)) != 0) {
+    if(res < 0) {
+      if(errno == EINTR)
+        continue;
+      fprintf(stderr, "Error: read\n");
+      free(buffer);
+      return 1;
+    }
+    if(write_all(fd, buffer, (size_t) res)) {
+      fprintf(stderr, "Error: write\n");
+      free(buffer);
+      return 1;
+    }
+  }
+
+  free(buffer);
+  return 0;
+}
+
+#ifdef __linux__
+/**
+* Moves the file from the data socket to the output file inside the kernel (socket -> pipe -> file)
+* @arg ftp FTP Struct of the server
+* @arg fd File Descriptor of the output file
+* @arg chunk_size Max bytes moved by each splice
+* @return Returns 0 in case of success, 1 in case of error, 2 if splice is not supported and nothing was read
+*/
+static int receive_splice(FTP * ftp, const int fd, size_t chunk_size) {
+  char buffer[INPUT_SIZE];
+  int pipe_fd[2];
+  ssize_t in, out;
+  int started = 0;
+
+  if(pipe(pipe_fd) < 0)
+    return 2;
+  fcntl(pipe_fd[1], F_SETPIPE_SZ, (int) chunk_size); /* Bigger pipe means fewer splices, it's only a hint */
+
+  while(1) {
+    in = splice(ftp->data_socket_fd, NULL, pipe_fd[1], NULL, chunk_size, SPLICE_F_MOVE | SPLICE_F_MORE);
+    if(in == 0)
+      break;
+    if(in < 0) {
+      if(errno == EINTR)
+        continue;
+      close(pipe_fd[0]);
+      close(pipe_fd[1]);
+      if(!started && (errno == EINVAL || errno == ENOSYS))
+        return 2;
+      fprintf(stderr, "Error: splice\n");
+      return 1;
+    }
+    started = 1;
+
+    while(in > 0) { /* Empties the pipe into the file */
+      out = splice(pipe_fd[0], NULL, fd, NULL, (size_t) in, SPLICE_F_MOVE | SPLICE_F_MORE);
+      if(out < 0 && errno == EINTR)
+        continue;
+      if(out < 0 && errno == EINVAL) { /* File system can't splice, copy this chunk by hand */
+        out = read(pipe_fd[0], buffer, (size_t) in < INPUT_SIZE ? (size_t) in : INPUT_SIZE);
+        if(out > 0 && write_all(fd, buffer, (size_t) out))
+          out = -1;
+      }
+      if(out <= 0) {
+        fprintf(stderr, "Error: splice\n");
+        close(pipe_fd[0]);
+        close(pipe_fd[1]);
+        return 1;
+      }
+      in -= out;
+    }
+  }
+
+  close(pipe_fd[0]);
+  close(pipe_fd[1]);
   return 0;
 }
+#endif
 
 int ftp_download(FTP * ftp, const char * path) {
   const char * offset = strrchr(path, '/'); /* Pointes to the last occorence of '/' */
-  FILE *f;
 
   if(!offset)  /* No occorrence of '/' filename is the path itself */
-    f = fopen(offset, "w");
-  else
-    f = fopen(offset + 1, "w");
+    return ftp_retrieve(ftp, path, path);
+  return ftp_retrieve(ftp, path, offset + 1);
+}
 
-  if (!f) { /* Failed to create/open file */
-    fprintf(stderr, "Error: fopen\n");
-    return 1;
+/**
+* Closes the data connection, it only serves one transfer
+* @arg ftp FTP Struct of the server
+*/
+static void close_data(FTP * ftp) {
+  if(ftp->data_socket_fd >= 0)
+    close(ftp->data_socket_fd);
+  ftp->data_socket_fd = -1;
+}
+
+/**
+* Gets the data connection ready to be pipelined with a transfer command. The first time a session needs
+* one it finds out, with a round trip, if the server knows EPSV
+* @arg ftp FTP Struct of the server
+* @return Returns the passive command to send first ("" if the data connection is open), NULL in case of error
+*/
+static const char * passive_command(FTP * ftp) {
+  if(ftp->data_socket_fd >= 0)
+    return "";
+  if(ftp->epsv == 0)
+    return ftp_pasv(ftp) ? NULL : "";
+  return ftp->epsv > 0 ? "EPSV\r\n" : "PASV\r\n";
+}
+
+int ftp_retrieve(FTP * ftp, const char * path, const char * filename) {
+  size_t buffer_size = ftp->buffer_size ? ftp->buffer_size : DATA_BUFFER_SIZE;
+  char buffer[INPUT_SIZE], commands[3 * INPUT_SIZE];
+  const char * passive;
+  long int size = -1, offset = 0;
+  int fd, res = 2, code, connected = 1;
+  struct stat info;
+  size_t used = 0;
+  char * bytes;
+
+  /* Resume: the bytes already in the local file aren't transferred again, the size says if they can be kept */
+  if(ftp->resume && !stat(filename, &info) && S_ISREG(info.st_mode) && info.st_size > 0) {
+    offset = (long int) info.st_size;
+    if(ftp_size(ftp, path, &size))
+      size = -1;
+    if(offset == size) {
+      fprintf(stderr, "%s is already complete\n", filename);
+      close_data(ftp);
+      return 0;
+    }
+    if(size >= 0 && offset > size) /* Not a part of this file, starts over */
+      offset = 0;
   }
 
-  char buffer[INPUT_SIZE], ch;
+  passive = passive_command(ftp);
+  if(!passive) {
+    close_data(ftp);
+    return 1;
+  }
 
-  /* Sends retr command with file path */
-  sprintf(buffer, "%s %s\n", "retr", path);
-  if(ftp_write(ftp->control_socket_fd, buffer)) {
+  /* Pipelines the commands in one write, the replies are read in order. RETR only starts
+     after the data connection is up, so it's safe to send it before the PASV reply arrives */
+  used += (size_t) snprintf(commands + used, sizeof(commands) - used, "%s", passive);
+  if(!ftp->resume) /* Size is only used to reserve space, it's fine if it's unknown */
+    used += (size_t) snprintf(commands + used, sizeof(commands) - used, "SIZE %s\r\n", path);
+  if(offset > 0)
+    used += (size_t) snprintf(commands + used, sizeof(commands) - used, "REST %ld\r\n", offset);
+  snprintf(commands + used, sizeof(commands) - used, "RETR %s\r\n", path);
+  if(ftp_write(ftp->control_socket_fd, commands)) {
     fprintf(stderr, "Error: ftp_write\n");
+    close_data(ftp);
+    return 1;
+  }
+
+  if(passive[0] && ftp_pasv_reply(ftp))
+    connected = 0; /* The other replies must still be read */
+  if(!ftp->resume && size_reply(ftp, &size)) {
+    close_data(ftp);
+    return 1;
+  }
+  if(offset > 0) {
+    code = ftp_reply(ftp, NULL, 0);
+    if(code < 0) {
+      close_data(ftp);
+      return 1;
+    }
+    if(code != 350) { /* Server can't restart, starts over */
+      fprintf(stderr, "REST not supported, downloading %s from the start\n", path);
+      offset = 0;
+    }
+    else
+      fprintf(stderr, "Resuming %s at byte %ld\n", path, offset);
+  }
+
+  /* Reads the 150 reply, it may carry the size as "(<size> bytes)" */
+  code = ftp_reply(ftp, buffer, INPUT_SIZE);
+  if(code / 100 != 1 || !connected) {
+    if(code >= 0)
+      fprintf(stderr, "Error: retr %s", buffer);
+    if(code / 100 == 1) /* Transfer started without us, waits for its end */
+      ftp_reply(ftp, NULL, 0);
+    close_data(ftp);
+    return 1;
+  }
+
+  /* Writes after the bytes already there when resuming (not O_APPEND, splice can't write to it) */
+  fd = open(filename, offset > 0 ? O_WRONLY : O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if(fd < 0 || lseek(fd, (off_t) offset, SEEK_SET) < 0) { /* Failed to create/open file */
+    fprintf(stderr, "Error: open\n");
+    if(fd >= 0)
+      close(fd);
+    close_data(ftp);
+    ftp_reply(ftp, NULL, 0);
+    return 1;
+  }
+  if(size < 0 && (bytes = strrchr(buffer, '(')) && sscanf(bytes, "(%ld bytes)", &size) == 1)
+    size += offset; /* The 150 reply counts only what is left */
+
+#ifdef __linux__
+  /* Reserves the blocks up front so the file isn't fragmented, the size stays as is until data is written */
+  if(size > offset)
+    fallocate(fd, FALLOC_FL_KEEP_SIZE, (off_t) offset, (off_t) (size - offset));
+
+  if(ftp->zero_copy)
+    res = receive_splice(ftp, fd, buffer_size);
+#endif
+  if(res == 2) /* Not zero copy or splice not supported */
+    res = receive_buffered(ftp, fd, buffer_size);
+
+  close_data(ftp);
+  if(close(fd) < 0) {
+    fprintf(stderr, "Error: close\n");
+    res = 1;
+  }
+
+  /* Reads the end of transfer reply so the control connection can be used for the next file */
+  code = ftp_reply(ftp, buffer, INPUT_SIZE);
+  if(code / 100 != 2) {
+    fprintf(stderr, "Error: transfer of %s didn't complete\n", path);
     return 1;
   }
 
-  /* Receives File from the server and writes to the file */
-  while(!ftp_read(ftp->data_socket_fd, &ch, 1)) {
-    if(fwrite(&ch, 1, 1, f) < 0) {
-      fprintf(stderr, "Error: fwrite\n");
-      fclose(f);
+  /* Resume: checks that the pieces add up to the file in the server */
+  if(!res && ftp->resume && !ftp_size(ftp, path, &size) && (stat(filename, &info) || (long int) info.st_size != size)) {
+    fprintf(stderr, "Error: %s has %ld bytes, the server has %ld\n", filename, (long int) info.st_size, size);
+    return 1;
+  }
+  return res;
+}
+
+/**
+* Connects the Data Socket to the address of a 229 (EPSV) or 227 (PASV) reply
+* @arg ftp FTP Struct of the server
+* @arg reply Text of the reply
+* @return Returns 0 in case of success, 1 in case of error
+*/
+static int passive_connect(FTP * ftp, const char * reply) {
+  const char * address = strchr(reply, '(');
+  char ip[MAX_IP_SIZE], delimiter[4];
+  int port;
+
+  if(ftp->epsv > 0) { /* "(|||port|)", the server is the one at the other end of the Control Socket */
+    if(!address || sscanf(address, "(%c%c%c%d%c", &delimiter[0], &delimiter[1], &delimiter[2], &port, &delimiter[3]) != 5
+        || delimiter[1] != delimiter[0] || delimiter[2] != delimiter[0] || delimiter[3] != delimiter[0]) {
+      fprintf(stderr, "Error: sscanf\n");
       return 1;
     }
+    if(ftp_peer(ftp->control_socket_fd, ip))
+      return 1;
+  }
+  else { /* Parsers IP from response */
+    int ip1, ip2, ip3, ip4, port1, port2;
+    if(!address || sscanf(address, "(%d,%d,%d,%d,%d,%d)", &ip1, &ip2, &ip3, &ip4, &port1, &port2) != 6) {
+      fprintf(stderr, "Error: sscanf\n");
+      return 1;
+    }
+    snprintf(ip, MAX_IP_SIZE, "%d.%d.%d.%d", ip1, ip2, ip3, ip4);
+    port = port1 * 256 + port2;
+  }
+
+  if(ftp_connect(ip, port, &ftp->data_socket_fd)) {
+    fprintf(stderr, "Error: ftp_connect\n");
+    close_data(ftp);
+    return 1;
   }
-  fclose(f);
   return 0;
 }
 
+int ftp_pasv_reply(FTP * ftp) {
   char buffer[INPUT_SIZE];
+
+  /* Reads response (IP + Port, or just the Port for EPSV) */
+  if(ftp_reply(ftp, buffer, INPUT_SIZE) != (ftp->epsv > 0 ? 229 : 227)) {
+    fprintf(stderr, "Error: ftp_reply\n");
+    return 1;
+  }
+  printf("%s", buffer);
+  return passive_connect(ftp, buffer);
+}
+
 int ftp_pasv(FTP * ftp) {
+  char buffer[INPUT_SIZE];
+  int code;
+
+  /* EPSV works over IPv6 and doesn't trust the address in the reply, PASV is the fallback */
+  if(ftp->epsv >= 0) {
+    if(ftp_write(ftp->control_socket_fd, "EPSV\r\n")) {
+      fprintf(stderr, "Error: ftp_write\n");
+      return 1;
+    }
+    code = ftp_reply(ftp, buffer, INPUT_SIZE);
+    if(code == 229) {
+      ftp->epsv = 1;
+      printf("%s", buffer);
+      return passive_connect(ftp, buffer);
+    }
+    if(code / 100 != 5) {
+      fprintf(stderr, "Error: ftp_reply\n");
+      return 1;
+    }
+    ftp->epsv = -1; /* Not supported, the session sticks to PASV */
+  }
 
   /* Sends pasv command */
-  if(ftp_write(ftp->control_socket_fd, "PASV\n")) {
+  if(ftp_write(ftp->control_socket_fd, "PASV\r\n")) {
     fprintf(stderr, "Error: ftp_write\n");
     return 1;
   }
+  return ftp_pasv_reply(ftp);
+}
+
+int ftp_session(FTP * ftp, const char * ip, const char * user, const char * password) {
+  int code;
 
-  /* Reads response (IP + Port) */
-  if(ftp_read(ftp->control_socket_fd, buffer, INPUT_SIZE)) {
-    fprintf(stderr, "Error: ftp_read\n");
+  memset(ftp, 0, sizeof(FTP)); /* Default settings */
+  ftp->data_socket_fd = -1;
+  if(ftp_connect(ip, SERVER_PORT, &ftp->control_socket_fd)) {
+    fprintf(stderr, "Error: ftp_connect\n");
     return 1;
   }
-  printf("%s", buffer);
 
-  /* Parsers IP from response */
-  int ip1, ip2, ip3, ip4, port1, port2;
-  if(!sscanf(strchr(buffer, '('), "(%d,%d,%d,%d,%d,%d)", &ip1, &ip2, &ip3, &ip4, &port1, &port2)) {
-    fprintf(stderr, "Error: sscanf\n");
+  /* Read Server Connection Welcome, 120 means it comes later */
+  while((code = ftp_reply(ftp, NULL, 0)) == 120);
+  if(code != 220 || ftp_login(ftp, user, password)) {
+    fprintf(stderr, "Error: ftp_session\n");
+    close(ftp->control_socket_fd);
+    return 1;
+  }
+  return 0;
+}
+
+/**
+* Downloads one segment on its own session: REST to the segment offset, RETR, and pwrite()s
+* until the segment is complete
+* @arg arg Segment to download
+* @return Returns NULL, the result is left in the segment
+*/
+static void * download_segment(void * arg) {
+  Segment * segment = (Segment *) arg;
+  char buffer[3 * INPUT_SIZE];
+  long int offset = segment->offset, remaining = segment->length;
+  const char * passive;
+  size_t size;
+  ssize_t res;
+  char * data = NULL;
+  FTP ftp;
+
+  segment->result = 1;
+  if(ftp_session(&ftp, segment->ip, segment->user, segment->password))
+    return NULL;
+  ftp.epsv = segment->epsv;
+
+  data = (char *) malloc(segment->buffer_size);
+  if(!data) {
+    fprintf(stderr, "Error: malloc\n");
+    goto disconnect;
+  }
+
+  /* Starts the transfer at the segment offset, the commands go in one write */
+  passive = passive_command(&ftp);
+  if(!passive) {
+    fprintf(stderr, "Error: segment at %ld\n", segment->offset);
+    goto disconnect;
+  }
+  snprintf(buffer, sizeof(buffer), "%sREST %ld\r\nRETR %s\r\n", passive, segment->offset, segment->path);
+  if(ftp_write(ftp.control_socket_fd, buffer) || (passive[0] && ftp_pasv_reply(&ftp))) {
+    fprintf(stderr, "Error: segment at %ld\n", segment->offset);
+    goto disconnect;
+  }
+  if(ftp_reply(&ftp, NULL, 0) != 350) {
+    fprintf(stderr, "Error: REST %ld not accepted\n", segment->offset);
+    goto disconnect;
+  }
+  if(ftp_reply(&ftp, NULL, 0) / 100 != 1) {
+    fprintf(stderr, "Error: retr at %ld\n", segment->offset);
+    goto disconnect;
+  }
+
+  /* The server sends until the end of the file, stops reading at the end of the segment */
+  while(remaining > 0) {
+    size = (size_t) remaining < segment->buffer_size ? (size_t) remaining : segment->buffer_size;
+    res = read(ftp.data_socket_fd, data, size);
+    if(res < 0 && errno == EINTR)
+      continue;
+    if(res <= 0) {
+      fprintf(stderr, "Error: segment at %ld ended %ld bytes early\n", segment->offset, remaining);
+      goto disconnect;
+    }
+    if(pwrite(segment->fd, data, (size_t) res, (off_t) offset) != res) {
+      fprintf(stderr, "Error: pwrite\n");
+      goto disconnect;
+    }
+    offset += res;
+    remaining -= res;
+  }
+  segment->result = 0;
+
+  disconnect:
+    free(data);
+    ftp_disconnect(&ftp);
+    return NULL;
+}
+
+int ftp_download_segmented(FTP * ftp, const char * ip, const char * user, const char * password,
+    const char * path, unsigned int segments) {
+  const char * offset = strrchr(path, '/'); /* Pointes to the last occorence of '/' */
+  const char * filename = offset ? offset + 1 : path; /* No occorrence of '/' filename is the path itself */
+  size_t buffer_size = ftp->buffer_size ? ftp->buffer_size : DATA_BUFFER_SIZE;
+  pthread_t * threads;
+  Segment * segment;
+  char * part;
+  long int size;
+  unsigned int i;
+  int fd, res = 0;
+
+  /* Unknown size or too small to be worth more connections, downloads on this session */
+  if(ftp_size(ftp, path, &size) || size / MIN_SEGMENT_SIZE < 2 || segments < 2)
+    return ftp_download(ftp, path);
+  if(size / MIN_SEGMENT_SIZE < segments)
+    segments = (unsigned int) (size / MIN_SEGMENT_SIZE);
+
+  /* Written under another name and renamed when every segment is in: the file is preallocated
+     to its full size, a failed run must not leave something that looks complete */
+  if(asprintf(&part, "%s.part", filename) < 0) {
+    fprintf(stderr, "Error: asprintf\n");
+    return 1;
+  }
+  fd = open(part, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if(fd < 0) { /* Failed to create/open file */
+    fprintf(stderr, "Error: open\n");
+    free(part);
     return 1;
   }
 
-  char ip[MAX_IP_SIZE];
-  if(!sprintf(ip, "%d.%d.%d.%d", ip1, ip2, ip3, ip4)) {
-    fprintf(stderr, "Error: sprintf\n");
+  /* Each segment writes in its own slice of the full sized file */
+#ifdef __linux__
+  if(fallocate(fd, 0, 0, (off_t) size) < 0)
+#endif
+  if(ftruncate(fd, (off_t) size) < 0) {
+    fprintf(stderr, "Error: ftruncate\n");
+    close(fd);
+    unlink(part);
+    free(part);
     return 1;
   }
 
-  int port = port1 * 256 + port2;
-  if(ftp_connect(ip, port, &ftp->data_socket_fd)) {
-    fprintf(stderr, "Error: ftp_connect\n");
+  threads = (pthread_t *) malloc(segments * sizeof(pthread_t));
+  segment = (Segment *) malloc(segments * sizeof(Segment));
+  if(!threads || !segment) {
+    fprintf(stderr, "Error: malloc\n");
+    free(threads);
+    free(segment);
+    close(fd);
+    unlink(part);
+    free(part);
+    return 1;
+  }
+
+  fprintf(stderr, "Downloading %ld bytes in %u segments\n", size, segments);
+  for(i = 0; i < segments; i++) {
+    segment[i].ip = ip;
+    segment[i].user = user;
+    segment[i].password = password;
+    segment[i].path = path;
+    segment[i].fd = fd;
+    segment[i].offset = size / segments * i;
+    segment[i].length = (i == segments - 1) ? size - segment[i].offset : size / segments;
+    segment[i].buffer_size = buffer_size;
+    segment[i].epsv = ftp->epsv;
+    segment[i].result = 1;
+    if(pthread_create(&threads[i], NULL, download_segment, &segment[i])) {
+      fprintf(stderr, "Error: pthread_create\n");
+      segments = i;
+      res = 1;
+      break;
+    }
+  }
+
+  for(i = 0; i < segments; i++) {
+    pthread_join(threads[i], NULL);
+    res |= segment[i].result;
+  }
+
+  free(threads);
+  free(segment);
+  if(close(fd) < 0) {
+    fprintf(stderr, "Error: close\n");
+    res = 1;
+  }
+  if(!res && rename(part, filename) < 0) {
+    fprintf(stderr, "Error: rename\n");
+    res = 1;
+  }
+  if(res) /* Holes where the failed segments were, it can't be kept */
+    unlink(part);
+  free(part);
+  return res;
+}
+
+int ftp_mdtm(FTP * ftp, const char * path, time_t * mtime) {
+  char buffer[INPUT_SIZE];
+  struct tm time;
+
+  /* Sends mdtm command with file path */
+  snprintf(buffer, INPUT_SIZE, "MDTM %s\r\n", path);
+  if(ftp_write(ftp->control_socket_fd, buffer)) {
+    fprintf(stderr, "Error: ftp_write\n");
+    return 1;
+  }
+
+  /* Reads response "213 YYYYMMDDHHMMSS", always in UTC */
+  if(ftp_reply(ftp, buffer, INPUT_SIZE) != 213)
+    return 1;
+  memset(&time, 0, sizeof(time));
+  if(sscanf(buffer + 4, "%4d%2d%2d%2d%2d%2d", &time.tm_year, &time.tm_mon, &time.tm_mday,
+      &time.tm_hour, &time.tm_min, &time.tm_sec) != 6)
+    return 1;
+  time.tm_year -= 1900;
+  time.tm_mon -= 1;
+  *mtime = timegm(&time);
+  return 0;
+}
+
+int ftp_list(FTP * ftp, const char * command, const char * path, char ** listing, size_t * size) {
+  char buffer[2 * INPUT_SIZE];
+  size_t capacity = INPUT_SIZE;
+  const char * passive = passive_command(ftp);
+  int code, connected = 1;
+  ssize_t res = 0;
+  char * grown;
+
+  *listing = NULL;
+  *size = 0;
+  if(!passive)
+    return 1;
+
+  /* Sends the listing command, with the path of the directory if there is one, after PASV in the same write */
+  snprintf(buffer, sizeof(buffer), "%s%s%s%s\r\n", passive, command, path && path[0] ? " " : "",
+      path ? path : "");
+  if(ftp_write(ftp->control_socket_fd, buffer)) {
+    fprintf(stderr, "Error: ftp_write\n");
+    close_data(ftp);
+    return 1;
+  }
+  if(passive[0] && ftp_pasv_reply(ftp))
+    connected = 0;
+
+  code = ftp_reply(ftp, NULL, 0);
+  if(code / 100 != 1 || !connected) { /* Command not supported or no such directory */
+    if(code / 100 == 1)
+      ftp_reply(ftp, NULL, 0);
+    close_data(ftp);
+    return code / 100 > 1 ? code : 1; /* The reply tells the two apart */
+  }
+
+  /* Reads the whole listing, it's NUL terminated so it can be parsed as a string */
+  *listing = (char *) malloc(capacity);
+  while(*listing) {
+    if(*size + 1 == capacity) {
+      grown = (char *) realloc(*listing, capacity *= 2);
+      if(!grown) {
+        free(*listing);
+        *listing = NULL;
+        break;
+      }
+      *listing = grown;
+    }
+    res = read(ftp->data_socket_fd, *listing + *size, capacity - *size - 1);
+    if(res < 0 && errno == EINTR)
+      continue;
+    if(res <= 0) {
+      (*listing)[*size] = '\0';
+      break;
+    }
+    *size += (size_t) res;
+  }
+  close_data(ftp);
+
+  /* Reads the end of transfer reply */
+  code = ftp_reply(ftp, NULL, 0);
+  if(!*listing || res < 0 || code / 100 != 2) {
+    fprintf(stderr, "Error: %s didn't complete\n", command);
+    free(*listing);
+    *listing = NULL;
     return 1;
   }
   return 0;
@@ -2,9 +2,15 @@
 #define FTP_H
 
 #include <stddef.h> /* size_t */
+#include <time.h>   /* time_t */
 
+#define SERVER_PORT 21  /* Default Server Port */
 #define INPUT_SIZE 128  /* Size of buffer used to read input from the server */
-#define MAX_IP_SIZE 16  /* Max Size of a IP string */
+#define MAX_IP_SIZE 64  /* Max Size of a IP string, IPv6 with a scope included */
+#define DATA_BUFFER_SIZE (256 * 1024) /* Default size of the buffer used to read the data socket */
+#define MIN_SEGMENT_SIZE (1024 * 1024) /* Smallest part of a file worth its own connection */
+#define REPLY_BUFFER_SIZE 4096 /* Size of the buffer of the Control Socket */
+#define REPLY_LINE_SIZE 512 /* Max size of a reply line, longer lines are cut */
 
 /**
 * Struct that contained the file descriptors of the sockets used in the FTP connection
@@ -12,16 +18,31 @@
 typedef struct FTP {
   int data_socket_fd;       /* Data Socket File Descriptor */
   int control_socket_fd;    /* Control Socket File Descriptor */
+  size_t buffer_size;       /* Size of each read from the Data Socket */
+  int zero_copy;            /* Splice the Data Socket into the file without copying to userspace (Linux) */
+  int resume;               /* Continue partial local files with REST instead of downloading them again */
+  int epsv;                 /* 1 if the server knows EPSV, -1 if it only knows PASV, 0 if not known yet */
+  char reply[REPLY_BUFFER_SIZE]; /* Bytes received on the Control Socket and not parsed yet */
+  size_t reply_start, reply_end; /* Unparsed part of reply */
 } FTP;
 
 /**
-* Connects the user to the FTP server with the IP ip and Port port
-* @arg ip FTP IP of the FTP server
+* Connects the user to the FTP server with the host name or IP host and Port port. All the IPv6 and IPv4
+* addresses of the host race each other (happy eyeballs), a new one starting every 250 ms
+* @arg host Host name or IP (IPv4 or IPv6) of the FTP server
 * @arg port FTP Port of the FTP server
 * @arg socket_fd Socket File Descriptor opened by the connection
 * @return Returns 0 in case of success, 1 in case of error
 */
-int ftp_connect(const char * ip, const int port, int * socket_fd);
+int ftp_connect(const char * host, const int port, int * socket_fd);
+
+/**
+* Gets the IP at the other end of the socket
+* @arg socket_fd Socket File Descriptor
+* @arg ip IP of the peer, MAX_IP_SIZE bytes
+* @return Returns 0 in case of success, 1 in case of error
+*/
+int ftp_peer(const int socket_fd, char * ip);
 
 /**
 * Disconnects the user from the FTP server
@@ -39,6 +60,16 @@ int ftp_disconnect(FTP * ftp);
 */
 int ftp_read(const int socket_fd, char * message, size_t size);
 
+/**
+* Reads the next full reply from the Control Socket, with all the lines of a multi-line reply (RFC 959).
+* Bytes after the reply stay in ftp->reply, so replies to pipelined commands are read one at a time
+* @arg ftp FTP Struct of the server
+* @arg message Text of the reply, NUL terminated and cut to size (may be NULL)
+* @arg size Size of message
+* @return Returns the 3 digit reply code, -1 in case of error
+*/
+int ftp_reply(FTP * ftp, char * message, size_t size);
+
 /**
 * Sends a message to the server
 * @arg socket_fd Socket File Descriptor
@@ -48,7 +79,8 @@ int ftp_read(const int socket_fd, char * message, size_t size);
 int ftp_write(const int socket_fd, const char * message);
 
 /**
-* Logins the User user to the FTP server
+* Logins the User user to the FTP server and switches to binary mode (TYPE I), so files arrive byte for byte.
+* USER, PASS and TYPE are sent in the same write
 * @arg ftp FTP Struct of the server
 * @arg user Name of the user used to log in
 * @arg password Password of the user used to log in
@@ -57,7 +89,20 @@ int ftp_write(const int socket_fd, const char * message);
 int ftp_login(FTP * ftp, const char * user, const char * password);
 
 /**
-* Downloads the file in the Path path
+* Gets the size of the file in the Path path
+* @arg ftp FTP Struct of the server
+* @arg path Path of the file
+* @arg size Size of the file in bytes
+* @return Returns 0 in case of success, 1 in case of error
+*/
+int ftp_size(FTP * ftp, const char * path, long int * size);
+
+/**
+* Downloads the file in the Path path, reading the data socket in blocks of ftp->buffer_size bytes
+* or splicing it straight into the file if ftp->zero_copy is set. The file space is reserved when its size is known.
+* If ftp->resume is set an existing local file is continued with REST and checked against SIZE at the end.
+* If no data connection is open, PASV is sent in the same write as SIZE and RETR (pipelined).
+* The data connection is closed at the end
 * @arg ftp FTP Struct of the server
 * @arg path Path of the file
 * @return Returns 0 in case of success, 1 in case of error
@@ -65,10 +110,74 @@ int ftp_login(FTP * ftp, const char * user, const char * password);
 int ftp_download(FTP * ftp, const char * path);
 
 /**
-* Enters the user in passive mode and connects the other socket to the server
+* Downloads the file in the Path path to the local file filename, like ftp_download
+* @arg ftp FTP Struct of the server
+* @arg path Path of the file
+* @arg filename Local file to create
+* @return Returns 0 in case of success, 1 in case of error
+*/
+int ftp_retrieve(FTP * ftp, const char * path, const char * filename);
+
+/**
+* Enters the user in passive mode and connects the other socket to the server. Tries EPSV first (needed
+* over IPv6), falls back to PASV for good if the server doesn't know it
 * @arg ftp FTP Struct of the server
 * @return Returns 0 in case of success, 1 in case of error
 */
 int ftp_pasv(FTP * ftp);
 
+/**
+* Reads the reply to PASV (or EPSV if ftp->epsv is 1) and connects the data socket, for when it was pipelined
+* with other commands
+* @arg ftp FTP Struct of the server
+* @return Returns 0 in case of success, 1 in case of error
+*/
+int ftp_pasv_reply(FTP * ftp);
+
+/**
+* Connects to the FTP server and logs in, a new session besides the one of the user
+* @arg ftp FTP Struct to fill
+* @arg ip IP of the FTP server
+* @arg user Name of the user used to log in
+* @arg password Password of the user used to log in
+* @return Returns 0 in case of success, 1 in case of error
+*/
+int ftp_session(FTP * ftp, const char * ip, const char * user, const char * password);
+
+/**
+* Downloads the file in the Path path split in segments, each one on its own session (REST + RETR) and
+* written with pwrite() into its slice of the file. The file is written as <name>.part and only renamed when
+* every segment succeeded, so a failed run leaves nothing behind. Falls back to ftp_download if the size is unknown or too small
+* @arg ftp FTP Struct of the server, logged in
+* @arg ip IP of the FTP server
+* @arg user Name of the user used to log in
+* @arg password Password of the user used to log in
+* @arg path Path of the file
+* @arg segments Number of segments (connections) to use
+* @return Returns 0 in case of success, 1 in case of error
+*/
+int ftp_download_segmented(FTP * ftp, const char * ip, const char * user, const char * password,
+    const char * path, unsigned int segments);
+
+/**
+* Gets the modification time of the file in the Path path
+* @arg ftp FTP Struct of the server
+* @arg path Path of the file
+* @arg mtime Modification time of the file
+* @return Returns 0 in case of success, 1 in case of error
+*/
+int ftp_mdtm(FTP * ftp, const char * path, time_t * mtime);
+
+/**
+* Lists a directory over the data connection, opened like in ftp_download and closed at the end
+* @arg ftp FTP Struct of the server
+* @arg command Listing command, "MLSD" or "LIST"
+* @arg path Path of the directory, NULL or empty for the current one
+* @arg listing NUL terminated listing, allocated by this function
+* @arg size Size of the listing
+* @return Returns 0 in case of success, the reply code if the server refused the command (500/502 if it doesn't
+* know it, 550 if the directory can't be listed), 1 in case of other errors
+*/
+int ftp_list(FTP * ftp, const char * command, const char * path, char ** listing, size_t * size);
+
 #endif
@@ -0,0 +1,196 @@
+#define _GNU_SOURCE       /* asprintf, strcasecmp, timegm */
+#include "mirror.h"
+#include <stdio.h>        /* printf */
+#include <stdlib.h>       /* free */
+#include <string.h>       /* strchr */
+#include <strings.h>      /* strncasecmp */
+#include <errno.h>        /* errno */
+#include <fcntl.h>        /* AT_FDCWD */
+#include <sys/stat.h>     /* stat / mkdir */
+
+/**
+* File or directory found in a listing
+*/
+typedef struct Entry {
+  const char * name;        /* Name inside the directory */
+  int is_dir;               /* 1 if directory, 0 if file */
+  long int size;            /* Size in bytes, -1 if unknown */
+  time_t mtime;             /* Modification time, -1 if unknown */
+} Entry;
+
+/**
+* Parses a "YYYYMMDDHHMMSS" UTC time
+* @arg text Time as sent by the server
+* @return Returns the time, -1 if it isn't valid
+*/
+static time_t parse_time(const char * text) {
+  struct tm time;
+
+  memset(&time, 0, sizeof(time));
+  if(sscanf(text, "%4d%2d%2d%2d%2d%2d", &time.tm_year, &time.tm_mon, &time.tm_mday,
+      &time.tm_hour, &time.tm_min, &time.tm_sec) != 6)
+    return -1;
+  time.tm_year -= 1900;
+  time.tm_mon -= 1;
+  return timegm(&time);
+}
+
+/**
+* Parses a MLSD line "fact=value;fact=value; name"
+* @arg line Line of the listing, changed in place
+* @arg entry Entry to fill
+* @return Returns 0 if it's a file or directory, 1 otherwise (current/parent directory, links, bad lines)
+*/
+static int parse_mlsd(char * line, Entry * entry) {
+  char * name = strchr(line, ' ');
+  char * fact, * next;
+
+  if(!name)
+    return 1;
+  *name++ = '\0';
+  entry->name = name;
+  entry->is_dir = -1;
+  entry->size = -1;
+  entry->mtime = -1;
+
+  for(fact = line; fact && *fact; fact = next) {
+    next = strchr(fact, ';');
+    if(next)
+      *next++ = '\0';
+    if(!strcasecmp(fact, "type=file"))
+      entry->is_dir = 0;
+    else if(!strcasecmp(fact, "type=dir"))
+      entry->is_dir = 1;
+    else if(!strncasecmp(fact, "size=", 5))
+      entry->size = strtol(fact + 5, NULL, 10);
+    else if(!strncasecmp(fact, "modify=", 7))
+      entry->mtime = parse_time(fact + 7);
+  }
+  return entry->is_dir == -1;
+}
+
+/**
+* Parses a Unix style LIST line "-rw-r--r-- 1 owner group size month day time name"
+* @arg line Line of the listing
+* @arg entry Entry to fill, the time is left unknown (LIST doesn't give it exactly)
+* @return Returns 0 if it's a file or directory, 1 otherwise (links, totals, "." and "..")
+*/
+static int parse_list(char * line, Entry * entry) {
+  char permissions[16];
+  int name = 0;
+
+  if(sscanf(line, "%15s %*s %*s %*s %ld %*s %*s %*s %n", permissions, &entry->size, &name) != 2 || !name)
+    return 1;
+  entry->name = line + name;
+  entry->mtime = -1;
+  if(permissions[0] == 'd')
+    entry->is_dir = 1;
+  else if(permissions[0] == '-')
+    entry->is_dir = 0;
+  else
+    return 1;
+  return !strcmp(entry->name, ".") || !strcmp(entry->name, "..");
+}
+
+/**
+* Downloads the file unless the local copy has the same size and modification time
+* @arg ftp FTP Struct of the server
+* @arg mirror Mirror state
+* @arg entry File found in the listing
+* @arg remote Path of the remote file
+* @arg local Path of the local file
+*/
+static void mirror_file(FTP * ftp, Mirror * mirror, Entry * entry, const char * remote, const char * local) {
+  struct timespec times[2];
+  struct stat info;
+  int resume, res;
+
+  mirror->files++;
+  if(entry->mtime == -1 && ftp_mdtm(ftp, remote, &entry->mtime))
+    entry->mtime = -1;
+
+  if(!stat(local, &info) && S_ISREG(info.st_mode) && info.st_size == entry->size && entry->mtime != -1
+      && info.st_mtime == entry->mtime)
+    return; /* Up to date */
+
+  fprintf(stderr, "%s\n", remote);
+  resume = ftp->resume;
+  ftp->resume = 0; /* A changed file can't be continued, it's downloaded again */
+  res = ftp_retrieve(ftp, remote, local);
+  ftp->resume = resume;
+  if(res) {
+    fprintf(stderr, "Error: mirror %s\n", remote);
+    mirror->failed++;
+    return;
+  }
+  mirror->downloaded++;
+  if(!stat(local, &info))
+    mirror->bytes += (long int) info.st_size;
+
+  /* Same time as the server, so the next sync knows it's up to date */
+  if(entry->mtime != -1) {
+    times[0].tv_sec = times[1].tv_sec = entry->mtime;
+    times[0].tv_nsec = times[1].tv_nsec = 0;
+    utimensat(AT_FDCWD, local, times, 0);
+  }
+}
+
+int mirror_tree(FTP * ftp, Mirror * mirror, const char * remote, const char * local) {
+  char * listing, * line, * save, * remote_path, * local_path;
+  size_t size;
+  Entry entry;
+  int res, mlsd = 0;
+
+  if(mkdir(local, 0755) < 0 && errno != EEXIST) {
+    fprintf(stderr, "Error: mkdir %s\n", local);
+    mirror->unlisted++;
+    return 1;
+  }
+
+  /* MLSD gives exact size and time, LIST is the fallback for older servers */
+  res = 1;
+  if(!mirror->list_only) {
+    res = ftp_list(ftp, "MLSD", remote, &listing, &size);
+    mlsd = !res;
+    if(res == 500 || res == 502) /* Command not recognized, a 550 is only about this directory */
+      mirror->list_only = 1;
+  }
+  if(res) {
+    if(ftp_list(ftp, "LIST", remote, &listing, &size)) {
+      fprintf(stderr, "Error: couldn't list %s\n", remote[0] ? remote : ".");
+      mirror->unlisted++;
+      return 1;
+    }
+  }
+
+  for(line = strtok_r(listing, "\r\n", &save); line; line = strtok_r(NULL, "\r\n", &save)) {
+    if(mlsd ? parse_mlsd(line, &entry) : parse_list(line, &entry))
+      continue;
+    if(!entry.name[0] || !strcmp(entry.name, ".") || !strcmp(entry.name, "..") || strchr(entry.name, '/')) {
+      fprintf(stderr, "Warning: skipping '%s', it would leave %s\n", entry.name, local);  /* Name comes from the server */
+      continue;
+    }
+
+    if(remote[0])
+      res = asprintf(&remote_path, "%s/%s", remote, entry.name);
+    else
+      res = asprintf(&remote_path, "%s", entry.name);
+    if(res < 0)
+      break;
+    if(asprintf(&local_path, "%s/%s", local, entry.name) < 0) {
+      free(remote_path);
+      break;
+    }
+
+    if(entry.is_dir)
+      mirror_tree(ftp, mirror, remote_path, local_path);
+    else
+      mirror_file(ftp, mirror, &entry, remote_path, local_path);
+
+    free(remote_path);
+    free(local_path);
+  }
+
+  free(listing);
+  return 0;
+}
@@ -0,0 +1,30 @@
+#ifndef MIRROR_H
+#define MIRROR_H
+
+#include "ftp.h"
+
+/**
+* State and results of a mirror
+*/
+typedef struct Mirror {
+  unsigned int files;       /* Files found in the server */
+  unsigned int downloaded;  /* Files that were new or changed and got downloaded */
+  unsigned int failed;      /* Files that failed */
+  unsigned int unlisted;    /* Directories that couldn't be created or listed */
+  long int bytes;           /* Bytes downloaded */
+  int list_only;            /* Server doesn't know MLSD (500/502), LIST is parsed instead */
+} Mirror;
+
+/**
+* Mirrors the remote directory tree into the local directory. Walks it with MLSD (or LIST if the
+* server doesn't support it) and only downloads the files whose size or modification time (MDTM)
+* differ from the local copy. Downloaded files get the remote modification time
+* @arg ftp FTP Struct of a logged in session
+* @arg mirror Mirror state, zeroed before the first call
+* @arg remote Path of the remote directory, empty for the current one
+* @arg local Path of the local directory, created if it doesn't exist
+* @return Returns 0 in case of success, 1 in case of error
+*/
+int mirror_tree(FTP * ftp, Mirror * mirror, const char * remote, const char * local);
+
+#endif
@@ -0,0 +1,193 @@
+#define _GNU_SOURCE       /* clock_gettime */
+#include "pool.h"
+#include <stdio.h>        /* printf */
+#include <stdlib.h>       /* malloc / qsort */
+#include <string.h>       /* strrchr */
+#include <pthread.h>      /* pthread_create */
+#include <time.h>         /* clock_gettime */
+#include <sys/stat.h>     /* stat */
+
+#define MEGABYTE (1024.0 * 1024.0)
+
+/**
+* Queue of files shared by the sessions of the pool
+*/
+typedef struct Pool {
+  const char * ip, * user, * password;  /* Where and how to open the sessions */
+  size_t buffer_size;       /* Settings of ftp_download */
+  int zero_copy;
+  int resume;
+  PoolFile * files;         /* Files sorted largest first */
+  size_t count;             /* Number of files */
+  size_t next;              /* Next file to dispatch */
+  pthread_mutex_t lock;     /* Protects next */
+} Pool;
+
+/**
+* Session of the pool and what it transferred
+*/
+typedef struct Worker {
+  Pool * pool;
+  unsigned int id;
+  unsigned int files;       /* Files downloaded */
+  long int bytes;           /* Bytes downloaded */
+  double seconds;           /* Time spent downloading */
+} Worker;
+
+/**
+* Seconds since an arbitrary point, for measuring intervals
+*/
+static double now(void) {
+  struct timespec time;
+
+  clock_gettime(CLOCK_MONOTONIC, &time);
+  return (double) time.tv_sec + (double) time.tv_nsec / 1e9;
+}
+
+/**
+* Name of the local file ftp_download writes the path to
+*/
+static const char * local_name(const char * path) {
+  const char * offset = strrchr(path, '/');
+
+  return offset ? offset + 1 : path;
+}
+
+/**
+* Orders the files largest first, the ones with unknown size go last
+*/
+static int compare_size(const void * a, const void * b) {
+  long int size_a = ((const PoolFile *) a)->size, size_b = ((const PoolFile *) b)->size;
+
+  return (size_a < size_b) - (size_a > size_b);
+}
+
+/**
+* Session of the pool: takes the next file of the queue until it's empty
+* @arg arg Worker of the session
+* @return Returns NULL, the results are left in the worker
+*/
+static void * pool_worker(void * arg) {
+  Worker * worker = (Worker *) arg;
+  Pool * pool = worker->pool;
+  struct stat info;
+  double start;
+  size_t i;
+  FTP ftp;
+
+  if(ftp_session(&ftp, pool->ip, pool->user, pool->password)) {
+    fprintf(stderr, "Error: session %u couldn't log in\n", worker->id);
+    return NULL;
+  }
+  ftp.buffer_size = pool->buffer_size;
+  ftp.zero_copy = pool->zero_copy;
+  ftp.resume = pool->resume;
+
+  while(1) {
+    pthread_mutex_lock(&pool->lock);
+    i = pool->next++;
+    pthread_mutex_unlock(&pool->lock);
+    if(i >= pool->count)
+      break;
+
+    start = now();
+    if(ftp_download(&ftp, pool->files[i].path)) {
+      fprintf(stderr, "Error: session %u failed %s\n", worker->id, pool->files[i].path);
+      continue;
+    }
+    worker->seconds += now() - start;
+    worker->files++;
+
+    /* The local file tells how many bytes really arrived */
+    if(!stat(local_name(pool->files[i].path), &info))
+      worker->bytes += (long int) info.st_size;
+  }
+
+  ftp_disconnect(&ftp);
+  return NULL;
+}
+
+unsigned int pool_download(FTP * ftp, const char * ip, const char * user, const char * password,
+    char * const * paths, size_t count, unsigned int sessions) {
+  unsigned int i, downloaded = 0;
+  pthread_t * threads;
+  Worker * workers;
+  long int bytes = 0;
+  double start, seconds;
+  Pool pool;
+  size_t j, k;
+
+  pool.ip = ip;
+  pool.user = user;
+  pool.password = password;
+  pool.buffer_size = ftp->buffer_size;
+  pool.zero_copy = ftp->zero_copy;
+  pool.resume = ftp->resume;
+  pool.count = 0;
+  pool.next = 0;
+
+  /* Largest first, so the big files don't start last and set the total time alone */
+  pool.files = (PoolFile *) malloc(count * sizeof(PoolFile));
+  if(!pool.files) {
+    fprintf(stderr, "Error: malloc\n");
+    return (unsigned int) count;
+  }
+  for(j = 0; j < count; j++) {
+    /* Every file goes to the current directory by its last name, two sessions can't write the same one */
+    for(k = 0; k < pool.count; k++)
+      if(!strcmp(local_name(pool.files[k].path), local_name(paths[j])))
+        break;
+    if(k < pool.count) {
+      fprintf(stderr, "Error: %s would overwrite %s, both are saved as %s\n", paths[j], pool.files[k].path,
+          local_name(paths[j]));
+      continue;
+    }
+    pool.files[pool.count].path = paths[j];
+    if(ftp_size(ftp, paths[j], &pool.files[pool.count].size))
+      pool.files[pool.count].size = -1;
+    pool.count++;
+  }
+  qsort(pool.files, pool.count, sizeof(PoolFile), compare_size);
+
+  if(sessions > pool.count)
+    sessions = (unsigned int) pool.count;
+  threads = (pthread_t *) malloc(sessions * sizeof(pthread_t));
+  workers = (Worker *) calloc(sessions, sizeof(Worker));
+  if(!threads || !workers) {
+    fprintf(stderr, "Error: malloc\n");
+    free(pool.files);
+    free(threads);
+    free(workers);
+    return (unsigned int) count;
+  }
+  pthread_mutex_init(&pool.lock, NULL);
+
+  start = now();
+  for(i = 0; i < sessions; i++) {
+    workers[i].pool = &pool;
+    workers[i].id = i;
+    if(pthread_create(&threads[i], NULL, pool_worker, &workers[i])) {
+      fprintf(stderr, "Error: pthread_create\n");
+      sessions = i;
+      break;
+    }
+  }
+
+  for(i = 0; i < sessions; i++) {
+    pthread_join(threads[i], NULL);
+    fprintf(stderr, "Session %u: %u files, %.2f MB in %.2f s (%.2f MB/s)\n", i, workers[i].files,
+        (double) workers[i].bytes / MEGABYTE, workers[i].seconds,
+        workers[i].seconds > 0 ? (double) workers[i].bytes / MEGABYTE / workers[i].seconds : 0.0);
+    downloaded += workers[i].files;
+    bytes += workers[i].bytes;
+  }
+  seconds = now() - start;
+  fprintf(stderr, "Total: %u of %lu files, %.2f MB in %.2f s (%.2f MB/s)\n", downloaded, (unsigned long) count,
+      (double) bytes / MEGABYTE, seconds, seconds > 0 ? (double) bytes / MEGABYTE / seconds : 0.0);
+
+  pthread_mutex_destroy(&pool.lock);
+  free(pool.files);
+  free(threads);
+  free(workers);
+  return (unsigned int) count - downloaded;
+}
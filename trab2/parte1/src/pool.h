@@ -0,0 +1,30 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include "ftp.h"
+
+/**
+* File queued in the pool
+*/
+typedef struct PoolFile {
+  const char * path;  /* Path of the file in the server */
+  long int size;      /* Size given by SIZE, -1 if unknown */
+} PoolFile;
+
+/**
+* Downloads the files in parallel over a pool of sessions logged in to the same server. The files are
+* dispatched largest first to whichever session is free, so the whole set takes about as long as the
+* largest file. Prints the bandwidth of each session and of the whole pool at the end
+* @arg ftp FTP Struct of a logged in session, used to get the sizes and as the settings of the pool
+* @arg ip IP of the FTP server
+* @arg user Name of the user used to log in
+* @arg password Password of the user used to log in
+* @arg paths Paths of the files
+* @arg count Number of paths
+* @arg sessions Number of sessions of the pool
+* @return Returns the number of files that failed
+*/
+unsigned int pool_download(FTP * ftp, const char * ip, const char * user, const char * password,
+    char * const * paths, size_t count, unsigned int sessions);
+
+#endif
@@ -4,10 +4,7 @@
 #include <stdlib.h>       /* malloc */
 #include <string.h>       /* strlen */
 #include <termios.h>      /* termios */
-#include <netdb.h>        /* gethostbyname */
-#include <arpa/inet.h>    /* inet_ntoa */
 
-#define h_addr h_addr_list[0]
 #define INPUT_SIZE 128    /* Size of buffers used */
 
 int url_getInput(const char * message, char ** input, size_t * size) {
@@ -20,8 +17,9 @@ int url_getInput(const char * message, char ** input, size_t * size) {
   }
 
   *size = strlen(temp) - 1;
-  *input = (char *) malloc(*size);
+  *input = (char *) malloc(*size + 1);
   strncpy(*input, temp, *size);
+  (*input)[*size] = '\0';
 
   return 0;
 }
@@ -47,8 +45,9 @@ int url_getPassword(char ** password, size_t * size) {
   }
 
   *size = strlen(temp) - 1;
-  *password = (char *) malloc(*size);
+  *password = (char *) malloc(*size + 1);
   strncpy(*password, temp, *size);
+  (*password)[*size] = '\0';
 
   if (tcsetattr(fileno(stdin), TCSANOW, &oldFlags) != 0) {
     fprintf(stderr, "Error: tcsetattr\n");  /* Failed to restore configuration */
@@ -58,21 +57,6 @@ int url_getPassword(char ** password, size_t * size) {
   return 0;
 }
 
-int url_getIP(const char * host, char * ip) {
-  struct hostent * h;
-
-  if (( h = gethostbyname(host) ) == NULL) {
-    fprintf(stderr, "Error: gethostbyname\n"); /* Failed to get IP */
-    return 1;
-  }
-
-  strcpy(ip, inet_ntoa( *( (struct in_addr *)h->h_addr)));
-  printf("Host name  : %s\n", h->h_name);
-  printf("IP Address : %s\n", ip);
-
-  return 0;
-}
-
 int url_parser(const char * path, URL * url) {
   if (strncmp(path, "ftp://", 6)) { /* Paths must begin with "ftp://" to be valid */
     fprintf(stderr, "Error: FTP URL must start with \"ftp://\"\n");
@@ -97,12 +81,14 @@ int url_parser(const char * path, URL * url) {
           url->userSize = strlen(path) - strlen(temp) - offset - 1;
           url->user = (char *) malloc( url->userSize+1);
           strncpy(url->user, path + offset + 1, url->userSize);
+          url->user[url->userSize] = '\0';
           offset += url->userSize + 2;  /* offset becomes the start of password */
         }
 
         url->passwordSize = offsetBracket - offset - 1;
         url->password = (char *) malloc( url->passwordSize+1);
         strncpy(url->password, path + offset, url->passwordSize);
+        url->password[url->passwordSize] = '\0';
         offset = offsetBracket + 1; /* offset becomes the start of the host */
         break;
       }
@@ -116,6 +102,7 @@ int url_parser(const char * path, URL * url) {
     if(url->pathSize > 0) {
       url->path = (char *) malloc( url->pathSize+1);
       strncpy(url->path, path + offsetPath, url->pathSize);
+      url->path[url->pathSize] = '\0';
     }
   }
 
@@ -127,6 +114,7 @@ int url_parser(const char * path, URL * url) {
   if(url->hostSize > 0) {
     url->host = (char *) malloc( url->hostSize * sizeof(char)+1);
     strncpy(url->host, path + offset, url->hostSize);
+    url->host[url->hostSize] = '\0';
   }
 
   return 0;
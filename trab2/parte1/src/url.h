@@ -39,14 +39,6 @@ int url_getPassword(char ** password, size_t * size);
 */
 int url_getInput(const char * message, char ** input, size_t * size);
 
-/**
-* Gets the IP of the host
-* @arg host Name of host which IP the function gets
-* @arg ip Host's IP
-* @return Returns 0 in case of success, 1 in case of error
-*/
-int url_getIP(const char * host, char * ip);
-
 /**
 * Deallocates URL fields
 * @arg url URL struct to clear